@@ -0,0 +1,38 @@
+###
+### Copyright 2018 Oliver Giles
+###
+### This file is part of Laminar
+###
+### Laminar is free software: you can redistribute it and/or modify
+### it under the terms of the GNU General Public License as published by
+### the Free Software Foundation, either version 3 of the License, or
+### (at your option) any later version.
+###
+### Laminar is distributed in the hope that it will be useful,
+### but WITHOUT ANY WARRANTY; without even the implied warranty of
+### MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+### GNU General Public License for more details.
+###
+### You should have received a copy of the GNU General Public License
+### along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+###
+
+# Writes a copy of the HTML file INPUT to OUTPUT in which each quoted
+# reference to one of the URLs in ASSETS has a "?v=" query appended which
+# is derived from the content of the file it is served from. ASSETS is a
+# list of url=path pairs. The server allows fingerprinted URLs to be
+# cached indefinitely, while the HTML itself is always revalidated.
+# Usage:
+#   cmake -DINPUT=... -DOUTPUT=... -DASSETS="/js/a.js=/path/a.js;..." -P fingerprint.cmake
+
+file(READ ${INPUT} CONTENT)
+foreach(ASSET ${ASSETS})
+    string(FIND ${ASSET} "=" SPLIT)
+    string(SUBSTRING ${ASSET} 0 ${SPLIT} URL)
+    math(EXPR SPLIT "${SPLIT} + 1")
+    string(SUBSTRING ${ASSET} ${SPLIT} -1 FILE)
+    file(SHA256 ${FILE} HASH)
+    string(SUBSTRING ${HASH} 0 16 HASH)
+    string(REPLACE "\"${URL}\"" "\"${URL}?v=${HASH}\"" CONTENT "${CONTENT}")
+endforeach()
+file(WRITE ${OUTPUT} "${CONTENT}")
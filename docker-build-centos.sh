@@ -63,6 +63,8 @@ make
 
 %files
 %{_bindir}/laminarc
+%{_bindir}/laminar-supervisor
+%{_bindir}/laminar-agent
 %{_bindir}/laminard
 %{_unitdir}/laminar.service
 %config(noreplace) %{_sysconfdir}/laminar.conf
@@ -0,0 +1,284 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "laminar.capnp.h"
+#include "log.h"
+#include "node.h"
+#include "run.h"
+
+#include <capnp/rpc-twoparty.h>
+#include <kj/async-io.h>
+#include <kj/async-unix.h>
+
+#include <boost/filesystem.hpp>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+// laminar-agent registers with laminard as a node and executes the runs
+// assigned to it on this host. It is configured by these environment
+// variables:
+//   LAMINAR_HOST             address of laminard's RPC interface
+//   LAMINAR_AGENT_NAME       name of the node, default the host name
+//   LAMINAR_AGENT_EXECUTORS  number of executors, default 6
+//   LAMINAR_AGENT_TAGS       comma-separated tags of the node
+//   LAMINAR_AGENT_HOME       directory for workspaces, run directories
+//                            and archives, default /var/lib/laminar-agent
+
+// Number of chunks of output which may be waiting for laminard to answer.
+// Reading from a script pauses beyond this, so memory use is bounded if
+// laminard or the network cannot keep up with the scripts' output
+#define OUTPUT_WINDOW 8
+#define OUTPUT_CHUNK_SIZE 16384
+
+// laminard going away is only noticed by calls to it failing
+#define PING_INTERVAL_SECONDS 30
+
+namespace {
+
+RunState toRunState(LaminarCi::JobResult result) {
+    switch(result) {
+    case LaminarCi::JobResult::SUCCESS: return RunState::SUCCESS;
+    case LaminarCi::JobResult::FAILED:  return RunState::FAILED;
+    case LaminarCi::JobResult::ABORTED: return RunState::ABORTED;
+    default:
+        return RunState::UNKNOWN;
+    }
+}
+
+// A run being executed on behalf of laminard
+struct ActiveRun {
+    ActiveRun(LaminarCi::RunOutput::Client output) :
+        output(kj::mv(output))
+    {}
+
+    Run run;
+    LaminarCi::RunOutput::Client output;
+    std::string scriptDir;
+    // index of the script being executed
+    uint32_t script = 0;
+    kj::Own<kj::AsyncInputStream> stream;
+    std::deque<kj::Promise<void>> inFlight;
+    char buffer[OUTPUT_CHUNK_SIZE];
+};
+
+class AgentImpl : public LaminarCi::Agent::Server {
+public:
+    AgentImpl(kj::AsyncIoContext& io, std::string name, std::string home) :
+        io(io),
+        node(new Node),
+        home(home)
+    {
+        node->name = name;
+    }
+
+    kj::Promise<void> execute(ExecuteContext context) override {
+        auto params = context.getParams();
+        std::shared_ptr<ActiveRun> r = std::make_shared<ActiveRun>(params.getOutput());
+        Run& run = r->run;
+        run.name = params.getJobName();
+        run.build = params.getBuildNum();
+        run.lastResult = toRunState(params.getLastResult());
+        run.laminarHome = home;
+        run.node = node;
+
+        // the same layout as $LAMINAR_HOME on laminard
+        boost::system::error_code err;
+        fs::path jobDir = fs::path(home)/"run"/run.name;
+        fs::path ws = jobDir/"workspace";
+        fs::path rd = jobDir/std::to_string(run.build);
+        bool newWorkspace = !fs::exists(ws);
+        fs::create_directories(ws, err);
+        fs::remove_all(rd, err);
+        fs::create_directories(rd, err);
+        fs::create_directories(fs::path(home)/"archive"/run.name/std::to_string(run.build), err);
+        run.runDir = rd.string();
+        r->scriptDir = (jobDir/(std::to_string(run.build) + ".scripts")).string();
+        fs::create_directories(r->scriptDir, err);
+
+        uint32_t i = 0;
+        for(auto script : params.getScripts()) {
+            if(script.getInit() && !newWorkspace)
+                continue;
+            std::string path = r->scriptDir + "/" + std::to_string(i++) + "-" + script.getName().cStr();
+            auto content = script.getContent();
+            std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char*>(content.begin()), content.size());
+            chmod(path.c_str(), 0755);
+            run.addScript(path, script.getInit() ? ws.string() : rd.string(), script.getInit());
+        }
+        for(auto p : params.getEnv())
+            run.setEnv(p.getName(), p.getValue());
+        for(auto p : params.getParams())
+            run.params[p.getName()] = p.getValue();
+
+        LLOG(INFO, "Executing run", run.name, run.build);
+        runs[std::make_pair(run.name, run.build)] = r;
+        return step(r).then([this, r]{
+            LLOG(INFO, "Run completed", r->run.name, r->run.build, to_string(r->run.result));
+            runs.erase(std::make_pair(r->run.name, r->run.build));
+            boost::system::error_code err;
+            fs::remove_all(r->run.runDir, err);
+            fs::remove_all(r->scriptDir, err);
+        });
+    }
+
+    kj::Promise<void> abort(AbortContext context) override {
+        auto it = runs.find(std::make_pair(std::string(context.getParams().getJobName()), context.getParams().getBuildNum()));
+        if(it != runs.end())
+            it->second->run.abort();
+        return kj::READY_NOW;
+    }
+
+    void abortAll() {
+        for(auto& it : runs)
+            it.second->run.abort();
+    }
+
+private:
+    kj::Promise<void> step(std::shared_ptr<ActiveRun> r) {
+        if(r->run.step())
+            return kj::READY_NOW;
+
+        kj::Promise<int> exited = io.unixEventPort.onChildExit(r->run.current_pid);
+        r->stream = io.lowLevelProvider->wrapInputFd(r->run.output_fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+        return pump(r).then([p = kj::mv(exited)]() mutable {
+            return kj::mv(p);
+        }).then([this, r](int status){
+            r->run.reaped(status);
+            // sent after all of the script's output, since calls on one
+            // capability are delivered in order
+            auto req = r->output.statusRequest();
+            req.setScript(r->script++);
+            req.setStatus(status);
+            return req.send().then([this, r](capnp::Response<LaminarCi::RunOutput::StatusResults>){
+                return step(r);
+            });
+        });
+    }
+
+    // Sends the output of the current script to laminard until it closes
+    kj::Promise<void> pump(std::shared_ptr<ActiveRun> r) {
+        return r->stream->tryRead(r->buffer, 1, sizeof(r->buffer)).then([this, r](size_t n) -> kj::Promise<void> {
+            if(n == 0)
+                return drain(r);
+            auto req = r->output.writeRequest();
+            req.setData(kj::arrayPtr(reinterpret_cast<const kj::byte*>(r->buffer), n));
+            r->inFlight.push_back(req.send().ignoreResult());
+            if(r->inFlight.size() < OUTPUT_WINDOW)
+                return pump(r);
+            kj::Promise<void> oldest = kj::mv(r->inFlight.front());
+            r->inFlight.pop_front();
+            return oldest.then([this, r]{
+                return pump(r);
+            });
+        });
+    }
+
+    // waits for all output to have been received by laminard
+    kj::Promise<void> drain(std::shared_ptr<ActiveRun> r) {
+        if(r->inFlight.empty()) {
+            r->stream = nullptr;
+            return kj::READY_NOW;
+        }
+        kj::Promise<void> oldest = kj::mv(r->inFlight.front());
+        r->inFlight.pop_front();
+        return oldest.then([this, r]{
+            return drain(r);
+        });
+    }
+
+    kj::AsyncIoContext& io;
+    std::shared_ptr<Node> node;
+    std::string home;
+    std::map<std::pair<std::string, uint>, std::shared_ptr<ActiveRun>> runs;
+};
+
+kj::Promise<void> keepAlive(kj::Timer& timer, LaminarCi::AgentSession::Client& session) {
+    return timer.afterDelay(PING_INTERVAL_SECONDS * kj::SECONDS).then([&session]{
+        return session.pingRequest().send().ignoreResult();
+    }).then([&timer, &session]{
+        return keepAlive(timer, session);
+    });
+}
+
+}
+
+int main(int argc, char** argv) {
+    for(int i = 1; i < argc; ++i) {
+        if(strcmp(argv[i], "-v") == 0) {
+            kj::_::Debug::setLogLevel(kj::_::Debug::Severity::INFO);
+        }
+    }
+
+    const char* address = getenv("LAMINAR_HOST") ?: "unix-abstract:laminar";
+    // so that laminarc can be used from scripts
+    setenv("LAMINAR_HOST", address, false);
+    char hostname[256] = {0};
+    gethostname(hostname, sizeof(hostname) - 1);
+    std::string name = getenv("LAMINAR_AGENT_NAME") ?: hostname;
+    int executors = atoi(getenv("LAMINAR_AGENT_EXECUTORS") ?: "6");
+    std::vector<std::string> tags;
+    std::istringstream iss(getenv("LAMINAR_AGENT_TAGS") ?: "");
+    for(std::string tag; std::getline(iss, tag, ',');)
+        tags.push_back(tag);
+    std::string home = getenv("LAMINAR_AGENT_HOME") ?: "/var/lib/laminar-agent";
+
+    kj::UnixEventPort::captureChildExit();
+    kj::AsyncIoContext io = kj::setupAsyncIo();
+
+    try {
+        kj::Own<kj::AsyncIoStream> stream = io.provider->getNetwork().parseAddress(address)
+                .then([](kj::Own<kj::NetworkAddress>&& addr){
+            return addr->connect();
+        }).wait(io.waitScope);
+        capnp::TwoPartyClient rpc(*stream);
+        LaminarCi::Client laminar = rpc.bootstrap().castAs<LaminarCi>();
+
+        kj::Own<AgentImpl> impl = kj::heap<AgentImpl>(io, name, home);
+        AgentImpl& agent = *impl;
+        // keeps the agent alive even if laminard releases it
+        LaminarCi::Agent::Client agentClient(kj::mv(impl));
+
+        auto req = laminar.registerAgentRequest();
+        req.setName(name);
+        req.setExecutors(executors);
+        auto tagList = req.initTags(tags.size());
+        for(size_t i = 0; i < tags.size(); ++i)
+            tagList.set(i, tags[i]);
+        req.setAgent(agentClient);
+        LaminarCi::AgentSession::Client session = req.send().wait(io.waitScope).getSession();
+        LLOG(INFO, "Registered agent", name, executors);
+
+        try {
+            keepAlive(io.provider->getTimer(), session).wait(io.waitScope);
+        } catch(kj::Exception& e) {
+            // scripts of runs which can no longer be reported are stopped
+            agent.abortAll();
+            throw;
+        }
+    } catch(kj::Exception& e) {
+        fprintf(stderr, "laminar-agent: %s\n", e.getDescription().cStr());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "cgroup.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+
+// time to wait in Cgroup::remove for killed processes to exit
+#define CGROUP_REMOVE_TIMEOUT_MS 500
+
+namespace {
+
+bool writeFile(const std::string& path, const std::string& value) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if(fd == -1)
+        return false;
+    bool ok = write(fd, value.data(), value.size()) == ssize_t(value.size());
+    close(fd);
+    return ok;
+}
+
+}
+
+Cgroup::Cgroup() :
+    fd(-1),
+    procs(-1)
+{
+}
+
+Cgroup::~Cgroup() {
+    if(fd != -1)
+        close(fd);
+    if(procs != -1)
+        close(procs);
+}
+
+bool Cgroup::setup(std::string parent) {
+    if(mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+        LLOG(ERROR, "Could not create cgroup", parent, strerror(errno));
+        return false;
+    }
+    std::string control = parent + "/cgroup.subtree_control";
+    // Each controller is enabled separately so that a missing memory
+    // controller does not prevent CPU weights from working
+    for(const char* controller : {"+cpu", "+memory"}) {
+        if(writeFile(control, controller))
+            continue;
+        if(errno == EBUSY) {
+            // parent contains processes, presumably laminard
+            std::string self = parent + "/laminard";
+            mkdir(self.c_str(), 0755);
+            if(writeFile(self + "/cgroup.procs", "0") && writeFile(control, controller))
+                continue;
+        }
+        LLOG(WARNING, "Could not enable cgroup controller", parent, controller, strerror(errno));
+    }
+    return true;
+}
+
+bool Cgroup::create(std::string path) {
+    if(mkdir(path.c_str(), 0755) != 0)
+        return false;
+    dir = path;
+    fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    procs = open((dir + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    return fd != -1 && procs != -1;
+}
+
+bool Cgroup::setCpuWeight(int weight) {
+    return writeFile(dir + "/cpu.weight", std::to_string(weight));
+}
+
+bool Cgroup::setMemoryMax(std::string limit) {
+    return writeFile(dir + "/memory.max", limit);
+}
+
+bool Cgroup::kill() {
+    if(dir.empty())
+        return false;
+    if(writeFile(dir + "/cgroup.kill", "1"))
+        return true;
+    // cgroup.kill requires Linux 5.14. Otherwise the processes have to
+    // be signalled individually, which may miss any forked concurrently
+    std::ifstream in(dir + "/cgroup.procs");
+    if(!in)
+        return false;
+    pid_t pid;
+    while(in >> pid)
+        ::kill(pid, SIGKILL);
+    return true;
+}
+
+Cgroup::Usage Cgroup::usage() const {
+    Usage u;
+    std::ifstream stat(dir + "/cpu.stat");
+    std::string key;
+    long value;
+    while(stat >> key >> value) {
+        if(key == "user_usec")
+            u.userUsec = value;
+        else if(key == "system_usec")
+            u.systemUsec = value;
+    }
+    // memory.peak requires Linux 5.19 and the memory controller
+    std::ifstream peak(dir + "/memory.peak");
+    peak >> u.memoryPeak;
+    return u;
+}
+
+bool Cgroup::remove() {
+    if(dir.empty())
+        return true;
+    // a cgroup can only be removed once all its processes have exited
+    for(int ms = 0; rmdir(dir.c_str()) != 0; ms += 10) {
+        if(errno != EBUSY || ms >= CGROUP_REMOVE_TIMEOUT_MS) {
+            LLOG(WARNING, "Could not remove cgroup", dir, strerror(errno));
+            return false;
+        }
+        usleep(10000);
+    }
+    dir.clear();
+    return true;
+}
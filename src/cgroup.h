@@ -0,0 +1,85 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_CGROUP_H_
+#define LAMINAR_CGROUP_H_
+
+#include <string>
+
+// A cgroup (v2) containing all the processes of one run, including those
+// which left the run's process group, so that they can be killed and
+// the resources they used accounted for.
+class Cgroup {
+public:
+    struct Usage {
+        long userUsec = 0;
+        long systemUsec = 0;
+        // bytes, or 0 if the memory controller is not available
+        long memoryPeak = 0;
+    };
+
+    Cgroup();
+    ~Cgroup();
+
+    Cgroup(const Cgroup&) = delete;
+    Cgroup& operator=(const Cgroup&) = delete;
+
+    // Prepares the delegated cgroup parent to contain the cgroups of runs
+    // by enabling the cpu and memory controllers for its children. If
+    // laminard itself is a member of parent, it first moves into a child
+    // named "laminard", since a cgroup with enabled controllers may not
+    // contain processes itself. Returns false on failure.
+    static bool setup(std::string parent);
+
+    // Creates a new cgroup at path. Returns false on failure
+    bool create(std::string path);
+
+    // relative share of CPU time, between 1 and 10000 (default 100)
+    bool setCpuWeight(int weight);
+
+    // Limits memory use to the given number of bytes, which may have a
+    // K, M or G suffix
+    bool setMemoryMax(std::string limit);
+
+    // Descriptor of the cgroup directory, with which a process can be
+    // created directly in the cgroup by clone3(CLONE_INTO_CGROUP)
+    int dirFd() const { return fd; }
+
+    // Descriptor of the cgroup.procs file. A process joins the cgroup by
+    // writing "0" to it
+    int procsFd() const { return procs; }
+
+    // Kills all processes in the cgroup with SIGKILL
+    bool kill();
+
+    // resources used by all processes of the cgroup so far
+    Usage usage() const;
+
+    // Removes the cgroup, waiting briefly for processes which have been
+    // killed to exit. Returns false if it could not be removed.
+    bool remove();
+
+    const std::string& path() const { return dir; }
+
+private:
+    std::string dir;
+    int fd;
+    int procs;
+};
+
+#endif // LAMINAR_CGROUP_H_
@@ -21,6 +21,8 @@
 #include <capnp/ez-rpc.h>
 #include <kj/vector.h>
 
+#include <vector>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -41,9 +43,11 @@ static int setParams(int argc, char** argv, T& request) {
     char* job = getenv("JOB");
     char* num = getenv("RUN");
     char* reason = getenv("LAMINAR_REASON");
+    char* priority = getenv("LAMINAR_PRIORITY");
 
     if(job && num) n+=2;
     else if(reason) n++;
+    if(priority) n++;
 
     if(n == 0) return argsConsumed;
 
@@ -66,10 +70,86 @@ static int setParams(int argc, char** argv, T& request) {
         params[argsConsumed].setName("=reason");
         params[argsConsumed].setValue(reason);
     }
+    if(priority) {
+        params[n-1].setName("=priority");
+        params[n-1].setValue(priority);
+    }
 
     return argsConsumed;
 }
 
+// Returns the indices in argv of the job names in a list of the form
+// job [param=value...] job [param=value...]...
+static std::vector<int> jobIndices(int argc, char** argv, int first) {
+    std::vector<int> jobs;
+    for(int i = first; i < argc;) {
+        jobs.push_back(i++);
+        while(i < argc && strchr(argv[i], '=') != NULL)
+            i++;
+    }
+    return jobs;
+}
+
+// Fills the jobs of a batch request from the command line. Returns the
+// indices in argv of the job names
+template<typename T>
+static std::vector<int> setJobs(int argc, char** argv, T& request) {
+    std::vector<int> indices = jobIndices(argc, argv, 2);
+    auto jobs = request.initJobs(indices.size());
+    for(size_t i = 0; i < indices.size(); ++i) {
+        jobs[i].setJobName(argv[indices[i]]);
+        setParams(argc - indices[i] - 1, &argv[indices[i] + 1], jobs[i]);
+    }
+    return indices;
+}
+
+// Prints runs as they complete
+class PrintRuns : public LaminarCi::RunListener::Server {
+public:
+    PrintRuns(bool printStarted) : printStarted(printStarted) {}
+
+    kj::Promise<void> started(StartedContext context) override {
+        if(printStarted) {
+            printf("started %s:%d\n", context.getParams().getJobName().cStr(), context.getParams().getBuildNum());
+            fflush(stdout);
+        }
+        return kj::READY_NOW;
+    }
+    kj::Promise<void> completed(CompletedContext context) override {
+        auto run = context.getParams().getRun();
+        if(printStarted)
+            printf("completed %s:%d %s\n", run.getJobName().cStr(), run.getBuildNum(), resultName(run.getResult()));
+        else
+            printf("%s:%d\n", run.getJobName().cStr(), run.getBuildNum());
+        fflush(stdout);
+        return kj::READY_NOW;
+    }
+
+    static const char* resultName(LaminarCi::JobResult result) {
+        switch(result) {
+        case LaminarCi::JobResult::SUCCESS: return "success";
+        case LaminarCi::JobResult::FAILED:  return "failed";
+        case LaminarCi::JobResult::ABORTED: return "aborted";
+        default:
+            return "unknown";
+        }
+    }
+
+private:
+    bool printStarted;
+};
+
+// Copies a run's log to stdout
+class PrintLog : public LaminarCi::LogOutput::Server {
+public:
+    kj::Promise<void> write(WriteContext context) override {
+        auto data = context.getParams().getData();
+        fwrite(data.begin(), 1, data.size(), stdout);
+        fflush(stdout);
+        return kj::READY_NOW;
+    }
+};
+
 int main(int argc, char** argv) {
     if(argc < 2) {
         fprintf(stderr, "Usage: %s <command> [parameters...]\n", argv[0]);
@@ -89,21 +169,14 @@ int main(int argc, char** argv) {
             fprintf(stderr, "Usage %s queue <jobName>\n", argv[0]);
             return EINVAL;
         }
-        kj::Vector<capnp::RemotePromise<LaminarCi::QueueResults>> promises;
-        int jobNameIndex = 2;
-        // make a request for each job specified on the commandline
-        do {
-            auto req = laminar.queueRequest();
-            req.setJobName(argv[jobNameIndex]);
-            int n = setParams(argc - jobNameIndex - 1, &argv[jobNameIndex + 1], req);
-            promises.add(req.send());
-            jobNameIndex += n + 1;
-        } while(jobNameIndex < argc);
-        // pend on the promises
-        for(auto& p : promises) {
-            if(p.wait(waitScope).getResult() != LaminarCi::MethodResult::SUCCESS) {
-                fprintf(stderr, "Failed to queue job '%s'\n", argv[2]);
-                return ENOENT;
+        // all jobs are queued with one request
+        auto req = laminar.queueBatchRequest();
+        std::vector<int> jobs = setJobs(argc, argv, req);
+        auto results = req.send().wait(waitScope);
+        for(size_t i = 0; i < jobs.size(); ++i) {
+            if(results.getResults()[i] != LaminarCi::MethodResult::SUCCESS) {
+                fprintf(stderr, "Failed to queue job '%s'\n", argv[jobs[i]]);
+                ret = ENOENT;
             }
         }
     } else if(strcmp(argv[1], "start") == 0 || strcmp(argv[1], "trigger") == 0) {
@@ -139,25 +212,17 @@ int main(int argc, char** argv) {
             fprintf(stderr, "Usage %s run <jobName>\n", argv[0]);
             return EINVAL;
         }
-        struct: public kj::TaskSet::ErrorHandler {
-            void taskFailed(kj::Exception&&) override {}
-        } ignoreFailed;
-        kj::TaskSet ts(ignoreFailed);
-        int jobNameIndex = 2;
-        // make a request for each job specified on the commandline
-        do {
-            auto req = laminar.runRequest();
-            req.setJobName(argv[jobNameIndex]);
-            int n = setParams(argc - jobNameIndex - 1, &argv[jobNameIndex + 1], req);
-            ts.add(req.send().then([&ret,argv,jobNameIndex](capnp::Response<LaminarCi::RunResults> resp){
-                printf("%s:%d\n", argv[jobNameIndex], resp.getBuildNum());
-                if(resp.getResult() != LaminarCi::JobResult::SUCCESS) {
-                    ret = EFAILED;
-                }
-            }));
-            jobNameIndex += n + 1;
-        } while(jobNameIndex < argc);
-        ts.onEmpty().wait(waitScope);
+        // runs are printed as they complete
+        auto req = laminar.runBatchRequest();
+        setJobs(argc, argv, req);
+        req.setListener(kj::heap<PrintRuns>(false));
+        auto resp = req.send().wait(waitScope);
+        for(auto r : resp.getResults()) {
+            if(r.getBuildNum() == 0)
+                fprintf(stderr, "Failed to queue job '%s'\n", r.getJobName().cStr());
+            if(r.getResult() != LaminarCi::JobResult::SUCCESS)
+                ret = EFAILED;
+        }
     } else if(strcmp(argv[1], "set") == 0) {
         if(argc < 3) {
             fprintf(stderr, "Usage %s set param=value\n", argv[0]);
@@ -180,6 +245,24 @@ int main(int argc, char** argv) {
             fprintf(stderr, "Missing $JOB or $RUN or param is not in the format key=value\n");
             return EINVAL;
         }
+    } else if(strcmp(argv[1], "watch") == 0) {
+        auto req = laminar.watchRequest();
+        if(argc > 2)
+            req.setJobName(argv[2]);
+        req.setListener(kj::heap<PrintRuns>(true));
+        // runs until killed or disconnected
+        auto handle = req.send().wait(waitScope).getHandle();
+        kj::NEVER_DONE.wait(waitScope);
+    } else if(strcmp(argv[1], "tail") == 0) {
+        if(argc < 4) {
+            fprintf(stderr, "Usage %s tail <jobName> <buildNum>\n", argv[0]);
+            return EINVAL;
+        }
+        auto req = laminar.tailLogRequest();
+        req.setJobName(argv[2]);
+        req.setBuildNum(atoi(argv[3]));
+        req.setOutput(kj::heap<PrintLog>());
+        req.send().wait(waitScope);
     } else if(strcmp(argv[1], "lock") == 0) {
         auto req = laminar.lockRequest();
         req.setLockName(argv[2]);
@@ -17,6 +17,7 @@
 /// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
 ///
 #include "database.h"
+#include "metrics.h"
 
 #include <sqlite3.h>
 #include <string.h>
@@ -26,22 +27,78 @@ Database::Database(const char *path) {
 }
 
 Database::~Database() {
+    for(auto& it : cache)
+        sqlite3_finalize(it.second.stmt);
     sqlite3_close(hdl);
 }
 
+void Database::setBusyTimeout(int ms) {
+    sqlite3_busy_timeout(hdl, ms);
+}
+
+int Database::changes() const {
+    return sqlite3_changes(hdl);
+}
+
+Database::Statement Database::stmt(const char* q) {
+    auto it = cache.find(q);
+    if(it == cache.end()) {
+        sqlite3_stmt* stmt = nullptr;
+        // don't cache statements which failed to prepare
+        if(sqlite3_prepare_v2(hdl, q, -1, &stmt, nullptr) != SQLITE_OK || !stmt) {
+            sqlite3_finalize(stmt);
+            return Statement(hdl, q);
+        }
+        it = cache.emplace(q, CachedStatement{stmt, false}).first;
+    }
+    // The same query may be requested again while the cached statement
+    // is still held, for example from within a fetch callback. Give the
+    // second user a statement of its own.
+    if(it->second.inUse)
+        return Statement(hdl, q);
+    it->second.inUse = true;
+    return Statement(it->second.stmt, &it->second.inUse);
+}
+
 Database::Statement::Statement(sqlite3 *db, const char *query) :
-    stmt(nullptr)
+    stmt(nullptr),
+    inUse(nullptr),
+    stepTime(std::chrono::steady_clock::duration::zero())
 {
     sqlite3_prepare_v2(db, query, -1, &stmt, nullptr);
 }
 
+Database::Statement::Statement(sqlite3_stmt* cached, bool* inUse) :
+    stmt(cached),
+    inUse(inUse),
+    stepTime(std::chrono::steady_clock::duration::zero())
+{
+}
+
 Database::Statement::~Statement() {
-    sqlite3_finalize(stmt);
+    if(stepTime != std::chrono::steady_clock::duration::zero())
+        metrics.statement.observe(std::chrono::duration<double>(stepTime).count());
+    if(inUse) {
+        // bound strings are not copied by sqlite, so don't leave
+        // pointers to them in the statement
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        *inUse = false;
+    } else {
+        sqlite3_finalize(stmt);
+    }
 }
 
 
 bool Database::Statement::exec() {
-    return sqlite3_step(stmt) == SQLITE_DONE;
+    return step() == SQLITE_DONE;
+}
+
+int Database::Statement::step() {
+    auto start = std::chrono::steady_clock::now();
+    int rc = sqlite3_step(stmt);
+    stepTime += std::chrono::steady_clock::now() - start;
+    return rc;
 }
 
 void Database::Statement::bindValue(int i, int e) {
@@ -71,7 +128,9 @@ void Database::Statement::bindValue(int i, const std::string& e) {
 template<> std::string Database::Statement::fetchColumn(int col) {
     uint sz = static_cast<uint>(sqlite3_column_bytes(stmt, col)); // according to documentation will never be negative
     std::string res(sz, '\0');
-    memcpy(&res[0], sqlite3_column_text(stmt, col), sz);
+    // NULL columns have zero size but a null pointer
+    if(sz > 0)
+        memcpy(&res[0], sqlite3_column_text(stmt, col), sz);
     return res;
 }
 
@@ -97,5 +156,5 @@ template<> ulong Database::Statement::fetchColumn(int col) {
 }
 
 bool Database::Statement::row() {
-    return sqlite3_step(stmt) == SQLITE_ROW;
+    return step() == SQLITE_ROW;
 }
@@ -19,8 +19,10 @@
 #ifndef LAMINAR_DATABASE_H_
 #define LAMINAR_DATABASE_H_
 
+#include <chrono>
 #include <string>
 #include <functional>
+#include <unordered_map>
 
 struct sqlite3;
 struct sqlite3_stmt;
@@ -33,6 +35,8 @@ struct sqlite3_stmt;
 //          // function called for each retrieved row
 //          doSomething(result);
 //      });
+// Prepared statements are cached by query text and reused, so repeated
+// queries only pay for sqlite3_reset and rebinding.
 class Database {
 public:
     Database(const char* path);
@@ -51,11 +55,19 @@ private:
         struct typeindex<0, T, Args...> { typedef T type; };
 
     public:
+        // Prepares a statement owned by this object
         Statement(sqlite3* db, const char* query);
+        // Borrows a statement from the cache. It is reset and inUse is
+        // cleared when this object is destroyed
+        Statement(sqlite3_stmt* cached, bool* inUse);
         Statement(const Statement&) =delete;
         Statement(Statement&& other) {
             stmt = other.stmt;
+            inUse = other.inUse;
+            stepTime = other.stepTime;
             other.stmt = nullptr;
+            other.inUse = nullptr;
+            other.stepTime = std::chrono::steady_clock::duration::zero();
         }
         ~Statement();
 
@@ -106,6 +118,8 @@ private:
         friend struct FetchMarshaller;
 
         bool row();
+        // calls sqlite3_step, accounting for the time taken
+        int step();
 
         template<typename T, typename...Args>
         Statement& bindRecursive(int i, const T& v, const Args&...args) {
@@ -131,17 +145,34 @@ private:
         T fetchColumn(int col);
 
         sqlite3_stmt* stmt;
+        // null if the statement is owned rather than cached
+        bool* inUse;
+        // total time spent in sqlite3_step, reported to the metrics when
+        // the statement is released
+        std::chrono::steady_clock::duration stepTime;
     };
 
 public:
-    Statement stmt(const char* q) {
-        return Statement(hdl, q);
-    }
-    // shorthand
+    Statement stmt(const char* q);
+    // shorthand for one-off statements such as schema changes, which
+    // are not cached
     bool exec(const char* q) { return Statement(hdl, q).exec(); }
+    // Makes statements wait up to ms milliseconds for a lock held by
+    // another connection instead of failing immediately. Not set by
+    // default, so that a connection used from the event loop never blocks
+    void setBusyTimeout(int ms);
+    // number of rows changed by the most recently completed statement
+    int changes() const;
 private:
 
     sqlite3* hdl;
+
+    struct CachedStatement {
+        sqlite3_stmt* stmt;
+        // set while a Statement is borrowing stmt
+        bool inUse;
+    };
+    std::unordered_map<std::string, CachedStatement> cache;
 };
 
 // specialization declarations, defined in source file
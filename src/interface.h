@@ -19,10 +19,12 @@
 #ifndef LAMINAR_INTERFACE_H_
 #define LAMINAR_INTERFACE_H_
 
+#include "node.h"
 #include "run.h"
 
 #include <string>
 #include <memory>
+#include <set>
 #include <unordered_map>
 
 typedef std::unordered_map<std::string, std::string> ParamMap;
@@ -49,14 +51,14 @@ struct MonitorScope {
     {}
 
     // whether this scope wants status information about the given job or run
-    bool wantsStatus(std::string ajob, uint anum = 0) const {
+    bool wantsStatus(const std::string& ajob, uint anum = 0) const {
         if(type == HOME || type == ALL) return true;
         if(type == JOB) return ajob == job;
         if(type == RUN) return ajob == job && anum == num;
         return false;
     }
 
-    bool wantsLog(std::string ajob, uint anum) const {
+    bool wantsLog(const std::string& ajob, uint anum) const {
         return type == LOG && ajob == job && anum == num;
     }
 
@@ -67,14 +69,20 @@ struct MonitorScope {
     uint page = 0;
     std::string field;
     bool order_desc;
+    // for LOG, the log is sent from this byte offset onward
+    uint64_t offset = 0;
 };
 
+// A serialized message for clients. Messages are immutable so that one
+// instance can be shared by every client it is sent to without copying
+typedef std::shared_ptr<const std::string> Message;
+
 // Represents a (websocket) client that wants to be notified about events
 // matching the supplied scope. Pass instances of this to LaminarInterface
 // registerClient and deregisterClient
 struct LaminarClient {
     virtual ~LaminarClient() noexcept(false) {}
-    virtual void sendMessage(std::string payload) = 0;
+    virtual void sendMessage(Message payload) = 0;
     MonitorScope scope;
 };
 
@@ -83,14 +91,21 @@ struct LaminarClient {
 // deregisterWaiter
 struct LaminarWaiter {
     virtual ~LaminarWaiter() =default;
+    // called when a run has been started on a node
+    virtual void started(const Run*) {}
     virtual void complete(const Run*) = 0;
 };
 
 // Represents a file mapped in memory. Used to serve artefacts
 struct MappedFile {
     virtual ~MappedFile() =default;
+    // nullptr if the file is not a readable regular file
     virtual const void* address() = 0;
     virtual size_t size() = 0;
+    // Strong HTTP entity tag (including quotes) which changes whenever
+    // the file is replaced or modified
+    virtual std::string etag() = 0;
+    virtual time_t mtime() = 0;
 };
 
 // The interface connecting the network layer to the application business
@@ -125,11 +140,22 @@ struct LaminarInterface {
     // initial websocket connect.
     virtual void sendStatus(LaminarClient* client) = 0;
 
+    // Whether the given run has started and not yet completed
+    virtual bool runInProgress(std::string job, uint num) = 0;
+
     // Implements the laminar client interface allowing the setting of
     // arbitrary parameters on a run (usually itself) to be available in
     // the environment of subsequent scripts.
     virtual bool setParam(std::string job, uint buildNum, std::string param, std::string value) = 0;
 
+    // Fetches the gzip-compressed log of a finished run. The returned
+    // MappedFile has no data if the log is not available.
+    virtual kj::Own<MappedFile> getLog(std::string job, uint num) = 0;
+
+    // Decompresses part of the log of a run, which may be in progress.
+    // Returns false if the log is not available
+    virtual bool getLogSlice(std::string job, uint num, const LogRange& range, LogSlice& slice) = 0;
+
     // Fetches the content of an artifact given its filename relative to
     // $LAMINAR_HOME/archive. Ideally, this would instead be served by a
     // proper web server which handles this url.
@@ -140,11 +166,30 @@ struct LaminarInterface {
     // which handles this url.
     virtual std::string getCustomCss() = 0;
 
+    // Fetches the daemon's metrics in the Prometheus text format (see
+    // MetricsWriter)
+    virtual std::string getMetrics() = 0;
+
+    // Searches the logs of runs of job (of any job if empty) completed
+    // between from and to for lines containing the phrase query. Returns
+    // the matching lines as JSON, or an empty string if the logs are not
+    // indexed (see LAMINAR_LOG_SEARCH)
+    virtual std::string searchLogs(std::string query, std::string job, time_t from, time_t to) = 0;
+
     // Abort all running jobs
     virtual void abortAll() = 0;
 
-    // Callback to handle a configuration modification notification
-    virtual void notifyConfigChanged() = 0;
+    // Callback to handle a configuration modification notification. The
+    // path is that of the file which changed, or empty if it is unknown
+    virtual void notifyConfigChanged(std::string path) = 0;
+
+    // Adds a node whose runs are executed by the given agent. Returns false
+    // if a node with that name already exists
+    virtual bool registerAgent(std::string name, int executors, std::set<std::string> tags, std::shared_ptr<Agent> agent) = 0;
+
+    // Removes the node of an agent which is no longer available. Runs in
+    // progress on it fail once their calls to the agent do
+    virtual void deregisterAgent(const Agent* agent) = 0;
 };
 
 #endif // LAMINAR_INTERFACE_H_
@@ -0,0 +1,274 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "journal.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+
+// Each record is a line of tab-separated fields:
+//   Q <id> <queuedAt> <job> [<param name> <param value>]...
+//   S <id> <number> <startedAt> <node>
+//   C <id> <param name> <param value>
+//   F <id>
+// Backslash, tab and newline within fields are escaped.
+
+namespace {
+
+void addField(std::string& record, const std::string& field) {
+    record += '\t';
+    for(char c : field) {
+        switch(c) {
+        case '\\': record += "\\\\"; break;
+        case '\t': record += "\\t"; break;
+        case '\n': record += "\\n"; break;
+        default: record += c;
+        }
+    }
+}
+
+std::vector<std::string> splitFields(const std::string& line) {
+    std::vector<std::string> fields(1);
+    for(size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if(c == '\t') {
+            fields.emplace_back();
+        } else if(c == '\\' && i + 1 < line.size()) {
+            c = line[++i];
+            fields.back() += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+        } else {
+            fields.back() += c;
+        }
+    }
+    return fields;
+}
+
+std::string queuedRecord(const Journal::Entry& e) {
+    std::string record = "Q";
+    addField(record, std::to_string(e.id));
+    addField(record, std::to_string(e.queuedAt));
+    addField(record, e.job);
+    for(const auto& p : e.params) {
+        addField(record, p.first);
+        addField(record, p.second);
+    }
+    return record + '\n';
+}
+
+std::string startedRecord(uint64_t id, uint number, const std::string& node, time_t startedAt) {
+    std::string record = "S";
+    addField(record, std::to_string(id));
+    addField(record, std::to_string(number));
+    addField(record, std::to_string(startedAt));
+    addField(record, node);
+    return record + '\n';
+}
+
+bool writeAll(int fd, const std::string& data) {
+    for(size_t done = 0; done < data.size();) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if(n < 0 && errno != EINTR)
+            return false;
+        if(n > 0)
+            done += n;
+    }
+    return true;
+}
+
+}
+
+Journal::Journal() :
+    fd(-1),
+    nextId(1),
+    records(0),
+    compacting(false)
+{
+}
+
+Journal::~Journal() {
+    if(fd >= 0)
+        close(fd);
+}
+
+bool Journal::open(std::string path, std::vector<Entry>& pending) {
+    filePath = path;
+    // ordered by id, which is the order in which runs were queued
+    std::map<uint64_t, Entry> entries;
+    std::ifstream in(path);
+    std::string line;
+    // length of the complete records read
+    off_t complete = 0;
+    while(std::getline(in, line)) {
+        // the last record may have been cut short
+        if(in.eof())
+            break;
+        complete += static_cast<off_t>(line.size()) + 1;
+        std::vector<std::string> f = splitFields(line);
+        uint64_t id = f.size() > 1 ? strtoull(f[1].c_str(), nullptr, 10) : 0;
+        if(f[0] == "Q" && f.size() >= 4) {
+            Entry& e = entries[id];
+            e.id = id;
+            e.queuedAt = static_cast<time_t>(atoll(f[2].c_str()));
+            e.job = f[3];
+            for(size_t i = 4; i + 1 < f.size(); i += 2)
+                e.params[f[i]] = f[i + 1];
+            e.number = 0;
+            e.startedAt = 0;
+        } else if(f[0] == "S" && f.size() >= 5) {
+            auto it = entries.find(id);
+            if(it != entries.end()) {
+                it->second.number = static_cast<uint>(atoi(f[2].c_str()));
+                it->second.startedAt = static_cast<time_t>(atoll(f[3].c_str()));
+                it->second.node = f[4];
+            }
+        } else if(f[0] == "C" && f.size() >= 4) {
+            auto it = entries.find(id);
+            if(it != entries.end())
+                it->second.params[f[2]] = f[3];
+        } else if(f[0] == "F") {
+            entries.erase(id);
+        } else {
+            LLOG(WARNING, "Ignoring invalid journal record", line);
+        }
+        if(id >= nextId)
+            nextId = id + 1;
+    }
+    in.close();
+
+    fd = ::open(path.c_str(), O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC, 0644);
+    if(fd < 0) {
+        LLOG(ERROR, "Could not open journal", path, strerror(errno));
+        return false;
+    }
+    // A partial record is removed, otherwise the next record would be
+    // appended to it and both would be misread
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > complete && ftruncate(fd, complete) != 0) {
+        LLOG(ERROR, "Could not truncate journal", path, strerror(errno));
+    }
+    pending.clear();
+    for(auto& it : entries)
+        pending.push_back(std::move(it.second));
+    return true;
+}
+
+uint64_t Journal::queued(const std::string& job, const Params& params, time_t queuedAt) {
+    Entry e;
+    e.id = nextId++;
+    e.job = job;
+    e.params = params;
+    e.queuedAt = queuedAt;
+    append(queuedRecord(e));
+    return e.id;
+}
+
+void Journal::started(uint64_t id, uint number, const std::string& node, time_t startedAt) {
+    append(startedRecord(id, number, node, startedAt));
+}
+
+void Journal::changed(uint64_t id, const std::string& param, const std::string& value) {
+    std::string record = "C";
+    addField(record, std::to_string(id));
+    addField(record, param);
+    addField(record, value);
+    append(record + '\n');
+}
+
+void Journal::finished(uint64_t id) {
+    std::string record = "F";
+    addField(record, std::to_string(id));
+    append(record + '\n');
+}
+
+void Journal::compact(const std::vector<Entry>& live) {
+    Compaction c;
+    if(!startCompact(live, c))
+        return;
+    writeCompaction(c);
+    finishCompact(c);
+}
+
+bool Journal::startCompact(const std::vector<Entry>& live, Compaction& c) {
+    if(fd < 0 || compacting)
+        return false;
+    c.path = filePath + ".tmp";
+    c.content.clear();
+    for(const Entry& e : live) {
+        c.content += queuedRecord(e);
+        if(e.number)
+            c.content += startedRecord(e.id, e.number, e.node, e.startedAt);
+    }
+    compacting = true;
+    backlog.clear();
+    return true;
+}
+
+void Journal::writeCompaction(Compaction& c) {
+    c.fd = ::open(c.path.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(c.fd >= 0 && (!writeAll(c.fd, c.content) || fdatasync(c.fd) != 0)) {
+        close(c.fd);
+        c.fd = -1;
+    }
+    if(c.fd < 0) {
+        LLOG(ERROR, "Could not compact journal", c.path, strerror(errno));
+        unlink(c.path.c_str());
+    }
+}
+
+void Journal::finishCompact(Compaction& c) {
+    compacting = false;
+    if(c.fd < 0)
+        return;
+    // The records appended meanwhile are only in the old journal. They are
+    // added before the rename, so that a crash leaves either journal
+    // complete, and like any other record they are not synced
+    if(!writeAll(c.fd, backlog) || rename(c.path.c_str(), filePath.c_str()) != 0) {
+        LLOG(ERROR, "Could not compact journal", filePath, strerror(errno));
+        close(c.fd);
+        unlink(c.path.c_str());
+        return;
+    }
+    close(fd);
+    fd = c.fd;
+    // the descriptor was not opened for appending, but its offset is at
+    // the end of what was written
+    records = std::count(backlog.begin(), backlog.end(), '\n');
+    backlog.clear();
+}
+
+void Journal::append(const std::string& record) {
+    if(fd < 0)
+        return;
+    // O_APPEND and a single call for the whole record, so that it is only
+    // ever cut short by running out of space or a crash
+    if(!writeAll(fd, record)) {
+        LLOG(ERROR, "Could not write to journal", filePath, strerror(errno));
+    }
+    if(compacting)
+        backlog += record;
+    records++;
+}
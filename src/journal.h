@@ -0,0 +1,107 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_JOURNAL_H_
+#define LAMINAR_JOURNAL_H_
+
+#include <stdint.h>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+// Append-only record of the runs which are queued or in progress, which
+// otherwise only exist in memory until they are written to the database
+// on completion. After a restart, the journal tells which runs were still
+// queued, so that they can be queued again, and which were interrupted.
+// Records are appended with a single write() each and not synced, so the
+// journal survives laminard being killed, but not necessarily the loss of
+// power. A partially written final record is ignored.
+class Journal {
+public:
+    typedef std::unordered_map<std::string, std::string> Params;
+
+    struct Entry {
+        uint64_t id;
+        std::string job;
+        // as passed to LaminarInterface::queueJob
+        Params params;
+        time_t queuedAt;
+        // 0 if the run has not started
+        uint number;
+        std::string node;
+        time_t startedAt;
+    };
+
+    Journal();
+    ~Journal();
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Reads the journal at path, which need not exist, into pending: the
+    // runs which did not finish, in the order in which they were queued.
+    // Further records are appended to the file. Returns false if it could
+    // not be opened, in which case nothing is recorded.
+    bool open(std::string path, std::vector<Entry>& pending);
+
+    // Each of these appends a record. queued returns the id by which the
+    // run is referred to subsequently
+    uint64_t queued(const std::string& job, const Params& params, time_t queuedAt);
+    void started(uint64_t id, uint number, const std::string& node, time_t startedAt);
+    // sets a parameter of a queued run, such as a priority raised by
+    // coalescing
+    void changed(uint64_t id, const std::string& param, const std::string& value);
+    // called once the run has been recorded elsewhere
+    void finished(uint64_t id);
+
+    // Replaces the journal with one containing only the given entries, so
+    // that the records of finished runs don't accumulate
+    void compact(const std::vector<Entry>& live);
+
+    // The same in steps, so that the new journal can be written and synced
+    // off the event loop. startCompact returns false if there is nothing to
+    // do or a compaction is already in progress. Otherwise writeCompaction
+    // may be called on any thread, followed by finishCompact, which adds
+    // the records appended in the meantime and puts the new journal in
+    // place.
+    struct Compaction {
+        std::string path;
+        std::string content;
+        int fd = -1;
+    };
+    bool startCompact(const std::vector<Entry>& live, Compaction& c);
+    static void writeCompaction(Compaction& c);
+    void finishCompact(Compaction& c);
+
+    // number of records appended since the journal was last compacted
+    size_t length() const { return records; }
+
+private:
+    void append(const std::string& record);
+
+    std::string filePath;
+    int fd;
+    uint64_t nextId;
+    size_t records;
+    bool compacting;
+    // records appended while compacting, for the new journal
+    std::string backlog;
+};
+
+#endif // LAMINAR_JOURNAL_H_
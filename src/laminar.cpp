@@ -20,20 +20,61 @@
 #include "server.h"
 #include "conf.h"
 #include "log.h"
+#include "cgroup.h"
+#include "metrics.h"
+#include "logindex.h"
+#include "workspace.h"
 
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <fstream>
-#include <zlib.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
 
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
 
 #define COMPRESS_LOG_MIN_SIZE 1024
 
+// Weight given to the most recent run when estimating a job's duration
+#define DURATION_EWMA_WEIGHT 0.3
+// Number of recent runs per job used to initialize JobStats at startup
+#define JOB_STATS_SEED_RUNS 20
+// Number of records after which the journal is compacted
+#define JOURNAL_COMPACT_RECORDS 10000
+
+// Expired runs are removed by a pass this many seconds after startup and
+// then at this interval
+#define RETENTION_START_DELAY 60
+#define RETENTION_INTERVAL 3600
+// Expired runs are removed in transactions of at most this many runs,
+// with a pause in between so that completing runs are not held up
+#define RETENTION_BATCH_RUNS 100
+#define RETENTION_BATCH_PAUSE_MS 50
+// Maximum number of free database pages returned to the filesystem after
+// each batch
+#define RETENTION_VACUUM_PAGES 2000
+
+// The archive of a run in progress is listed up to this many files, and
+// walked again when its listing is this many seconds old
+#define ACTIVE_ARTIFACTS_LIMIT 10000
+#define ACTIVE_ARTIFACTS_RESCAN 10
+
+// Maximum number of matching lines returned by a log search
+#define LOG_SEARCH_RESULTS 100
+
+// A log is added to the search index in batches of at most this many
+// lines and uncompressed bytes, each in its own transaction. A longer line
+// is only indexed up to this many bytes
+#define LOG_INDEX_BATCH_LINES 10000
+#define LOG_INDEX_BATCH_BYTES (1024 * 1024)
+
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h>
 
@@ -48,12 +89,54 @@ public:
     Json& startObject(const char* key) { String(key); StartObject(); return *this; }
     Json& startArray(const char* key) { String(key); StartArray(); return *this; }
     const char* str() { EndObject(); return buf.GetString(); }
+    Message message() { EndObject(); return std::make_shared<const std::string>(buf.GetString(), buf.GetSize()); }
 private:
     rapidjson::StringBuffer buf;
 };
 template<> Json& Json::set(const char* key, const char* value) { String(key); String(value); return *this; }
 template<> Json& Json::set(const char* key, std::string value) { String(key); String(value.c_str()); return *this; }
 
+class MappedFileImpl : public MappedFile {
+public:
+    MappedFileImpl(const char* path) :
+        fd(open(path, O_RDONLY | O_CLOEXEC)),
+        sz(0),
+        ptr(nullptr)
+    {
+        if(fd == -1) return;
+        if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) return;
+        sz = st.st_size;
+        // an empty file cannot be mapped, but is still a file
+        if(sz == 0) {
+            ptr = const_cast<char*>("");
+            return;
+        }
+        ptr = mmap(nullptr, sz, PROT_READ, MAP_SHARED, fd, 0);
+        if(ptr == MAP_FAILED)
+            ptr = nullptr;
+    }
+    ~MappedFileImpl() override {
+        if(ptr && sz > 0)
+            munmap(ptr, sz);
+        if(fd != -1)
+            close(fd);
+    }
+    virtual const void* address() override { return ptr; }
+    virtual size_t size() override { return sz; }
+    virtual std::string etag() override {
+        char buf[80];
+        snprintf(buf, sizeof(buf), "\"%lx-%lx-%lx.%lx\"", ulong(st.st_ino), ulong(st.st_size),
+                 ulong(st.st_mtim.tv_sec), ulong(st.st_mtim.tv_nsec));
+        return buf;
+    }
+    virtual time_t mtime() override { return st.st_mtime; }
+private:
+    struct stat st;
+    int fd;
+    size_t sz;
+    void* ptr;
+};
+
 namespace {
 // Default values when none were supplied in $LAMINAR_CONF_FILE (/etc/laminar.conf)
 constexpr const char* INTADDR_RPC_DEFAULT = "unix-abstract:laminar";
@@ -70,43 +153,227 @@ fs::path operator+(fs::path p, const char* ext) {
 
 typedef std::string str;
 
+// Creates a directory, setting existed if it was already there. Only a
+// missing parent costs more than the one mkdir of the common cases
+static bool makeDirectory(const fs::path& dir, bool& existed) {
+    existed = false;
+    if(mkdir(dir.c_str(), 0777) == 0)
+        return true;
+    if(errno == EEXIST) {
+        existed = fs::is_directory(dir);
+        return existed;
+    }
+    boost::system::error_code err;
+    return errno == ENOENT && fs::create_directories(dir, err);
+}
+
 Laminar::Laminar() {
     archiveUrl = ARCHIVE_URL_DEFAULT;
     if(char* envArchive = getenv("LAMINAR_ARCHIVE_URL"))
         archiveUrl = envArchive;
     numKeepRunDirs = 0;
     homeDir = getenv("LAMINAR_HOME") ?: "/var/lib/laminar";
+    scheduler.setEstimator([this](const std::string& job) -> uint {
+        auto stats = jobStats.find(job);
+        return stats == jobStats.end() ? 0 : stats->second.estimatedDuration();
+    });
+    if(const char* cgroup = getenv("LAMINAR_CGROUP")) {
+        if(Cgroup::setup(cgroup))
+            cgroupPath = cgroup;
+    }
+    if(const char* dedup = getenv("LAMINAR_ARCHIVE_DEDUP")) {
+        // within the archive so that it is on the same filesystem
+        std::unique_ptr<ObjectStore> store(new ObjectStore);
+        if(strcmp(dedup, "0") != 0 && store->open((fs::path(homeDir)/"archive"/".objects").string()))
+            objects = std::move(store);
+    }
 
     db = new Database((fs::path(homeDir)/"laminar.sqlite").string().c_str());
+    // Runs are recorded from background threads with a separate connection.
+    // Only these threads write to the database once laminard is running,
+    // so only they may have to wait for each other's locks
+    completionDb = new Database((fs::path(homeDir)/"laminar.sqlite").string().c_str());
+    completionDb->setBusyTimeout(1000);
     // Prepare database for first use
     // TODO: error handling
+    // Lets the space of removed runs be released in small steps. This only
+    // takes effect on a new database, or after a VACUUM
+    db->exec("PRAGMA auto_vacuum=INCREMENTAL");
     db->exec("CREATE TABLE IF NOT EXISTS builds("
              "name TEXT, number INT UNSIGNED, node TEXT, queuedAt INT, "
              "startedAt INT, completedAt INT, result INT, output TEXT, "
              "outputLen INT, parentJob TEXT, parentBuild INT, reason TEXT, "
-             "PRIMARY KEY (name, number))");
+             "logPath TEXT, PRIMARY KEY (name, number))");
     db->exec("CREATE INDEX IF NOT EXISTS idx_completion_time ON builds("
              "completedAt DESC)");
+    // for the most recent (successful, failed) run of a given job
+    db->exec("CREATE INDEX IF NOT EXISTS idx_name_completion ON builds("
+             "name, completedAt DESC)");
+    db->exec("CREATE INDEX IF NOT EXISTS idx_name_result_completion ON builds("
+             "name, result, completedAt DESC)");
+    // Write-ahead logging lets status queries proceed while a run is being
+    // recorded. With WAL, synchronous=NORMAL is still safe against
+    // corruption and only risks losing the most recent commits on power loss
+    db->exec("PRAGMA journal_mode=WAL");
+    for(Database* conn : {db, completionDb}) {
+        conn->exec("PRAGMA synchronous=NORMAL");
+        // in KiB when negative
+        conn->exec("PRAGMA cache_size=-16384");
+    }
+    // Upgrade databases created before columns were added to the schema
+    auto ensureColumn = [this](const char* column, const char* type) {
+        bool exists = false;
+        db->stmt("PRAGMA table_info(builds)").fetch<int,str>([&](int, str name){
+            exists = exists || name == column;
+        });
+        if(!exists)
+            db->exec((str("ALTER TABLE builds ADD COLUMN ") + column + " " + type).c_str());
+    };
+    ensureColumn("logPath", "TEXT");
+    // only recorded when runs are placed in cgroups
+    ensureColumn("cpuUser", "INT");
+    ensureColumn("cpuSystem", "INT");
+    ensureColumn("memoryPeak", "INT");
+    // number of rows in the artifacts table for the run. NULL for runs
+    // completed before the table existed
+    ensureColumn("artifactCount", "INT");
+    // runs with identical output share a log, which may only be removed
+    // with the last of them
+    db->exec("CREATE INDEX IF NOT EXISTS idx_log_path ON builds(logPath)");
+    logSearch = false;
+    if(const char* search = getenv("LAMINAR_LOG_SEARCH")) {
+        if(strcmp(search, "0") != 0) {
+            logSearch = LogIndex::create(*db);
+            if(!logSearch) {
+                LLOG(ERROR, "SQLite does not support FTS5, logs will not be indexed");
+            }
+        }
+    }
+    // The manifest of each run's archive, taken when it completed
+    db->exec("CREATE TABLE IF NOT EXISTS artifacts("
+             "name TEXT, number INT UNSIGNED, filename TEXT, size INT, mtime INT, "
+             "hash TEXT, PRIMARY KEY (name, number, filename))");
+    // The last build number and number of runs of each job, maintained as
+    // runs are recorded so that startup does not need to scan all builds
+    db->exec("CREATE TABLE IF NOT EXISTS jobs("
+             "name TEXT PRIMARY KEY, lastNumber INT UNSIGNED, runCount INT UNSIGNED)");
+    bool haveJobs = false;
+    db->stmt("SELECT 1 FROM jobs LIMIT 1").fetch<int>([&](int){ haveJobs = true; });
+    if(!haveJobs) {
+        // the database predates the jobs table, or has no builds at all
+        db->exec("INSERT INTO jobs SELECT name, MAX(number), COUNT(*) FROM builds GROUP BY name");
+    }
+
+    // Runs which were in progress when laminard last stopped cannot be
+    // resumed, so they are recorded as aborted. Those which were still
+    // queued are queued again once the configuration has been loaded
+    std::vector<Journal::Entry> pending;
+    journal.open((fs::path(homeDir)/"journal").string(), pending);
+    std::vector<Journal::Entry> requeue;
+    time_t now = time(nullptr);
+    for(const Journal::Entry& e : pending) {
+        if(e.number == 0) {
+            requeue.push_back(e);
+            continue;
+        }
+        LLOG(WARNING, "Recording interrupted run as aborted", e.job, e.number);
+        std::shared_ptr<Run> run = createRun(e.job, e.params, e.queuedAt);
+        run->build = e.number;
+        run->startedAt = e.startedAt;
+        run->result = RunState::ABORTED;
+        db->exec("BEGIN TRANSACTION");
+        recordRun(db, *run, e.node, now, 0, std::string());
+        db->exec("COMMIT");
+    }
 
     // retrieve the last build numbers
-    db->stmt("SELECT name, MAX(number) FROM builds GROUP BY name")
-    .fetch<str,uint>([this](str name, uint build){
+    std::unordered_map<std::string, uint> counts;
+    db->stmt("SELECT name, lastNumber, runCount FROM jobs")
+    .fetch<str,uint,uint>([&](str name, uint build, uint count){
         buildNums[name] = build;
+        counts[name] = count;
     });
+    // and summarize the most recent runs of each job
+    for(const auto& it : counts) {
+        struct Completed { uint number; time_t started, completed; int result; };
+        std::vector<Completed> recent;
+        db->stmt("SELECT number, startedAt, completedAt, result FROM builds WHERE name = ? ORDER BY completedAt DESC LIMIT ?")
+         .bind(it.first, JOB_STATS_SEED_RUNS)
+         .fetch<uint,time_t,time_t,int>([&](uint number, time_t started, time_t completed, int result){
+            recent.push_back({number, started, completed, result});
+        });
+        JobStats& stats = jobStats[it.first];
+        for(auto r = recent.rbegin(); r != recent.rend(); ++r)
+            stats.add(r->number, r->started, r->completed, RunState(r->result));
+        stats.count = it.second;
+        // these may be older than the runs seen above
+        if(stats.lastSuccessNumber == 0) {
+            db->stmt("SELECT number,startedAt FROM builds WHERE name = ? AND result = ? ORDER BY completedAt DESC LIMIT 1")
+             .bind(it.first, int(RunState::SUCCESS))
+             .fetch<uint,time_t>([&](uint build, time_t started){
+                stats.lastSuccessNumber = build;
+                stats.lastSuccessStarted = started;
+            });
+        }
+        if(stats.lastFailedNumber == 0) {
+            db->stmt("SELECT number,startedAt FROM builds WHERE name = ? AND result <> ? ORDER BY completedAt DESC LIMIT 1")
+             .bind(it.first, int(RunState::SUCCESS))
+             .fetch<uint,time_t>([&](uint build, time_t started){
+                stats.lastFailedNumber = build;
+                stats.lastFailedStarted = started;
+            });
+        }
+    }
 
     srv = nullptr;
+    snapshotTime = 0;
 
     // Load configuration, may be called again in response to an inotify event
     // that the configuration files have been modified
     loadConfiguration();
+
+    // They are dispatched once the server is running
+    std::vector<Journal::Entry> live;
+    for(const Journal::Entry& e : requeue) {
+        if(!cfgExists("jobs/" + e.job + ".run")) {
+            LLOG(WARNING, "Dropping queued run of removed job", e.job);
+            continue;
+        }
+        std::shared_ptr<Run> run = createRun(e.job, e.params, e.queuedAt);
+        run->journalId = e.id;
+        scheduler.queue(run);
+        live.push_back(e);
+    }
+    if(!live.empty()) {
+        LLOG(INFO, "Requeued runs from the journal", live.size());
+    }
+    journal.compact(live);
 }
 
 void Laminar::registerClient(LaminarClient* client) {
-    clients.insert(client);
+    // A new log client receives everything appended so far from
+    // sendStatus, so it must not also receive the output collected
+    // before it was registered
+    if(client->scope.type == MonitorScope::LOG)
+        flushOutput();
+    clients.add(client);
+}
+
+void Laminar::flushOutput() {
+    LoopSection section("flush output");
+    outputFlushScheduled = false;
+    for(auto& it : pendingOutput) {
+        const Run* run = it.first;
+        Message msg = std::make_shared<const std::string>(std::move(it.second));
+        clients.forLog(run->name, run->build, [&](LaminarClient* c){
+            c->sendMessage(msg);
+        });
+    }
+    pendingOutput.clear();
 }
 
 void Laminar::deregisterClient(LaminarClient* client) {
-    clients.erase(client);
+    clients.remove(client);
 }
 
 void Laminar::registerWaiter(LaminarWaiter *waiter) {
@@ -126,78 +393,212 @@ bool Laminar::setParam(std::string job, uint buildNum, std::string param, std::s
 }
 
 
-void Laminar::populateArtifacts(Json &j, std::string job, uint num) const {
+std::vector<Artifact> Laminar::scanArtifacts(std::string job, uint num, size_t limit) const {
+    std::vector<Artifact> result;
     fs::path dir(fs::path(homeDir)/"archive"/job/std::to_string(num));
     if(fs::is_directory(dir)) {
         size_t prefixLen = (fs::path(homeDir)/"archive").string().length();
         size_t scopeLen = dir.string().length();
-        for(fs::recursive_directory_iterator it(dir); it != fs::recursive_directory_iterator(); ++it) {
-            if(!fs::is_regular_file(*it))
+        boost::system::error_code err;
+        for(fs::recursive_directory_iterator it(dir, err); it != fs::recursive_directory_iterator(); it.increment(err)) {
+            if(!fs::is_regular_file(it->status()))
                 continue;
-            j.StartObject();
-            j.set("url", archiveUrl + it->path().string().substr(prefixLen));
-            j.set("filename", it->path().string().substr(scopeLen+1));
-            j.set("size", fs::file_size(it->path()));
-            j.EndObject();
+            if(limit && result.size() == limit)
+                break;
+            result.push_back({
+                archiveUrl + it->path().string().substr(prefixLen),
+                it->path().string().substr(scopeLen+1),
+                fs::file_size(it->path(), err),
+                fs::last_write_time(it->path(), err),
+                std::string()
+            });
         }
+        // served in this order, one page at a time
+        std::sort(result.begin(), result.end(), [](const Artifact& a, const Artifact& b){
+            return a.filename < b.filename;
+        });
     }
+    return result;
 }
 
-void Laminar::sendStatus(LaminarClient* client) {
-    if(client->scope.type == MonitorScope::LOG) {
-        // If the requested job is currently in progress
-        if(const Run* run = activeRun(client->scope.job, client->scope.num)) {
-            client->sendMessage(run->log.c_str());
-        } else { // it must be finished, fetch it from the database
-            db->stmt("SELECT output, outputLen FROM builds WHERE name = ? AND number = ?")
-              .bind(client->scope.job, client->scope.num)
-              .fetch<str,int>([=](str maybeZipped, unsigned long sz) {
-                str log(sz+1,'\0');
-                if(sz >= COMPRESS_LOG_MIN_SIZE) {
-                    int res = ::uncompress((uint8_t*) log.data(), &sz,
-                         (const uint8_t*) maybeZipped.data(), maybeZipped.size());
-                    if(res == Z_OK)
-                        client->sendMessage(log);
-                    else
-                        LLOG(ERROR, "Failed to uncompress log");
-                } else {
-                    client->sendMessage(maybeZipped);
-                }
+void Laminar::storeArtifacts(Database* db, std::string job, uint num, const std::vector<Artifact>& artifacts) {
+    for(const Artifact& a : artifacts) {
+        db->stmt("INSERT OR REPLACE INTO artifacts(name, number, filename, size, mtime, hash) VALUES(?,?,?,?,?,?)")
+         .bind(job, num, a.filename, a.size, a.mtime, a.hash)
+         .exec();
+    }
+    db->stmt("UPDATE builds SET artifactCount = ? WHERE name = ? AND number = ?")
+     .bind(artifacts.size(), job, num)
+     .exec();
+}
+
+void Laminar::scanArchive(std::string job, uint num) {
+    auto key = std::make_pair(job, num);
+    if(!archiveScans.insert(key).second)
+        return;
+    bool active = activeRun(job, num) != nullptr;
+    std::shared_ptr<std::vector<Artifact>> artifacts = std::make_shared<std::vector<Artifact>>();
+    srv->addTask(srv->runInBackground([this, job, num, active, artifacts]{
+        // the archive of a run in progress may be too large to list in full
+        *artifacts = scanArtifacts(job, num, active ? ACTIVE_ARTIFACTS_LIMIT : 0);
+        if(!active) {
+            commitCompletion([&](Database* conn){
+                storeArtifacts(conn, job, num, *artifacts);
             });
         }
+    }).then([this, key, active, artifacts]{
+        LoopSection section("archive scan");
+        archiveScans.erase(key);
+        if(active) {
+            // the run may have completed meanwhile, in which case its
+            // clients have already received its recorded archive
+            if(!activeRun(key.first, key.second))
+                return;
+            activeArchives[key] = ArchiveListing{std::move(*artifacts), time(nullptr)};
+        }
+        clients.forRun(key.first, key.second, [this](LaminarClient* c){
+            sendStatus(c);
+        });
+    }));
+}
+
+void JobStats::add(uint number, time_t started, time_t completed, RunState result) {
+    uint duration = static_cast<uint>(completed - started);
+    avgDuration = count == 0 ? duration
+            : DURATION_EWMA_WEIGHT * duration + (1 - DURATION_EWMA_WEIGHT) * avgDuration;
+    count++;
+    lastNumber = number;
+    lastResult = result;
+    lastStarted = started;
+    lastCompleted = completed;
+    lastDuration = duration;
+    if(result == RunState::SUCCESS) {
+        lastSuccessNumber = number;
+        lastSuccessStarted = started;
+    } else {
+        lastFailedNumber = number;
+        lastFailedStarted = started;
+    }
+}
+
+uint JobStats::estimatedDuration() const {
+    return static_cast<uint>(avgDuration + 0.5);
+}
+
+// number of artifacts sent in each status message of a run
+static const uint ARTIFACTS_PER_PAGE = 100;
+
+// expects that Json has started an object
+static void writeArtifacts(Json& j, const std::vector<Artifact>& artifacts, size_t total, uint page) {
+    j.startArray("artifacts");
+    for(const Artifact& a : artifacts) {
+        j.StartObject();
+        j.set("url", a.url);
+        j.set("filename", a.filename);
+        j.set("size", a.size);
+        j.set("mtime", a.mtime);
+        if(!a.hash.empty())
+            j.set("hash", a.hash);
+        j.EndObject();
+    }
+    j.EndArray();
+    j.set("artifactsCount", total);
+    j.set("artifactsPage", page);
+    j.set("artifactsPages", total == 0 ? 1 : (total-1) / ARTIFACTS_PER_PAGE + 1);
+}
+
+void Laminar::sendStatus(LaminarClient* client) {
+    ScopedTimer timer(metrics.sendStatus[client->scope.type]);
+    LoopSection section("sendStatus");
+    if(client->scope.type == MonitorScope::LOG) {
+        // the part of the log the client has not already fetched, which
+        // is all of it unless it asked for an offset. Subsequent output is
+        // sent as it is produced
+        LogRange range;
+        range.first = client->scope.offset;
+        LogSlice slice;
+        getLogSlice(client->scope.job, client->scope.num, range, slice);
+        if(!slice.text.empty())
+            client->sendMessage(std::make_shared<const std::string>(std::move(slice.text)));
         return;
     }
 
+    // The home and all-jobs snapshots are the same for every client, so
+    // they are serialized once and reused until either the state changes
+    // or the "time" field would be different
+    time_t now = time(nullptr);
+    bool cacheable = client->scope.type == MonitorScope::HOME || client->scope.type == MonitorScope::ALL;
+    if(cacheable && snapshotTime == now) {
+        auto it = snapshots.find(client->scope.type);
+        if(it != snapshots.end()) {
+            client->sendMessage(it->second);
+            return;
+        }
+    }
+
     Json j;
     j.set("type", "status");
     j.set("title", getenv("LAMINAR_TITLE") ?: "Laminar");
-    j.set("time", time(nullptr));
+    j.set("time", now);
     j.startObject("data");
     if(client->scope.type == MonitorScope::RUN) {
-        db->stmt("SELECT queuedAt,startedAt,completedAt, result, reason FROM builds WHERE name = ? AND number = ?")
+        bool completed = false;
+        bool indexed = false;
+        uint nArtifacts = 0;
+        db->stmt("SELECT queuedAt,startedAt,completedAt, result, reason, artifactCount IS NOT NULL, IFNULL(artifactCount,0) FROM builds WHERE name = ? AND number = ?")
         .bind(client->scope.job, client->scope.num)
-        .fetch<time_t, time_t, time_t, int, std::string>([&](time_t queued, time_t started, time_t completed, int result, std::string reason) {
+        .fetch<time_t, time_t, time_t, int, std::string, int, uint>([&](time_t queued, time_t started, time_t completedAt, int result, std::string reason, int hasCount, uint count) {
             j.set("queued", started-queued);
             j.set("started", started);
-            j.set("completed", completed);
+            j.set("completed", completedAt);
             j.set("result", to_string(RunState(result)));
             j.set("reason", reason);
+            completed = true;
+            indexed = hasCount;
+            nArtifacts = count;
         });
+        if(completed && !indexed) {
+            // Completed before artifacts were recorded. They are recorded
+            // once, in the background, and the client is sent the status
+            // again when that is done
+            scanArchive(client->scope.job, client->scope.num);
+        }
+        const ArchiveListing* listing = nullptr;
         if(const Run* run = activeRun(client->scope.job, client->scope.num)) {
             j.set("queued", run->startedAt - run->queuedAt);
             j.set("started", run->startedAt);
             j.set("reason", run->reason());
             j.set("result", to_string(RunState::RUNNING));
-            db->stmt("SELECT completedAt - startedAt FROM builds WHERE name = ? ORDER BY completedAt DESC LIMIT 1")
-             .bind(run->name)
-             .fetch<uint>([&](uint lastRuntime){
-                j.set("etc", run->startedAt + lastRuntime);
-            });
+            auto stats = jobStats.find(run->name);
+            if(stats != jobStats.end())
+                j.set("etc", run->startedAt + stats->second.estimatedDuration());
+            // The archive of a run in progress may still change. It is
+            // listed from a recent walk in the background, which is
+            // repeated when the listing has become stale
+            auto it = activeArchives.find(std::make_pair(run->name, run->build));
+            if(it != activeArchives.end()) {
+                listing = &it->second;
+                nArtifacts = listing->artifacts.size();
+            }
+            if(!listing || now - listing->scannedAt >= ACTIVE_ARTIFACTS_RESCAN)
+                scanArchive(run->name, run->build);
         }
         j.set("latestNum", int(buildNums[client->scope.job]));
-        j.startArray("artifacts");
-        populateArtifacts(j, client->scope.job, client->scope.num);
-        j.EndArray();
+        std::vector<Artifact> artifacts;
+        uint page = std::min(client->scope.page, nArtifacts == 0 ? 0 : (nArtifacts-1) / ARTIFACTS_PER_PAGE);
+        if(listing) {
+            auto first = listing->artifacts.begin() + std::min<size_t>(nArtifacts, page * ARTIFACTS_PER_PAGE);
+            auto last = listing->artifacts.begin() + std::min<size_t>(nArtifacts, (page + 1) * ARTIFACTS_PER_PAGE);
+            artifacts.assign(first, last);
+        } else if(nArtifacts > 0) {
+            std::string prefix = archiveUrl + "/" + client->scope.job + "/" + std::to_string(client->scope.num) + "/";
+            db->stmt("SELECT filename, size, mtime, IFNULL(hash,'') FROM artifacts WHERE name = ? AND number = ? ORDER BY filename LIMIT ?,?")
+            .bind(client->scope.job, client->scope.num, page * ARTIFACTS_PER_PAGE, ARTIFACTS_PER_PAGE)
+            .fetch<str, uintmax_t, time_t, str>([&](str filename, uintmax_t size, time_t mtime, str hash){
+                artifacts.push_back({prefix + filename, filename, size, mtime, hash});
+            });
+        }
+        writeArtifacts(j, artifacts, nArtifacts, page);
     } else if(client->scope.type == MonitorScope::JOB) {
         const uint runsPerPage = 10;
         j.startArray("recent");
@@ -228,16 +629,14 @@ void Laminar::sendStatus(LaminarClient* client) {
              .EndObject();
         });
         j.EndArray();
-        db->stmt("SELECT COUNT(*) FROM builds WHERE name = ?")
-        .bind(client->scope.job)
-        .fetch<uint>([&](uint nRuns){
-            j.set("pages", (nRuns-1) / runsPerPage + 1);
-            j.startObject("sort");
-            j.set("page", client->scope.page)
-             .set("field", client->scope.field)
-             .set("order", client->scope.order_desc ? "dsc" : "asc")
-             .EndObject();
-        });
+        auto stats = jobStats.find(client->scope.job);
+        uint nRuns = stats == jobStats.end() ? 0 : stats->second.count;
+        j.set("pages", nRuns == 0 ? 1 : (nRuns-1) / runsPerPage + 1);
+        j.startObject("sort");
+        j.set("page", client->scope.page)
+         .set("field", client->scope.field)
+         .set("order", client->scope.order_desc ? "dsc" : "asc")
+         .EndObject();
         j.startArray("running");
         auto p = activeJobs.byJobName().equal_range(client->scope.job);
         for(auto it = p.first; it != p.second; ++it) {
@@ -251,45 +650,41 @@ void Laminar::sendStatus(LaminarClient* client) {
             j.EndObject();
         }
         j.EndArray();
-        int nQueued = 0;
-        for(const auto& run : queuedJobs) {
-            if (run->name == client->scope.job) {
-                nQueued++;
-            }
-        }
-        j.set("nQueued", nQueued);
-        db->stmt("SELECT number,startedAt FROM builds WHERE name = ? AND result = ? ORDER BY completedAt DESC LIMIT 1")
-        .bind(client->scope.job, int(RunState::SUCCESS))
-        .fetch<int,time_t>([&](int build, time_t started){
+        j.set("nQueued", int(scheduler.queuedCount(client->scope.job)));
+        if(stats != jobStats.end() && stats->second.lastSuccessNumber) {
             j.startObject("lastSuccess");
-            j.set("number", build).set("started", started);
+            j.set("number", stats->second.lastSuccessNumber).set("started", stats->second.lastSuccessStarted);
             j.EndObject();
-        });
-        db->stmt("SELECT number,startedAt FROM builds WHERE name = ? AND result <> ? ORDER BY completedAt DESC LIMIT 1")
-        .bind(client->scope.job, int(RunState::SUCCESS))
-        .fetch<int,time_t>([&](int build, time_t started){
+        }
+        if(stats != jobStats.end() && stats->second.lastFailedNumber) {
             j.startObject("lastFailed");
-            j.set("number", build).set("started", started);
+            j.set("number", stats->second.lastFailedNumber).set("started", stats->second.lastFailedStarted);
             j.EndObject();
-        });
+        }
 
     } else if(client->scope.type == MonitorScope::ALL) {
         j.startArray("jobs");
-        db->stmt("SELECT name,number,startedAt,completedAt,result FROM builds GROUP BY name ORDER BY number DESC")
-        .fetch<str,uint,time_t,time_t,int>([&](str name,uint number, time_t started, time_t completed, int result){
+        std::vector<std::pair<const str, JobStats>*> jobs;
+        for(auto& it : jobStats)
+            jobs.push_back(&it);
+        std::sort(jobs.begin(), jobs.end(), [](const std::pair<const str, JobStats>* a, const std::pair<const str, JobStats>* b){
+            return a->second.lastNumber > b->second.lastNumber;
+        });
+        for(const auto* it : jobs) {
+            const JobStats& stats = it->second;
             j.StartObject();
-            j.set("name", name);
-            j.set("number", number);
-            j.set("result", to_string(RunState(result)));
-            j.set("started", started);
-            j.set("completed", completed);
+            j.set("name", it->first);
+            j.set("number", stats.lastNumber);
+            j.set("result", to_string(stats.lastResult));
+            j.set("started", stats.lastStarted);
+            j.set("completed", stats.lastCompleted);
             j.startArray("tags");
-            for(const str& t: jobTags[name]) {
+            for(const str& t: jobTags[it->first]) {
                 j.String(t.c_str());
             }
             j.EndArray();
             j.EndObject();
-        });
+        }
         j.EndArray();
         j.startArray("running");
         for(const auto& run : activeJobs.byStartedAt()) {
@@ -327,18 +722,16 @@ void Laminar::sendStatus(LaminarClient* client) {
             j.set("number", run->build);
             j.set("node", run->node->name);
             j.set("started", run->startedAt);
-            db->stmt("SELECT completedAt - startedAt FROM builds WHERE name = ? ORDER BY completedAt DESC LIMIT 1")
-             .bind(run->name)
-             .fetch<uint>([&](uint lastRuntime){
-                j.set("etc", run->startedAt + lastRuntime);
-            });
+            auto stats = jobStats.find(run->name);
+            if(stats != jobStats.end())
+                j.set("etc", run->startedAt + stats->second.estimatedDuration());
             j.EndObject();
         }
         j.EndArray();
         j.startArray("queued");
-        for(const auto& run : queuedJobs) {
+        for(const auto& queued : scheduler.queued()) {
             j.StartObject();
-            j.set("name", run->name);
+            j.set("name", queued.run->name);
             j.EndObject();
         }
         j.EndArray();
@@ -352,26 +745,34 @@ void Laminar::sendStatus(LaminarClient* client) {
         j.set("executorsTotal", execTotal);
         j.set("executorsBusy", execBusy);
         j.startArray("buildsPerDay");
-        for(int i = 6; i >= 0; --i) {
+        // results of builds completed on each of the last 7 days, fetched
+        // in a single query and binned by day
+        std::map<int, int> perDay[7];
+        time_t since = 86400*(now/86400 - 6);
+        db->stmt("SELECT (completedAt - ?) / 86400 AS day, result, COUNT(*) FROM builds "
+                 "WHERE completedAt > ? AND completedAt < ? GROUP BY day, result")
+                .bind(since, since, since + 7 * 86400)
+                .fetch<int,int,int>([&](int day, int result, int num){
+            if(day >= 0 && day < 7)
+                perDay[day][result] = num;
+        });
+        for(const auto& day : perDay) {
             j.StartObject();
-            db->stmt("SELECT result, COUNT(*) FROM builds WHERE completedAt > ? AND completedAt < ? GROUP by result")
-                    .bind(86400*(time(nullptr)/86400 - i), 86400*(time(nullptr)/86400 - (i-1)))
-                    .fetch<int,int>([&](int result, int num){
-                j.set(to_string(RunState(result)).c_str(), num);
-            });
+            for(const auto& it : day)
+                j.set(to_string(RunState(it.first)).c_str(), it.second);
             j.EndObject();
         }
         j.EndArray();
         j.startObject("buildsPerJob");
         db->stmt("SELECT name, COUNT(*) c FROM builds WHERE completedAt > ? GROUP BY name ORDER BY c DESC LIMIT 5")
-                .bind(time(nullptr) - 86400)
+                .bind(now - 86400)
                 .fetch<str, int>([&](str job, int count){
             j.set(job.c_str(), count);
         });
         j.EndObject();
         j.startObject("timePerJob");
         db->stmt("SELECT name, AVG(completedAt-startedAt) av FROM builds WHERE completedAt > ? GROUP BY name ORDER BY av DESC LIMIT 5")
-                .bind(time(nullptr) - 7 * 86400)
+                .bind(now - 7 * 86400)
                 .fetch<str, uint>([&](str job, uint time){
             j.set(job.c_str(), time);
         });
@@ -379,12 +780,19 @@ void Laminar::sendStatus(LaminarClient* client) {
 
     }
     j.EndObject();
-    client->sendMessage(j.str());
+    Message msg = j.message();
+    if(cacheable) {
+        snapshots[client->scope.type] = msg;
+        snapshotTime = now;
+    }
+    client->sendMessage(msg);
 }
 
 Laminar::~Laminar() {
-    delete db;
+    // joins the background threads, which may still use completionDb
     delete srv;
+    delete completionDb;
+    delete db;
 }
 
 void Laminar::run() {
@@ -392,18 +800,39 @@ void Laminar::run() {
     const char* listen_http = getenv("LAMINAR_BIND_HTTP") ?: INTADDR_HTTP_DEFAULT;
 
     srv = new Server(*this, listen_rpc, listen_http);
+    srv->addWatchPath(fs::path(fs::path(homeDir)/"cfg").string().c_str());
     srv->addWatchPath(fs::path(fs::path(homeDir)/"cfg"/"nodes").string().c_str());
     srv->addWatchPath(fs::path(fs::path(homeDir)/"cfg"/"jobs").string().c_str());
+    if(objects) {
+        // reclaim the objects of archives removed while laminard was not
+        // running. Completes independently of the returned promise
+        srv->runInBackground([this]{
+            uintmax_t reclaimed = objects->collect();
+            LLOG(INFO, "Removed unreferenced archive objects", reclaimed);
+        });
+    }
+    // start the runs requeued from the journal
+    assignNewJobs();
+    retentionTask = scheduleRetention(RETENTION_START_DELAY).eagerlyEvaluate(nullptr);
     srv->start();
+    // a pass in progress is abandoned at shutdown
+    retentionStopped = true;
+    retentionTask = nullptr;
 }
 
 void Laminar::stop() {
     srv->stop();
 }
 
+void Laminar::dumpProfile() {
+    if(srv)
+        srv->dumpProfile();
+}
+
 bool Laminar::loadConfiguration() {
     if(const char* ndirs = getenv("LAMINAR_KEEP_RUNDIRS"))
         numKeepRunDirs = static_cast<uint>(atoi(ndirs));
+    supervisorPath = getenv("LAMINAR_SUPERVISOR") ?: "";
 
     std::set<std::string> knownNodes;
 
@@ -418,9 +847,14 @@ bool Laminar::loadConfiguration() {
 
             std::string nodeName = it->path().stem().string();
             auto existingNode = nodes.find(nodeName);
+            if(existingNode != nodes.end() && existingNode->second->agent) {
+                LLOG(WARNING, "Ignoring node configuration with the name of an agent", nodeName);
+                continue;
+            }
             std::shared_ptr<Node> node = existingNode == nodes.end() ? nodes.emplace(nodeName, std::shared_ptr<Node>(new Node)).first->second : existingNode->second;
             node->name = nodeName;
             node->numExecutors = conf.get<int>("EXECUTORS", 6);
+            node->resources = parseResources(conf.get<std::string>("RESOURCES"));
 
             std::string tags = conf.get<std::string>("TAGS");
             if(!tags.empty()) {
@@ -439,7 +873,7 @@ bool Laminar::loadConfiguration() {
     // remove any nodes whose config files disappeared.
     // if there are no known nodes, take care not to remove and re-add the default node
     for(auto it = nodes.begin(); it != nodes.end();) {
-        if((it->first == "" && knownNodes.size() == 0) || knownNodes.find(it->first) != knownNodes.end())
+        if((it->first == "" && knownNodes.size() == 0) || knownNodes.find(it->first) != knownNodes.end() || it->second->agent)
             it++;
         else
             it = nodes.erase(it);
@@ -453,39 +887,83 @@ bool Laminar::loadConfiguration() {
         nodes.emplace("", node);
     }
 
-    fs::path jobsDir = fs::path(homeDir)/"cfg"/"jobs";
-    if(fs::is_directory(jobsDir)) {
-        for(fs::directory_iterator it(jobsDir); it != fs::directory_iterator(); ++it) {
-            if(!fs::is_regular_file(it->status()) || it->path().extension() != ".conf")
+    // Remember which configuration files exist so that runs can be
+    // assembled without touching the filesystem. Kept up to date by
+    // notifyConfigChanged
+    cfgFiles.clear();
+    jobConfs.clear();
+    jobTags.clear();
+    jobDemands.clear();
+    fs::path cfgDir = fs::path(homeDir)/"cfg";
+    for(std::string sub : {"", "jobs/", "nodes/"}) {
+        fs::path dir = cfgDir/sub;
+        if(!fs::is_directory(dir))
+            continue;
+        for(fs::directory_iterator it(dir); it != fs::directory_iterator(); ++it) {
+            if(!fs::is_regular_file(it->status()))
                 continue;
-
-            StringMap conf = parseConfFile(it->path().string().c_str());
-
-            std::string tags = conf.get<std::string>("TAGS");
-            if(!tags.empty()) {
-                std::istringstream iss(tags);
-                std::set<std::string> tagList;
-                std::string tag;
-                while(std::getline(iss, tag, ','))
-                    tagList.insert(tag);
-                jobTags[it->path().stem().string()] = tagList;
-            }
-
+            cfgFiles.insert(sub + it->path().filename().string());
+            if(sub == "jobs/" && it->path().extension() == ".conf")
+                loadJobConf(it->path().stem().string());
         }
     }
 
+    scheduler.configure(nodes, jobTags, jobDemands);
+
+    // tags and executor counts are part of the status snapshots
+    snapshots.clear();
     return true;
 }
 
 std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params) {
-    if(!fs::exists(fs::path(homeDir)/"cfg"/"jobs"/name+".run")) {
+    LoopSection section("queueJob");
+    if(!cfgExists("jobs/" + name + ".run")) {
         LLOG(ERROR, "Non-existent job", name);
         return nullptr;
     }
 
+    time_t queuedAt = time(nullptr);
+    ParamMap recorded = params;
+    std::shared_ptr<Run> run = createRun(name, std::move(params), queuedAt);
+    auto conf = jobConfs.find(name);
+    if(conf != jobConfs.end() && conf->second.coalesce) {
+        // the caller waits for the run already queued instead
+        bool raised = false;
+        if(std::shared_ptr<Run> queued = scheduler.coalesce(*run, &raised)) {
+            LLOG(INFO, "Coalesced queued run", name, queued->priority);
+            // so that the run is requeued with its new priority after a restart
+            if(raised)
+                journal.changed(queued->journalId, "=priority", std::to_string(queued->priority));
+            snapshots.clear();
+            return queued;
+        }
+    }
+    run->journalId = journal.queued(name, recorded, queuedAt);
+    scheduler.queue(run);
+    snapshots.clear();
+
+    // notify clients
+    Json j;
+    j.set("type", "job_queued")
+        .startObject("data")
+        .set("name", name)
+        .EndObject();
+    Message msg = j.message();
+    clients.forStatus(name, 0, [&](LaminarClient* c){
+        c->sendMessage(msg);
+    });
+
+    assignNewJobs();
+    return run;
+}
+
+std::shared_ptr<Run> Laminar::createRun(std::string name, ParamMap params, time_t queuedAt) {
     std::shared_ptr<Run> run = std::make_shared<Run>();
     run->name = name;
-    run->queuedAt = time(nullptr);
+    run->queuedAt = queuedAt;
+    auto conf = jobConfs.find(name);
+    if(conf != jobConfs.end())
+        run->priority = conf->second.priority;
     for(auto it = params.begin(); it != params.end();) {
         if(it->first[0] == '=') {
             if(it->first == "=parentJob") {
@@ -494,6 +972,8 @@ std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params) {
                 run->parentBuild = atoi(it->second.c_str());
             } else if(it->first == "=reason") {
                 run->reasonMsg = it->second;
+            } else if(it->first == "=priority") {
+                run->priority = atoi(it->second.c_str());
             } else {
                 LLOG(ERROR, "Unknown internal job parameter", it->first);
             }
@@ -501,28 +981,155 @@ std::shared_ptr<Run> Laminar::queueJob(std::string name, ParamMap params) {
         } else
             ++it;
     }
-    run->params = params;
-    queuedJobs.push_back(run);
+    run->params = std::move(params);
+    return run;
+}
 
-    // notify clients
-    Json j;
-    j.set("type", "job_queued")
-        .startObject("data")
-        .set("name", name)
-        .EndObject();
-    const char* msg = j.str();
-    for(LaminarClient* c : clients) {
-        if(c->scope.wantsStatus(name))
-            c->sendMessage(msg);
+Journal::Entry Laminar::journalEntry(const Run& run) const {
+    Journal::Entry e;
+    e.id = run.journalId;
+    e.job = run.name;
+    e.params = run.params;
+    if(!run.parentName.empty()) {
+        e.params["=parentJob"] = run.parentName;
+        e.params["=parentBuild"] = std::to_string(run.parentBuild);
     }
+    if(!run.reasonMsg.empty())
+        e.params["=reason"] = run.reasonMsg;
+    // also keeps a priority raised by coalescing
+    e.params["=priority"] = std::to_string(run.priority);
+    e.queuedAt = run.queuedAt;
+    e.number = run.build;
+    e.node = run.node ? run.node->name : std::string();
+    e.startedAt = run.startedAt;
+    return e;
+}
+
+void Laminar::compactJournal() {
+    std::vector<Journal::Entry> live;
+    for(const Scheduler::QueuedRun& q : scheduler.queued())
+        live.push_back(journalEntry(*q.run));
+    for(const std::shared_ptr<Run>& run : activeJobs)
+        live.push_back(journalEntry(*run));
+    // the journal lists runs in the order they were queued
+    std::sort(live.begin(), live.end(), [](const Journal::Entry& a, const Journal::Entry& b){
+        return a.id < b.id;
+    });
+    // writing and syncing the new journal is left to a background thread
+    std::shared_ptr<Journal::Compaction> c = std::make_shared<Journal::Compaction>();
+    if(!journal.startCompact(live, *c))
+        return;
+    srv->addTask(srv->runInBackground([c]{
+        Journal::writeCompaction(*c);
+    }).then([this, c]{
+        journal.finishCompact(*c);
+    }));
+}
+
+void Laminar::loadJobConf(std::string name) {
+    fs::path path = fs::path(homeDir)/"cfg"/"jobs"/(name + ".conf");
+    jobConfs.erase(name);
+    jobTags.erase(name);
+    jobDemands.erase(name);
+    if(!fs::is_regular_file(path))
+        return;
 
+    StringMap conf = parseConfFile(path.string().c_str());
+
+    JobConf& jc = jobConfs[name];
+    jc.timeout = conf.get<int>("TIMEOUT", 0);
+    jc.cpuWeight = conf.get<int>("CPU_WEIGHT", 0);
+    jc.memoryMax = conf.get<std::string>("MEMORY_MAX");
+    jc.retention.keepRuns = static_cast<uint>(std::max(0, conf.get<int>("KEEP_RUNS", 0)));
+    jc.retention.keepDays = static_cast<uint>(std::max(0, conf.get<int>("KEEP_DAYS", 0)));
+    jc.retention.keepLastSuccess = conf.get<int>("KEEP_LAST_SUCCESS", 1) != 0;
+    jc.cloneWorkspace = conf.get<std::string>("WORKSPACE") == "clone";
+    jc.priority = conf.get<int>("PRIORITY", 0);
+    jc.coalesce = conf.get<int>("COALESCE", 0) != 0;
+
+    std::string tags = conf.get<std::string>("TAGS");
+    if(!tags.empty()) {
+        std::istringstream iss(tags);
+        std::set<std::string> tagList;
+        std::string tag;
+        while(std::getline(iss, tag, ','))
+            tagList.insert(tag);
+        jobTags[name] = tagList;
+    }
+
+    int slots = conf.get<int>("SLOTS", 1);
+    std::string resources = conf.get<std::string>("RESOURCES");
+    if(slots != 1 || !resources.empty()) {
+        Demand& demand = jobDemands[name];
+        // every run occupies at least one executor
+        demand.slots = std::max(slots, 1);
+        demand.resources = parseResources(resources);
+    }
+}
+
+bool Laminar::registerAgent(std::string name, int executors, std::set<std::string> tags, std::shared_ptr<Agent> agent) {
+    if(nodes.find(name) != nodes.end()) {
+        LLOG(ERROR, "Rejecting agent with the name of an existing node", name);
+        return false;
+    }
+    std::shared_ptr<Node> node(new Node);
+    node->name = name;
+    node->numExecutors = executors;
+    node->tags = tags;
+    node->agent = agent;
+    nodes.emplace(name, node);
+    LLOG(INFO, "Agent registered", name, executors);
+    scheduler.configure(nodes, jobTags, jobDemands);
+    snapshots.clear();
     assignNewJobs();
-    return run;
+    return true;
+}
+
+void Laminar::deregisterAgent(const Agent* agent) {
+    for(auto it = nodes.begin(); it != nodes.end(); ++it) {
+        if(it->second->agent.get() == agent) {
+            LLOG(INFO, "Agent deregistered", it->first);
+            nodes.erase(it);
+            scheduler.configure(nodes, jobTags, jobDemands);
+            snapshots.clear();
+            return;
+        }
+    }
 }
 
-void Laminar::notifyConfigChanged()
+void Laminar::notifyConfigChanged(std::string path)
 {
-    loadConfiguration();
+    LoopSection section("config reload");
+    std::string cfgDir = (fs::path(homeDir)/"cfg").string() + "/";
+    if(path.compare(0, cfgDir.size(), cfgDir) != 0) {
+        // unknown or unspecified change, reload everything
+        loadConfiguration();
+    } else if(path.compare(cfgDir.size(), std::string::npos, "jobs") == 0 ||
+              path.compare(cfgDir.size(), std::string::npos, "nodes") == 0) {
+        // A directory which was created after laminard started must be
+        // watched from now on. Files may have been placed in it before the
+        // watch was in place, and a removed or moved directory takes its
+        // files with it, so reload everything in either case
+        if(srv && fs::is_directory(path))
+            srv->addWatchPath(path.c_str());
+        loadConfiguration();
+    } else {
+        std::string rel = path.substr(cfgDir.size());
+        if(fs::is_regular_file(path))
+            cfgFiles.insert(rel);
+        else
+            cfgFiles.erase(rel);
+        fs::path p(rel);
+        if(p.extension() == ".conf" && p.parent_path() == "jobs") {
+            loadJobConf(p.stem().string());
+            scheduler.configure(nodes, jobTags, jobDemands);
+            snapshots.clear();
+        } else if(p.extension() == ".conf" && p.parent_path() == "nodes") {
+            loadConfiguration();
+        }
+        // other files are scripts and environment files, which are only
+        // looked up in cfgFiles
+    }
     // config change may allow stuck jobs to dequeue
     assignNewJobs();
 }
@@ -533,194 +1140,296 @@ void Laminar::abortAll() {
     }
 }
 
-bool Laminar::nodeCanQueue(const Node& node, const Run& run) const {
-    // if a node is too busy, it can't take the job
-    if(node.busyExecutors >= node.numExecutors)
+bool Laminar::tryStartRun(std::shared_ptr<Node> node, std::shared_ptr<Run> run, int queueIndex) {
+    fs::path cfgDir = fs::path(homeDir)/"cfg";
+    boost::system::error_code err;
+
+    auto conf = jobConfs.find(run->name);
+    // Runs on agents always use the agent's own workspace
+    bool cloneMode = conf != jobConfs.end() && conf->second.cloneWorkspace && !node->agent;
+    auto wsIt = cloneMode ? workspaces.find(run->name) : workspaces.end();
+    const WorkspaceState* wsState = wsIt != workspaces.end() ? &wsIt->second : nullptr;
+    // the base workspace may not be cloned before it is initialized
+    if(wsState && wsState->initializing)
         return false;
 
-    // if the node has no tags, allow the build
-    if(node.tags.size() == 0)
-        return true;
+    // create a workspace for this job if it doesn't exist
+    fs::path ws = fs::path(homeDir)/"run"/run->name/"workspace";
+    bool initWorkspace = false;
+    if(node->agent) {
+        // The workspace is on the agent's host. The agent only executes
+        // the init script if it does not exist there
+        if(cfgExists("jobs/" + run->name + ".init"))
+            run->addScript((cfgDir/"jobs"/run->name+".init").string(), ws.string(), true);
+    } else {
+        // nor may it be replaced while it is being cloned
+        if(wsState && wsState->cloning && !fs::exists(ws))
+            return false;
+        bool existed;
+        if(!makeDirectory(ws, existed)) {
+            LLOG(ERROR, "Could not create job workspace", run->name);
+            return false;
+        }
+        if(!existed) {
+            initWorkspace = true;
+            // prepend the workspace init script
+            if(cfgExists("jobs/" + run->name + ".init"))
+                run->addScript((cfgDir/"jobs"/run->name+".init").string(), ws.string(), true);
+        }
+    }
 
-    auto it = jobTags.find(run.name);
-    // if the job has no tags, it cannot be run on this node
-    if(it == jobTags.end())
+    uint buildNum = buildNums[run->name] + 1;
+    // create the run directory
+    fs::path rd = fs::path(homeDir)/"run"/run->name/std::to_string(buildNum);
+    bool existed;
+    if(!makeDirectory(rd, existed)) {
+        LLOG(ERROR, "Could not create working directory", rd.string());
         return false;
-
-    // otherwise, allow the build if job and node have a tag in common
-    for(const std::string& tag : it->second) {
-        if(node.tags.find(tag) != node.tags.end())
-            return true;
+    }
+    if(existed) {
+        LLOG(WARNING, "Working directory already exists, removing", rd.string());
+        fs::remove_all(rd, err);
+        if(err) {
+            LLOG(WARNING, "Failed to remove working directory", err.message());
+        } else if(!fs::create_directory(rd, err)) {
+            LLOG(ERROR, "Could not create working directory", rd.string());
+            return false;
+        }
+    }
+    run->runDir = rd.string();
+    // output is streamed to a compressed file in the run directory
+    run->log.open((rd/".laminar.log.gz").string());
+
+    // create an archive directory
+    fs::path archive = fs::path(homeDir)/"archive"/run->name/std::to_string(buildNum);
+    if(!makeDirectory(archive, existed)) {
+        LLOG(ERROR, "Could not create archive directory", archive.string());
+        return false;
+    } else if(existed) {
+        LLOG(WARNING, "Archive directory already exists", archive.string());
     }
 
-    return false;
-}
-
-bool Laminar::tryStartRun(std::shared_ptr<Run> run, int queueIndex) {
-    for(auto& sn : nodes) {
-        std::shared_ptr<Node> node = sn.second;
-        if(nodeCanQueue(*node.get(), *run)) {
-            fs::path cfgDir = fs::path(homeDir)/"cfg";
-            boost::system::error_code err;
+    // add scripts
+    // global before-run script
+    if(cfgExists("before"))
+        run->addScript((cfgDir/"before").string());
+    // per-node before-run script
+    if(cfgExists("nodes/" + node->name + ".before"))
+        run->addScript((cfgDir/"nodes"/node->name+".before").string());
+    // job before-run script
+    if(cfgExists("jobs/" + run->name + ".before"))
+        run->addScript((cfgDir/"jobs"/run->name+".before").string());
+    // main run script. must exist.
+    run->addScript((cfgDir/"jobs"/run->name+".run").string());
+    // job after-run script
+    if(cfgExists("jobs/" + run->name + ".after"))
+        run->addScript((cfgDir/"jobs"/run->name+".after").string());
+    // per-node after-run script
+    if(cfgExists("nodes/" + node->name + ".after"))
+        run->addScript((cfgDir/"nodes"/node->name+".after").string());
+    // global after-run script
+    if(cfgExists("after"))
+        run->addScript((cfgDir/"after").string());
+
+    // add environment files
+    if(cfgExists("env"))
+        run->addEnv((cfgDir/"env").string());
+    if(cfgExists("nodes/" + node->name + ".env"))
+        run->addEnv((cfgDir/"nodes"/node->name+".env").string());
+    if(cfgExists("jobs/" + run->name + ".env"))
+        run->addEnv((cfgDir/"jobs"/run->name+".env").string());
+
+    // add job timeout if specified
+    if(conf != jobConfs.end()) {
+        int timeout = conf->second.timeout;
+        if(timeout > 0) {
+            // A raw pointer to run is used here so as not to have a circular reference.
+            // The captured raw pointer is safe because if the Run is destroyed the Promise
+            // will be cancelled and the callback never called.
+            Run* r = run.get();
+            r->timeout = srv->addTimeout(timeout, [r](){
+                r->abort();
+            });
+        }
+    }
 
-            // create a workspace for this job if it doesn't exist
-            fs::path ws = fs::path(homeDir)/"run"/run->name/"workspace";
-            if(!fs::exists(ws)) {
-                if(!fs::create_directories(ws, err)) {
-                    LLOG(ERROR, "Could not create job workspace", run->name);
-                    break;
+    // give the run its own cgroup if configured. Runs may still proceed
+    // without one
+    if(!cgroupPath.empty() && !node->agent) {
+        std::unique_ptr<Cgroup> cg(new Cgroup);
+        if(cg->create(cgroupPath + "/" + run->name + "." + std::to_string(buildNum))) {
+            if(conf != jobConfs.end()) {
+                if(conf->second.cpuWeight > 0 && !cg->setCpuWeight(conf->second.cpuWeight)) {
+                    LLOG(WARNING, "Could not set CPU_WEIGHT", run->name, conf->second.cpuWeight);
                 }
-                // prepend the workspace init script
-                if(fs::exists(cfgDir/"jobs"/run->name+".init"))
-                    run->addScript((cfgDir/"jobs"/run->name+".init").string(), ws.string());
-            }
-
-            uint buildNum = buildNums[run->name] + 1;
-            // create the run directory
-            fs::path rd = fs::path(homeDir)/"run"/run->name/std::to_string(buildNum);
-            bool createWorkdir = true;
-            if(fs::is_directory(rd)) {
-                LLOG(WARNING, "Working directory already exists, removing", rd.string());
-                fs::remove_all(rd, err);
-                if(err) {
-                    LLOG(WARNING, "Failed to remove working directory", err.message());
-                    createWorkdir = false;
+                if(!conf->second.memoryMax.empty() && !cg->setMemoryMax(conf->second.memoryMax)) {
+                    LLOG(WARNING, "Could not set MEMORY_MAX", run->name, conf->second.memoryMax);
                 }
             }
-            if(createWorkdir && !fs::create_directory(rd, err)) {
-                LLOG(ERROR, "Could not create working directory", rd.string());
-                break;
-            }
-            run->runDir = rd.string();
-
-            // create an archive directory
-            fs::path archive = fs::path(homeDir)/"archive"/run->name/std::to_string(buildNum);
-            if(fs::is_directory(archive)) {
-                LLOG(WARNING, "Archive directory already exists", archive.string());
-            } else if(!fs::create_directories(archive)) {
-                LLOG(ERROR, "Could not create archive directory", archive.string());
-                break;
-            }
+            run->cgroup = std::move(cg);
+        } else {
+            LLOG(ERROR, "Could not create cgroup", run->name, strerror(errno));
+        }
+    }
 
-            // add scripts
-            // global before-run script
-            if(fs::exists(cfgDir/"before"))
-                run->addScript((cfgDir/"before").string());
-            // per-node before-run script
-            if(fs::exists(cfgDir/"nodes"/node->name+".before"))
-                run->addScript((cfgDir/"nodes"/node->name+".before").string());
-            // job before-run script
-            if(fs::exists(cfgDir/"jobs"/run->name+".before"))
-                run->addScript((cfgDir/"jobs"/run->name+".before").string());
-            // main run script. must exist.
-            run->addScript((cfgDir/"jobs"/run->name+".run").string());
-            // job after-run script
-            if(fs::exists(cfgDir/"jobs"/run->name+".after"))
-                run->addScript((cfgDir/"jobs"/run->name+".after").string());
-            // per-node after-run script
-            if(fs::exists(cfgDir/"nodes"/node->name+".after"))
-                run->addScript((cfgDir/"nodes"/node->name+".after").string());
-            // global after-run script
-            if(fs::exists(cfgDir/"after"))
-                run->addScript((cfgDir/"after").string());
-
-            // add environment files
-            if(fs::exists(cfgDir/"env"))
-                run->addEnv((cfgDir/"env").string());
-            if(fs::exists(cfgDir/"nodes"/node->name+".env"))
-                run->addEnv((cfgDir/"nodes"/node->name+".env").string());
-            if(fs::exists(cfgDir/"jobs"/run->name+".env"))
-                run->addEnv((cfgDir/"jobs"/run->name+".env").string());
-
-            // add job timeout if specified
-            if(fs::exists(cfgDir/"jobs"/run->name+".conf")) {
-                int timeout = parseConfFile(fs::path(cfgDir/"jobs"/run->name+".conf").string().c_str()).get<int>("TIMEOUT", 0);
-                if(timeout > 0) {
-                    // A raw pointer to run is used here so as not to have a circular reference.
-                    // The captured raw pointer is safe because if the Run is destroyed the Promise
-                    // will be cancelled and the callback never called.
-                    Run* r = run.get();
-                    r->timeout = srv->addTimeout(timeout, [r](){
-                        r->abort();
-                    });
-                }
-            }
+    // start the job. The scheduler takes the executors and resources
+    // the run needs once this returns
+    run->node = node;
+    run->startedAt = time(nullptr);
+    metrics.queueWait.observe(double(run->startedAt - run->queuedAt));
+    run->laminarHome = homeDir;
+    run->build = buildNum;
+    run->supervisor = supervisorPath;
+    // set the last known result if exists
+    auto stats = jobStats.find(run->name);
+    if(stats != jobStats.end())
+        run->lastResult = stats->second.lastResult;
+    // update next build number
+    buildNums[run->name] = buildNum;
+    journal.started(run->journalId, buildNum, node->name, run->startedAt);
+    snapshots.clear();
+
+    LLOG(INFO, "Queued job to node", run->name, run->build, node->name);
 
-            // start the job
-            node->busyExecutors++;
-            run->node = node;
-            run->startedAt = time(nullptr);
-            run->laminarHome = homeDir;
-            run->build = buildNum;
-            // set the last known result if exists
-            db->stmt("SELECT result FROM builds WHERE name = ? ORDER BY completedAt DESC LIMIT 1")
-             .bind(run->name)
-             .fetch<int>([=](int result){
-                run->lastResult = RunState(result);
-            });
-            // update next build number
-            buildNums[run->name] = buildNum;
-
-            LLOG(INFO, "Queued job to node", run->name, run->build, node->name);
-
-            // notify clients
-            Json j;
-            j.set("type", "job_started")
-             .startObject("data")
-             .set("queueIndex", queueIndex)
-             .set("name", run->name)
-             .set("queued", run->startedAt - run->queuedAt)
-             .set("started", run->startedAt)
-             .set("number", run->build)
-             .set("reason", run->reason());
-            db->stmt("SELECT completedAt - startedAt FROM builds WHERE name = ? ORDER BY completedAt DESC LIMIT 1")
-             .bind(run->name)
-             .fetch<uint>([&](uint etc){
-                j.set("etc", time(nullptr) + etc);
-            });
-            j.startArray("tags");
-            for(const str& t: jobTags[run->name]) {
-                j.String(t.c_str());
-            }
-            j.EndArray();
-            j.EndObject();
-            const char* msg = j.str();
-            for(LaminarClient* c : clients) {
-                if(c->scope.wantsStatus(run->name, run->build)
-                    // The run page also should know that another job has started
-                    // (so maybe it can show a previously hidden "next" button).
-                    // Hence this small hack:
-                        || (c->scope.type == MonitorScope::Type::RUN && c->scope.job == run->name))
-                    c->sendMessage(msg);
-            }
+    // notify clients
+    Json j;
+    j.set("type", "job_started")
+     .startObject("data")
+     .set("queueIndex", queueIndex)
+     .set("name", run->name)
+     .set("queued", run->startedAt - run->queuedAt)
+     .set("started", run->startedAt)
+     .set("number", run->build)
+     .set("reason", run->reason());
+    if(stats != jobStats.end())
+        j.set("etc", time(nullptr) + stats->second.estimatedDuration());
+    j.startArray("tags");
+    for(const str& t: jobTags[run->name]) {
+        j.String(t.c_str());
+    }
+    j.EndArray();
+    j.EndObject();
+    Message msg = j.message();
+    auto send = [&](LaminarClient* c){
+        c->sendMessage(msg);
+    };
+    clients.forGlobal(send);
+    clients.forJob(run->name, send);
+    // The run page also should know that another job has started
+    // (so maybe it can show a previously hidden "next" button).
+    // Hence this small hack:
+    clients.forRunsOf(run->name, send);
+
+    // notify the rpc clients if the start command was used
+    for(kj::Own<kj::PromiseFulfiller<void>>& f : run->startWaiters)
+        f->fulfill();
+    run->startWaiters.clear();
+    for(LaminarWaiter* w : waiters)
+        w->started(run.get());
+
+    // The run which initializes the base workspace works in it directly,
+    // the others in a private clone of it
+    kj::Promise<void> prepared = kj::READY_NOW;
+    if(initWorkspace && cloneMode) {
+        workspaces[run->name].initializing = run.get();
+    } else if(cloneMode) {
+        workspaces[run->name].cloning++;
+        run->workspace = (rd/"workspace").string();
+        run->preparing = true;
+        prepared = prepareWorkspace(run.get(), ws.string());
+    }
 
-            // notify the rpc client if the start command was used
-            run->started.fulfiller->fulfill();
+    // this actually spawns the first step
+    srv->addTask(prepared.then([this,run]{
+        return handleRunStep(run.get());
+    }).then([this,run]{
+        return runFinished(run.get()).attach(std::shared_ptr<Run>(run));
+    }));
 
-            // this actually spawns the first step
-            srv->addTask(handleRunStep(run.get()).then([this,run]{
-                runFinished(run.get());
-            }));
+    return true;
+}
 
-            return true;
+kj::Promise<void> Laminar::prepareWorkspace(Run* run, std::string base) {
+    std::shared_ptr<CloneStats> stats = std::make_shared<CloneStats>();
+    std::shared_ptr<bool> ok = std::make_shared<bool>(false);
+    auto start = std::chrono::steady_clock::now();
+    // A worker thread is not stopped by cancelling the promise, so it only
+    // gets copies of the paths. The continuation on the loop may use the
+    // run, which tryStartRun keeps alive until this promise completes
+    std::string dst = run->workspace;
+    return srv->runInBackground([base, dst, stats, ok]{
+        *ok = cloneTree(base, dst, *stats);
+    }).then([this, run, stats, ok, start]{
+        run->preparing = false;
+        if(*ok) {
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            LLOG(INFO, "Cloned workspace", run->name, run->build, stats->files, stats->reflinked, stats->copiedBytes, elapsed);
+            if(stats->reflinked < stats->files) {
+                LLOG(WARNING, "Workspace files were copied because they could not be reflinked", run->name, stats->files - stats->reflinked);
+            }
+        } else {
+            LLOG(ERROR, "Could not clone workspace", run->name, run->build, run->workspace);
+            run->abort();
+            run->result = RunState::FAILED;
         }
-    }
-    return false;
+        // a run waiting to recreate a removed base workspace may now start
+        if(--workspaces[run->name].cloning == 0) {
+            releaseWorkspace(run->name);
+            assignNewJobs();
+        }
+    });
+}
+
+void Laminar::releaseWorkspace(const std::string& job) {
+    // entries are only kept while the workspace is in use, so that jobs
+    // which were removed or no longer clone leave nothing behind
+    auto it = workspaces.find(job);
+    if(it != workspaces.end() && !it->second.initializing && it->second.cloning == 0)
+        workspaces.erase(it);
 }
 
 void Laminar::assignNewJobs() {
-    auto it = queuedJobs.begin();
-    while(it != queuedJobs.end()) {
-        if(tryStartRun(*it, std::distance(it, queuedJobs.begin()))) {
-            activeJobs.insert(*it);
-            it = queuedJobs.erase(it);
-        } else {
-            ++it;
+    LoopSection section("dispatch");
+    scheduler.dispatch([this](std::shared_ptr<Node> node, std::shared_ptr<Run> run, int queueIndex){
+        bool started;
+        {
+            ScopedTimer timer(metrics.dispatch);
+            started = tryStartRun(node, run, queueIndex);
         }
-    }
+        if(!started)
+            return false;
+        activeJobs.insert(run);
+        return true;
+    });
 }
 
 kj::Promise<void> Laminar::handleRunStep(Run* run) {
+    LoopSection section("run step");
+    auto onOutput = [this,run](const char*b,size_t n){
+        LoopSection section("run output");
+        // handle log output
+        run->log.append(b, n);
+        metrics.logBytes += n;
+        // Output is only copied for clients if any are watching. It is
+        // collected over the current turn of the event loop so that each
+        // client gets one message per run and turn, however many reads
+        // that took
+        if(!clients.watchingLog(run->name, run->build))
+            return;
+        pendingOutput[run].append(b, n);
+        if(!outputFlushScheduled) {
+            outputFlushScheduled = true;
+            srv->addTask(kj::evalLater([this]{
+                flushOutput();
+            }));
+        }
+    };
+
+    if(run->node->agent) {
+        // the agent executes all the scripts at once
+        return run->node->agent->execute(*run, onOutput);
+    }
+
     if(run->step()) {
         // no more steps
         return kj::READY_NOW;
@@ -729,15 +1438,18 @@ kj::Promise<void> Laminar::handleRunStep(Run* run) {
     kj::Promise<int> exited = srv->onChildExit(run->current_pid);
     // promise is fulfilled when the process is reaped. But first we wait for all
     // output from the pipe (Run::output_fd) to be consumed.
-    return srv->readDescriptor(run->output_fd, [this,run](const char*b,size_t n){
-        // handle log output
-        std::string s(b, n);
-        run->log += s;
-        for(LaminarClient* c : clients) {
-            if(c->scope.wantsLog(run->name, run->build))
-                c->sendMessage(s);
-        }
-    }).then([p = std::move(exited)]() mutable {
+    kj::Promise<void> output = srv->readDescriptor(run->output_fd, onOutput);
+    if(run->status_fd != -1) {
+        // A supervisor executes all the scripts in this step. The status of
+        // each is reported before the supervisor exits
+        kj::Promise<void> statuses = srv->readDescriptor(run->status_fd, [run](const char*b,size_t n){
+            run->statusReceived(b, n);
+        }).eagerlyEvaluate(nullptr);
+        output = output.then([s = kj::mv(statuses)]() mutable {
+            return kj::mv(s);
+        });
+    }
+    return output.then([p = std::move(exited)]() mutable {
         // wait until the process is reaped
         return kj::mv(p);
     }).then([this, run](int status){
@@ -747,67 +1459,28 @@ kj::Promise<void> Laminar::handleRunStep(Run* run) {
     });
 }
 
-void Laminar::runFinished(Run * r) {
-    std::shared_ptr<Node> node = r->node;
-
-    node->busyExecutors--;
+kj::Promise<void> Laminar::runFinished(Run * r) {
+    LoopSection section("runFinished");
     LLOG(INFO, "Run completed", r->name, to_string(r->result));
     time_t completedAt = time(nullptr);
 
-    // compress log
-    std::string maybeZipped = r->log;
-    size_t logsize = r->log.length();
-    if(r->log.length() >= COMPRESS_LOG_MIN_SIZE) {
-        std::string zipped(r->log.size(), '\0');
-        unsigned long zippedSize = zipped.size();
-        if(::compress((uint8_t*) zipped.data(), &zippedSize,
-            (const uint8_t*) r->log.data(), logsize) == Z_OK) {
-            zipped.resize(zippedSize);
-            std::swap(maybeZipped, zipped);
-        }
-    }
+    // log clients get all the output before the run is announced as
+    // completed, and the run may be destroyed once this completes
+    flushOutput();
 
-    std::string reason = r->reason();
-    db->stmt("INSERT INTO builds VALUES(?,?,?,?,?,?,?,?,?,?,?,?)")
-     .bind(r->name, r->build, node->name, r->queuedAt, r->startedAt, completedAt, int(r->result),
-           maybeZipped, logsize, r->parentName, r->parentBuild, reason)
-     .exec();
+    activeArchives.erase(std::make_pair(r->name, r->build));
 
-    // notify clients
-    Json j;
-    j.set("type", "job_completed")
-            .startObject("data")
-            .set("name", r->name)
-            .set("number", r->build)
-            .set("queued", r->startedAt - r->queuedAt)
-            .set("completed", completedAt)
-            .set("started", r->startedAt)
-            .set("result", to_string(r->result))
-            .set("reason", r->reason());
-    j.startArray("tags");
-    for(const str& t: jobTags[r->name]) {
-        j.String(t.c_str());
-    }
-    j.EndArray();
-    j.startArray("artifacts");
-    populateArtifacts(j, r->name, r->build);
-    j.EndArray();
-    j.EndObject();
-    const char* msg = j.str();
-    for(LaminarClient* c : clients) {
-        if(c->scope.wantsStatus(r->name, r->build))
-            c->sendMessage(msg);
+    // runs of the job waiting for its workspace to be initialized may
+    // now clone it
+    auto ws = workspaces.find(r->name);
+    if(ws != workspaces.end() && ws->second.initializing == r) {
+        ws->second.initializing = nullptr;
+        releaseWorkspace(r->name);
     }
 
-    // notify the waiters
-    for(LaminarWaiter* w : waiters) {
-        w->complete(r);
-    }
-
-    // erase reference to run from activeJobs. Since runFinished is called in a
-    // lambda whose context contains a shared_ptr<Run>, the run won't be deleted
-    // until the context is destroyed at the end of the lambda execution.
-    activeJobs.byRunPtr().erase(r);
+    // The log has already been compressed as it was produced, terminating
+    // the compressed stream here only flushes what remains
+    r->log.finish();
 
     // remove old run directories
     // We cannot count back the number of directories to keep from the currently
@@ -817,55 +1490,522 @@ void Laminar::runFinished(Run * r) {
     // from the oldest among them. If there are none, count back from the latest
     // known build number of this job, which may not be that of the run that
     // finished here.
-    auto it = activeJobs.byJobName().equal_range(r->name);
-    uint oldestActive = (it.first == it.second)? buildNums[r->name] : (*it.first)->build - 1;
-    for(int i = static_cast<int>(oldestActive - numKeepRunDirs); i > 0; i--) {
-        fs::path d = fs::path(homeDir)/"run"/r->name/std::to_string(i);
-        // Once the directory does not exist, it's probably not worth checking
-        // any further. 99% of the time this loop should only ever have 1 iteration
-        // anyway so hence this (admittedly debatable) optimization.
-        if(!fs::exists(d))
+    uint oldestActive = buildNums[r->name];
+    auto active = activeJobs.byJobName().equal_range(r->name);
+    for(auto it = active.first; it != active.second; ++it) {
+        if(it->get() != r) {
+            oldestActive = (*it)->build - 1;
             break;
-        fs::remove_all(d);
+        }
     }
+    int removeFrom = static_cast<int>(oldestActive - numKeepRunDirs);
+
+    // Everything that may block (moving the log, the database insert and
+    // walking or removing directories) happens in a background thread. The
+    // run is only announced as completed once it has been persisted.
+    std::shared_ptr<std::vector<Artifact>> artifacts = std::make_shared<std::vector<Artifact>>();
+    std::shared_ptr<std::string> logPath = std::make_shared<std::string>();
+    // The cgroup is taken from the run, so that an abort on the event loop
+    // does not use it while the background thread removes it
+    std::shared_ptr<Cgroup> cgroup(std::move(r->cgroup));
+    return srv->runInBackground([this, r, completedAt, removeFrom, artifacts, logPath, cgroup]{
+        size_t logsize = r->log.size();
+        Cgroup::Usage usage;
+        if(cgroup) {
+            usage = cgroup->usage();
+            // processes which outlived the run's scripts are not kept, and
+            // can no longer change the archive
+            cgroup->kill();
+        }
 
-    // in case we freed up an executor, check the queue
-    assignNewJobs();
+        *artifacts = scanArtifacts(r->name, r->build);
+        if(objects) {
+            fs::path dir = fs::path(homeDir)/"archive"/r->name/std::to_string(r->build);
+            for(Artifact& a : *artifacts) {
+                fs::path file = dir/a.filename;
+                a.hash = objects->add(file.string());
+                // a stored object keeps the modification time of the first
+                // file with its content
+                boost::system::error_code err;
+                a.mtime = fs::last_write_time(file, err);
+            }
+        }
+        commitCompletion([&](Database* conn){
+            // The database only records where the log is stored and its
+            // size. The log is stored while holding completionDbMutex so
+            // that pruneRuns cannot remove an identical log meanwhile
+            *logPath = storeLog(r->log);
+            recordRun(conn, *r, r->node->name, completedAt, logsize, *logPath);
+            if(cgroup) {
+                conn->stmt("UPDATE builds SET cpuUser = ?, cpuSystem = ?, memoryPeak = ? WHERE name = ? AND number = ?")
+                 .bind(usage.userUsec, usage.systemUsec, usage.memoryPeak, r->name, r->build)
+                 .exec();
+            }
+            storeArtifacts(conn, r->name, r->build, *artifacts);
+        });
+        if(cgroup)
+            cgroup->remove();
+
+        // a private workspace is not kept even if the run directory is
+        if(!r->workspace.empty()) {
+            boost::system::error_code err;
+            fs::remove_all(r->workspace, err);
+            if(err) {
+                LLOG(WARNING, "Could not remove cloned workspace", r->workspace, err.message());
+            }
+        }
+
+        for(int i = removeFrom; i > 0; i--) {
+            fs::path d = fs::path(homeDir)/"run"/r->name/std::to_string(i);
+            // Once the directory does not exist, it's probably not worth checking
+            // any further. 99% of the time this loop should only ever have 1 iteration
+            // anyway so hence this (admittedly debatable) optimization.
+            if(!fs::exists(d))
+                break;
+            boost::system::error_code err;
+            fs::remove_all(d, err);
+        }
+    }).then([this, r, completedAt, artifacts, logPath]{
+        LoopSection section("runFinished");
+        scheduler.finished(r);
+        jobStats[r->name].add(r->build, r->startedAt, completedAt, r->result);
+        snapshots.clear();
+
+        // notify clients
+        Json j;
+        j.set("type", "job_completed")
+                .startObject("data")
+                .set("name", r->name)
+                .set("number", r->build)
+                .set("queued", r->startedAt - r->queuedAt)
+                .set("completed", completedAt)
+                .set("started", r->startedAt)
+                .set("result", to_string(r->result))
+                .set("reason", r->reason());
+        j.startArray("tags");
+        for(const str& t: jobTags[r->name]) {
+            j.String(t.c_str());
+        }
+        j.EndArray();
+        // only the first page, further pages are fetched as status
+        std::vector<Artifact> firstPage(artifacts->begin(), artifacts->begin() + std::min<size_t>(artifacts->size(), ARTIFACTS_PER_PAGE));
+        writeArtifacts(j, firstPage, artifacts->size(), 0);
+        j.EndObject();
+        Message msg = j.message();
+        clients.forStatus(r->name, r->build, [&](LaminarClient* c){
+            c->sendMessage(msg);
+        });
+
+        // notify the waiters
+        for(LaminarWaiter* w : waiters) {
+            w->complete(r);
+        }
+
+        // erase reference to run from activeJobs. The promise returned by
+        // runFinished has a shared_ptr<Run> attached, so the run won't be
+        // deleted until this continuation has finished executing.
+        activeJobs.byRunPtr().erase(r);
+
+        journal.finished(r->journalId);
+        if(journal.length() > JOURNAL_COMPACT_RECORDS)
+            compactJournal();
+
+        // The log only becomes searchable after the run is announced, so
+        // that indexing a long log does not hold up the run's completion
+        if(logSearch && !logPath->empty()) {
+            srv->addTask(indexLog(std::make_shared<LogIndexing>(r->name, r->build, completedAt, *logPath)));
+        }
+
+        // in case we freed up an executor, check the queue
+        assignNewJobs();
+    });
 }
 
-class MappedFileImpl : public MappedFile {
-public:
-    MappedFileImpl(const char* path) :
-        fd(open(path, O_RDONLY)),
-        sz(0),
-        ptr(nullptr)
+// The progress of adding a stored log to the LogIndex
+struct LogIndexing {
+    LogIndexing(std::string job, uint num, time_t completedAt, std::string logPath) :
+        job(job), num(num), completedAt(completedAt), logPath(logPath) {}
+    std::string job;
+    uint num;
+    time_t completedAt;
+    std::string logPath;
+    // opened by the first batch
+    std::unique_ptr<MappedFileImpl> file;
+    LogLines index;
+    long id = 0;
+    uint64_t line = 0;
+};
+
+kj::Promise<void> Laminar::indexLog(std::shared_ptr<LogIndexing> state) {
+    std::shared_ptr<bool> more = std::make_shared<bool>(false);
+    return srv->runInBackground([this, state, more]{
+        *more = indexLogBatch(*state);
+    }).then([this, state, more]() -> kj::Promise<void> {
+        if(!*more)
+            return kj::READY_NOW;
+        // Each batch is queued anew, behind the work queued meanwhile such
+        // as the completions of other runs
+        return indexLog(state);
+    });
+}
+
+bool Laminar::indexLogBatch(LogIndexing& state) {
+    if(!state.file) {
+        fs::path path = fs::path(homeDir)/"logs"/state.logPath;
+        state.file.reset(new MappedFileImpl(path.c_str()));
+        // without its index, the log could only be decompressed in full
+        if(!state.file->address() || !state.index.read(path.string() + ".idx")) {
+            LLOG(WARNING, "Log not indexed for search", state.job, state.num, state.logPath);
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(completionDbMutex);
+        completionDb->exec("BEGIN TRANSACTION");
+        state.id = LogIndex::begin(*completionDb, state.job, state.num, state.completedAt);
+        completionDb->exec("COMMIT");
+    }
+    const uint64_t maxLines = uint64_t(1) << LogIndex::LINE_BITS;
+    if(state.line >= state.index.lines || state.line >= maxLines)
+        return false;
+    LogRange range;
+    range.unit = LogRange::LINES;
+    range.first = state.line;
+    range.last = state.line + LOG_INDEX_BATCH_LINES;
+    range.limit = LOG_INDEX_BATCH_BYTES;
+    LogSlice slice;
+    if(!sliceLog(state.file->address(), state.file->size(), &state.index, range, slice)) {
+        LLOG(ERROR, "Failed to read log for indexing", state.logPath);
+        return false;
+    }
+    if(slice.text.empty())
+        return false;
     {
-        if(fd == -1) return;
-        struct stat st;
-        if(fstat(fd, &st) != 0) return;
-        sz = st.st_size;
-        ptr = mmap(nullptr, sz, PROT_READ, MAP_SHARED, fd, 0);
-        if(ptr == MAP_FAILED)
-            ptr = nullptr;
+        std::lock_guard<std::mutex> lock(completionDbMutex);
+        completionDb->exec("BEGIN TRANSACTION");
+        LogIndex::addLines(*completionDb, state.id, slice.line, slice.text);
+        completionDb->exec("COMMIT");
     }
-    ~MappedFileImpl() override {
-        if(ptr)
-            munmap(ptr, sz);
-        if(fd != -1)
-            close(fd);
+    // A slice which ends within a line reached the byte limit, and the
+    // rest of that line is skipped
+    uint64_t lines = static_cast<uint64_t>(std::count(slice.text.begin(), slice.text.end(), '\n'));
+    if(slice.text.back() != '\n')
+        lines++;
+    state.line = slice.line + lines;
+    return true;
+}
+
+bool Laminar::recordRun(Database* db, const Run& run, const std::string& node, time_t completedAt,
+                        size_t logsize, const std::string& logPath) {
+    bool inserted = db->stmt("INSERT OR IGNORE INTO builds(name, number, node, queuedAt, startedAt, completedAt, result, "
+                             "outputLen, parentJob, parentBuild, reason, logPath) VALUES(?,?,?,?,?,?,?,?,?,?,?,?)")
+     .bind(run.name, run.build, node, run.queuedAt, run.startedAt, completedAt, int(run.result),
+           logsize, run.parentName, run.parentBuild, run.reason(), logPath)
+     .exec() && db->changes() > 0;
+    if(!inserted)
+        return false;
+    db->stmt("INSERT OR IGNORE INTO jobs VALUES(?,0,0)")
+     .bind(run.name)
+     .exec();
+    db->stmt("UPDATE jobs SET lastNumber = MAX(lastNumber, ?), runCount = runCount + 1 WHERE name = ?")
+     .bind(run.build, run.name)
+     .exec();
+    return true;
+}
+
+kj::Promise<void> Laminar::applyRetention() {
+    // copied, since the configuration may be reloaded during the pass
+    std::vector<std::pair<std::string, RetentionPolicy>> policies;
+    for(const auto& it : jobConfs) {
+        if(it.second.retention.limited())
+            policies.emplace_back(it.first, it.second.retention);
     }
-    virtual const void* address() override { return ptr; }
-    virtual size_t size() override { return sz; }
-private:
-    int fd;
-    size_t sz;
-    void* ptr;
-};
+    std::shared_ptr<std::unordered_map<std::string, uint>> removed = std::make_shared<std::unordered_map<std::string, uint>>();
+    return srv->runInBackground([this, policies, removed]{
+        time_t now = time(nullptr);
+        for(const auto& it : policies) {
+            std::vector<CompletedRun> runs;
+            {
+                std::lock_guard<std::mutex> lock(completionDbMutex);
+                completionDb->stmt("SELECT number, completedAt, result FROM builds WHERE name = ? ORDER BY number DESC")
+                 .bind(it.first)
+                 .fetch<uint,time_t,int>([&](uint number, time_t completed, int result){
+                    runs.push_back({number, completed, RunState(result)});
+                });
+            }
+            std::vector<uint> expired = expiredRuns(it.second, runs, now);
+            for(size_t i = 0; i < expired.size() && !retentionStopped; i += RETENTION_BATCH_RUNS) {
+                std::vector<uint> batch(expired.begin() + i, expired.begin() + std::min(expired.size(), i + RETENTION_BATCH_RUNS));
+                pruneRuns(it.first, batch);
+                (*removed)[it.first] += batch.size();
+                std::this_thread::sleep_for(std::chrono::milliseconds(RETENTION_BATCH_PAUSE_MS));
+            }
+        }
+        if(objects && !removed->empty()) {
+            uintmax_t reclaimed = objects->collect();
+            LLOG(INFO, "Removed unreferenced archive objects", reclaimed);
+        }
+    }).then([this, removed]{
+        for(const auto& it : *removed) {
+            LLOG(INFO, "Removed expired runs", it.first, it.second);
+            JobStats& stats = jobStats[it.first];
+            stats.count -= std::min(stats.count, it.second);
+        }
+        if(!removed->empty())
+            snapshots.clear();
+    });
+}
+
+kj::Promise<void> Laminar::scheduleRetention(int seconds) {
+    return srv->addTimeout(seconds, []{}).then([this]{
+        return applyRetention();
+    }).then([this]{
+        return scheduleRetention(RETENTION_INTERVAL);
+    });
+}
+
+void Laminar::pruneRuns(const std::string& job, const std::vector<uint>& numbers) {
+    {
+        std::lock_guard<std::mutex> lock(completionDbMutex);
+        std::vector<std::string> logs;
+        completionDb->exec("BEGIN TRANSACTION");
+        for(uint n : numbers) {
+            completionDb->stmt("SELECT logPath FROM builds WHERE name = ? AND number = ?")
+             .bind(job, n)
+             .fetch<str>([&](str path){
+                if(!path.empty())
+                    logs.push_back(path);
+            });
+            completionDb->stmt("DELETE FROM builds WHERE name = ? AND number = ?")
+             .bind(job, n)
+             .exec();
+            completionDb->stmt("DELETE FROM artifacts WHERE name = ? AND number = ?")
+             .bind(job, n)
+             .exec();
+            if(logSearch)
+                LogIndex::remove(*completionDb, job, n);
+        }
+        completionDb->stmt("UPDATE jobs SET runCount = MAX(runCount - ?, 0) WHERE name = ?")
+         .bind(uint(numbers.size()), job)
+         .exec();
+        completionDb->exec("COMMIT");
+        for(const std::string& path : logs) {
+            bool referenced = false;
+            completionDb->stmt("SELECT 1 FROM builds WHERE logPath = ? LIMIT 1")
+             .bind(path)
+             .fetch<int>([&](int){ referenced = true; });
+            if(!referenced) {
+                boost::system::error_code err;
+                fs::remove(fs::path(homeDir)/"logs"/path, err);
+                fs::remove(fs::path(homeDir)/"logs"/(path + ".idx"), err);
+            }
+        }
+        completionDb->exec(("PRAGMA incremental_vacuum(" + std::to_string(RETENTION_VACUUM_PAGES) + ")").c_str());
+    }
+    for(uint n : numbers) {
+        boost::system::error_code err;
+        fs::remove_all(fs::path(homeDir)/"archive"/job/std::to_string(n), err);
+        fs::remove_all(fs::path(homeDir)/"run"/job/std::to_string(n), err);
+    }
+}
+
+void Laminar::commitCompletion(std::function<void(Database*)> write) {
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(completionQueueMutex);
+        completionQueue.push_back(std::move(write));
+        seq = ++completionsQueued;
+    }
+    std::lock_guard<std::mutex> lock(completionDbMutex);
+    std::vector<std::function<void(Database*)>> batch;
+    uint64_t last;
+    {
+        std::lock_guard<std::mutex> qlock(completionQueueMutex);
+        // committed by the thread which held completionDbMutex before
+        if(completionsCommitted >= seq)
+            return;
+        batch.swap(completionQueue);
+        last = completionsQueued;
+    }
+    completionDb->exec("BEGIN TRANSACTION");
+    for(auto& w : batch)
+        w(completionDb);
+    completionDb->exec("COMMIT");
+    std::lock_guard<std::mutex> qlock(completionQueueMutex);
+    completionsCommitted = last;
+}
+
+std::string Laminar::storeLog(RunLog& log) {
+    // Logs are named by the hash of their compressed content, so identical
+    // logs (common for trivial jobs) are only stored once
+    const std::string& digest = log.digest();
+    if(digest.empty())
+        return std::string();
+    std::string relPath = digest.substr(0, 2) + "/" + digest + ".gz";
+    fs::path dest = fs::path(homeDir)/"logs"/relPath;
+    // the index of an identical log is identical, but may be missing if
+    // that log was stored before indexes were kept
+    std::string index = dest.string() + ".idx";
+    if(fs::exists(dest)) {
+        if(!fs::exists(index))
+            log.lineIndex().write(index);
+        return relPath;
+    }
+    boost::system::error_code err;
+    fs::create_directories(dest.parent_path(), err);
+    if(!log.moveTo(dest.string())) {
+        LLOG(ERROR, "Failed to store log", dest.string());
+        return std::string();
+    }
+    if(!log.lineIndex().write(index)) {
+        LLOG(WARNING, "Failed to store log index", index);
+    }
+    return relPath;
+}
+
+kj::Own<MappedFile> Laminar::getLog(std::string job, uint num) {
+    std::string logPath;
+    db->stmt("SELECT logPath FROM builds WHERE name = ? AND number = ?")
+     .bind(job, num)
+     .fetch<str>([&](str path){
+        logPath = path;
+    });
+    // Runs in progress and runs stored before the log store was introduced
+    // have no log file. An empty path results in a MappedFile with no data
+    fs::path file = logPath.empty() ? fs::path() : fs::path(homeDir)/"logs"/logPath;
+    return kj::heap<MappedFileImpl>(file.c_str());
+}
+
+bool Laminar::getLogSlice(std::string job, uint num, const LogRange& range, LogSlice& slice) {
+    // the live log is read back from the file it is being streamed to
+    if(Run* run = activeRun(job, num))
+        return run->log.slice(range, slice);
+    bool found = false;
+    db->stmt("SELECT output, outputLen, logPath FROM builds WHERE name = ? AND number = ?")
+      .bind(job, num)
+      .fetch<str,int,str>([&](str maybeZipped, unsigned long sz, str logPath) {
+        if(!logPath.empty()) {
+            fs::path path = fs::path(homeDir)/"logs"/logPath;
+            MappedFileImpl file(path.c_str());
+            // logs stored before their index was kept are decompressed
+            // in full
+            LogLines index;
+            bool indexed = index.read(path.string() + ".idx");
+            found = file.address() && sliceLog(file.address(), file.size(), indexed ? &index : nullptr, range, slice);
+            if(!found) {
+                LLOG(ERROR, "Failed to read stored log", logPath);
+            }
+        } else if(sz >= COMPRESS_LOG_MIN_SIZE) {
+            // logs from before the log store was introduced were kept in
+            // the database, compressed if large enough
+            found = sliceLog(maybeZipped.data(), maybeZipped.size(), nullptr, range, slice);
+            if(!found) {
+                LLOG(ERROR, "Failed to uncompress log");
+            }
+        } else {
+            sliceText(maybeZipped, range, slice);
+            found = true;
+        }
+    });
+    return found;
+}
 
 kj::Own<MappedFile> Laminar::getArtefact(std::string path) {
     return kj::heap<MappedFileImpl>(fs::path(fs::path(homeDir)/"archive"/path).c_str());
 }
 
+std::string Laminar::getMetrics() {
+    typedef MetricsWriter W;
+    W w;
+
+    std::map<std::string, uint> queued;
+    for(const Scheduler::QueuedRun& q : scheduler.queued())
+        queued[q.run->name]++;
+    w.family("laminar_queued_runs", "gauge", "Runs waiting for an executor");
+    for(const auto& it : queued)
+        w.sample("laminar_queued_runs", W::label("job", it.first), it.second);
+
+    std::map<std::pair<std::string, std::string>, uint> active;
+    for(const std::shared_ptr<Run>& run : activeJobs)
+        active[std::make_pair(run->name, run->node->name)]++;
+    w.family("laminar_active_runs", "gauge", "Runs in progress");
+    for(const auto& it : active)
+        w.sample("laminar_active_runs", W::label("job", it.first.first) + "," + W::label("node", it.first.second), it.second);
+
+    w.family("laminar_executors", "gauge", "Executors of each node");
+    for(const auto& it : nodes)
+        w.sample("laminar_executors", W::label("node", it.first), it.second->numExecutors);
+    w.family("laminar_executors_busy", "gauge", "Executors occupied by runs in progress");
+    for(const auto& it : nodes)
+        w.sample("laminar_executors_busy", W::label("node", it.first), it.second->busyExecutors);
+
+    static const char* scopes[] = { "home", "all", "job", "run", "log" };
+    w.family("laminar_clients", "gauge", "Connected status and log clients");
+    for(int t = MonitorScope::HOME; t <= MonitorScope::LOG; ++t)
+        w.sample("laminar_clients", W::label("scope", scopes[t]), clients.count(MonitorScope::Type(t)));
+    w.family("laminar_websocket_clients", "gauge", "Open websocket connections");
+    w.sample("laminar_websocket_clients", std::string(), metrics.websocketClients);
+    w.family("laminar_websocket_queued_bytes", "gauge", "Bytes waiting to be sent to websocket clients");
+    w.sample("laminar_websocket_queued_bytes", std::string(), metrics.websocketQueuedBytes);
+    w.family("laminar_websocket_dropped_total", "counter", "Websocket clients disconnected for being too slow");
+    w.sample("laminar_websocket_dropped_total", std::string(), metrics.websocketDropped);
+    w.family("laminar_websocket_queued_bytes_total", "counter", "Bytes queued for websocket clients");
+    w.sample("laminar_websocket_queued_bytes_total", std::string(), metrics.websocketQueuedBytesTotal);
+    w.family("laminar_websocket_dropped_bytes_total", "counter", "Bytes discarded unsent from the queues of websocket clients");
+    w.sample("laminar_websocket_dropped_bytes_total", std::string(), metrics.websocketDroppedBytes);
+
+    w.family("laminar_log_bytes_total", "counter", "Bytes of output produced by runs");
+    w.sample("laminar_log_bytes_total", std::string(), metrics.logBytes);
+
+    w.family("laminar_queue_wait_seconds", "histogram", "Time between a run being queued and started");
+    w.histogram("laminar_queue_wait_seconds", std::string(), metrics.queueWait);
+    w.family("laminar_dispatch_seconds", "histogram", "Time taken to prepare a run to start");
+    w.histogram("laminar_dispatch_seconds", std::string(), metrics.dispatch);
+    w.family("laminar_send_status_seconds", "histogram", "Time taken to build a status message");
+    for(int t = MonitorScope::HOME; t <= MonitorScope::LOG; ++t)
+        w.histogram("laminar_send_status_seconds", W::label("scope", scopes[t]), metrics.sendStatus[t]);
+    w.family("laminar_sqlite_statement_seconds", "histogram", "Time spent executing an SQLite statement");
+    w.histogram("laminar_sqlite_statement_seconds", std::string(), metrics.statement);
+
+    w.family("laminar_loop_lag_seconds", "histogram", "How late the event loop's watchdog timer fired");
+    w.histogram("laminar_loop_lag_seconds", std::string(), metrics.loopLag);
+    const LoopProfile::HandlerMap& handlers = metrics.loop.handlers();
+    w.family("laminar_loop_handler_seconds_total", "counter", "Time spent on the event loop by each handler");
+    for(const auto& it : handlers)
+        w.sample("laminar_loop_handler_seconds_total", W::label("handler", it.first), it.second.seconds);
+    w.family("laminar_loop_handler_calls_total", "counter", "Calls of each handler on the event loop");
+    for(const auto& it : handlers)
+        w.sample("laminar_loop_handler_calls_total", W::label("handler", it.first), it.second.calls);
+    w.family("laminar_loop_stalls_total", "counter", "Stalls of the event loop by the handler responsible");
+    for(const auto& it : handlers)
+        w.sample("laminar_loop_stalls_total", W::label("handler", it.first), it.second.stalls);
+
+    return w.str();
+}
+
+std::string Laminar::searchLogs(std::string query, std::string job, time_t from, time_t to) {
+    LoopSection section("searchLogs");
+    if(!logSearch)
+        return std::string();
+    bool more = false;
+    std::vector<LogIndex::Match> matches;
+    if(!query.empty())
+        matches = LogIndex::search(*db, query, job, from, to, LOG_SEARCH_RESULTS, more);
+    Json j;
+    j.startArray("results");
+    for(const LogIndex::Match& m : matches) {
+        j.StartObject();
+        j.set("name", m.job)
+         .set("number", m.number)
+         .set("completed", m.completedAt)
+         .set("line", m.line)
+         .set("text", m.text);
+        j.EndObject();
+    }
+    j.EndArray();
+    j.String("more");
+    j.Bool(more);
+    return j.str();
+}
+
 std::string Laminar::getCustomCss() {
     MappedFileImpl cssFile(fs::path(fs::path(homeDir)/"custom"/"style.css").c_str());
     if(cssFile.address()) {
@@ -23,14 +23,58 @@
 #include "run.h"
 #include "node.h"
 #include "database.h"
+#include "objectstore.h"
+#include "subscriptions.h"
+#include "scheduler.h"
+#include "journal.h"
+#include "retention.h"
 
 #include <unordered_map>
-
-// Node name to node object map
-typedef std::unordered_map<std::string, std::shared_ptr<Node>> NodeMap;
+#include <unordered_set>
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <functional>
 
 struct Server;
 class Json;
+struct LogIndexing;
+
+// A file in a run's archive directory
+struct Artifact {
+    std::string url;
+    std::string filename;
+    uintmax_t size;
+    time_t mtime;
+    // SHA-256 of the content, only known if the archive is deduplicated
+    std::string hash;
+};
+
+// Summary of the completed runs of a job, maintained as runs finish so
+// that status messages can be built without querying the database
+struct JobStats {
+    // number of completed runs
+    uint count = 0;
+    // the most recently completed run
+    uint lastNumber = 0;
+    RunState lastResult = RunState::UNKNOWN;
+    time_t lastStarted = 0;
+    time_t lastCompleted = 0;
+    uint lastDuration = 0;
+    // exponentially weighted moving average of run durations
+    double avgDuration = 0;
+    // the most recently completed successful and unsuccessful runs
+    uint lastSuccessNumber = 0;
+    time_t lastSuccessStarted = 0;
+    uint lastFailedNumber = 0;
+    time_t lastFailedStarted = 0;
+
+    // account for a newly completed run
+    void add(uint number, time_t started, time_t completed, RunState result);
+    // expected duration of the next run, in seconds
+    uint estimatedDuration() const;
+};
 
 // The main class implementing the application's business logic.
 // It owns a Server to manage the HTTP/websocket and Cap'n Proto RPC
@@ -45,6 +89,9 @@ public:
     void run();
     // Call this in a signal handler to make run() return
     void stop();
+    // Call this in a signal handler to log where the event loop spends
+    // its time
+    void dumpProfile();
 
     // Implementations of LaminarInterface
     std::shared_ptr<Run> queueJob(std::string name, ParamMap params = ParamMap()) override;
@@ -54,42 +101,182 @@ public:
     void deregisterWaiter(LaminarWaiter* waiter) override;
 
     void sendStatus(LaminarClient* client) override;
+    bool runInProgress(std::string job, uint num) override { return activeRun(job, num) != nullptr; }
     bool setParam(std::string job, uint buildNum, std::string param, std::string value) override;
+    kj::Own<MappedFile> getLog(std::string job, uint num) override;
+    bool getLogSlice(std::string job, uint num, const LogRange& range, LogSlice& slice) override;
     kj::Own<MappedFile> getArtefact(std::string path) override;
     std::string getCustomCss() override;
+    std::string getMetrics() override;
+    std::string searchLogs(std::string query, std::string job, time_t from, time_t to) override;
     void abortAll() override;
-    void notifyConfigChanged() override;
+    void notifyConfigChanged(std::string path) override;
+    bool registerAgent(std::string name, int executors, std::set<std::string> tags, std::shared_ptr<Agent> agent) override;
+    void deregisterAgent(const Agent* agent) override;
 
 private:
+    friend class LaminarConfigTest;
     bool loadConfiguration();
+    // (re)reads $LAMINAR_HOME/cfg/jobs/<name>.conf
+    void loadJobConf(std::string name);
+    bool cfgExists(const std::string& path) const { return cfgFiles.find(path) != cfgFiles.end(); }
     void assignNewJobs();
-    bool tryStartRun(std::shared_ptr<Run> run, int queueIndex);
+    bool tryStartRun(std::shared_ptr<Node> node, std::shared_ptr<Run> run, int queueIndex);
+    // Sends the output collected by handleRunStep to the clients watching
+    // the logs of the runs which produced it
+    void flushOutput();
+    // Clones the base workspace into run->workspace in a background thread.
+    // If that fails, the run is failed without executing its scripts
+    kj::Promise<void> prepareWorkspace(Run* run, std::string base);
+    // Forgets the state of the job's workspace once no run initializes or
+    // clones it
+    void releaseWorkspace(const std::string& job);
+    // Creates a run from the parameters passed to queueJob, which may
+    // include the internal parameters "=parentJob", "=parentBuild",
+    // "=reason" and "=priority"
+    std::shared_ptr<Run> createRun(std::string name, ParamMap params, time_t queuedAt);
+    // the inverse of createRun, as recorded in the journal
+    Journal::Entry journalEntry(const Run& run) const;
+    // rewrites the journal with only the queued and active runs
+    void compactJournal();
     kj::Promise<void> handleRunStep(Run *run);
-    void runFinished(Run*);
-    bool nodeCanQueue(const Node&, const Run&) const;
-    // expects that Json has started an array
-    void populateArtifacts(Json& out, std::string job, uint num) const;
+    kj::Promise<void> runFinished(Run*);
+    // moves a finished log into the log store, returning its path relative
+    // to $LAMINAR_HOME/logs or an empty string on failure
+    std::string storeLog(RunLog& log);
+    // Walks the archive directory of a run. Since this may take long for
+    // runs which archive many files, it is done once when the run finishes
+    // and the result recorded in the artifacts table by storeArtifacts. If
+    // limit is not 0, at most that many files are listed
+    std::vector<Artifact> scanArtifacts(std::string job, uint num, size_t limit = 0) const;
+    void storeArtifacts(Database* db, std::string job, uint num, const std::vector<Artifact>& artifacts);
+    // Walks the archive of a run in a background thread, then sends a new
+    // status to the clients watching the run. The archive of a completed
+    // run is recorded by storeArtifacts, as for runs which completed before
+    // archives were recorded. That of a run in progress is kept in
+    // activeArchives. Does nothing if a walk of the archive is pending
+    void scanArchive(std::string job, uint num);
+    // Inserts a finished run into the builds table and updates the jobs
+    // table accordingly. Returns false if the run was already recorded
+    bool recordRun(Database* db, const Run& run, const std::string& node, time_t completedAt,
+                   size_t logsize, const std::string& logPath);
+    // Executes write on completionDb. Writes from threads which arrive
+    // while another thread is committing are performed together in its
+    // next transaction, so that concurrently finishing runs share a
+    // commit. Returns once the transaction containing write is committed
+    void commitCompletion(std::function<void(Database*)> write);
+    // Removes the runs which the jobs' retention policies no longer keep
+    // in a background thread
+    kj::Promise<void> applyRetention();
+    // Applies retention after the given delay and then every
+    // RETENTION_INTERVAL seconds. Never resolves
+    kj::Promise<void> scheduleRetention(int seconds);
+    // removes the given runs of a job from the database, the log store,
+    // the archive and the run directory
+    void pruneRuns(const std::string& job, const std::vector<uint>& numbers);
+    // Adds a stored log to the LogIndex. It is decompressed and committed
+    // in batches of lines, each of which is a separate piece of background
+    // work holding completionDbMutex only for its own transaction, so that
+    // indexing long logs neither occupies the background threads nor
+    // delays the completion of other runs
+    kj::Promise<void> indexLog(std::shared_ptr<LogIndexing> state);
+    // Indexes the next batch of lines. Returns false once there are no
+    // more. Called from a background thread
+    bool indexLogBatch(LogIndexing& state);
 
     Run* activeRun(const std::string name, uint num) {
         auto it = activeJobs.byNameNumber().find(boost::make_tuple(name, num));
         return it == activeJobs.byNameNumber().end() ? nullptr : it->get();
     }
 
-    std::list<std::shared_ptr<Run>> queuedJobs;
+    Scheduler scheduler;
 
     std::unordered_map<std::string, uint> buildNums;
 
-    std::unordered_map<std::string, std::set<std::string>> jobTags;
+    std::unordered_map<std::string, JobStats> jobStats;
+
+    TagMap jobTags;
+    // executors and resources needed by each job declaring SLOTS or RESOURCES
+    DemandMap jobDemands;
+
+    // Regular files found in $LAMINAR_HOME/cfg, cfg/jobs and cfg/nodes,
+    // named relative to cfg (e.g. "jobs/foo.run")
+    std::unordered_set<std::string> cfgFiles;
+    // settings read from each job's .conf file
+    struct JobConf {
+        int timeout = 0;
+        // only applied if runs are placed in cgroups
+        int cpuWeight = 0;
+        std::string memoryMax;
+        RetentionPolicy retention;
+        // whether each run works in its own clone of the job's workspace
+        bool cloneWorkspace = false;
+        // of runs queued without a =priority parameter
+        int priority = 0;
+        // whether queueing a run with the same parameters as one already
+        // queued returns that run instead
+        bool coalesce = false;
+    };
+    std::unordered_map<std::string, JobConf> jobConfs;
+    // Jobs whose runs clone the workspace may either have one run
+    // initializing it or any number of runs cloning it at a time
+    struct WorkspaceState {
+        const Run* initializing = nullptr;
+        int cloning = 0;
+    };
+    std::unordered_map<std::string, WorkspaceState> workspaces;
 
     RunSet activeJobs;
     Database* db;
+    // only used from background threads, while holding completionDbMutex
+    Database* completionDb;
+    std::mutex completionDbMutex;
+    // writes waiting for the next transaction on completionDb, and the
+    // sequence numbers of the last queued and last committed write
+    std::mutex completionQueueMutex;
+    std::vector<std::function<void(Database*)>> completionQueue;
+    uint64_t completionsQueued = 0;
+    uint64_t completionsCommitted = 0;
+    // queued runs and runs in progress, so that they survive a restart
+    Journal journal;
+    // whether the output of completed runs is added to the LogIndex
+    bool logSearch;
     Server* srv;
+    // Held outside Server::childTasks, which must become empty for
+    // laminard to shut down
+    kj::Maybe<kj::Promise<void>> retentionTask;
+    // tells a retention pass in a background thread to stop early
+    std::atomic<bool> retentionStopped{false};
     NodeMap nodes;
     std::string homeDir;
-    std::set<LaminarClient*> clients;
+    Subscriptions clients;
+    // most recent listing of the archive of each run in progress which
+    // has been viewed, and the runs whose archive is being walked
+    struct ArchiveListing {
+        std::vector<Artifact> artifacts;
+        time_t scannedAt;
+    };
+    std::map<std::pair<std::string, uint>, ArchiveListing> activeArchives;
+    std::set<std::pair<std::string, uint>> archiveScans;
+    // output of each run not yet sent to the clients watching its log
+    std::unordered_map<const Run*, std::string> pendingOutput;
+    bool outputFlushScheduled = false;
+    // Serialized status messages for scopes whose content does not depend
+    // on the client. Cleared whenever the state they reflect changes
+    std::map<MonitorScope::Type, Message> snapshots;
+    time_t snapshotTime;
     std::set<LaminarWaiter*> waiters;
     uint numKeepRunDirs;
     std::string archiveUrl;
+    // path of the laminar-supervisor helper, empty if scripts are executed
+    // directly by laminard
+    std::string supervisorPath;
+    // delegated cgroup below which each run gets its own cgroup, empty if
+    // runs are not placed in cgroups
+    std::string cgroupPath;
+    // store archived files are moved into when runs complete, if the
+    // archive is deduplicated
+    std::unique_ptr<ObjectStore> objects;
 };
 
 #endif // LAMINAR_LAMINAR_H_
@@ -0,0 +1,158 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "logindex.h"
+#include "database.h"
+
+namespace {
+
+// Appends line to out without ANSI escape sequences (such as colours)
+// and carriage returns, which would otherwise become part of the words
+// next to them
+void stripEscapes(const char* line, size_t len, std::string& out) {
+    for(size_t i = 0; i < len; ++i) {
+        char c = line[i];
+        if(c == '\033') {
+            // CSI sequences end with a byte in 0x40-0x7e, others are only
+            // the escape and one more byte
+            if(i + 1 < len && line[i+1] == '[') {
+                i += 2;
+                while(i < len && (line[i] < 0x40 || line[i] > 0x7e))
+                    ++i;
+            } else {
+                ++i;
+            }
+        } else if(c != '\r') {
+            out += c;
+        }
+    }
+}
+
+// FTS5 query for the literal phrase
+std::string phrase(const std::string& query) {
+    std::string q = "\"";
+    for(char c : query) {
+        if(c == '"')
+            q += '"';
+        q += c;
+    }
+    return q + "\"";
+}
+
+}
+
+const int LogIndex::LINE_BITS;
+
+bool LogIndex::create(Database& db) {
+    if(!db.exec("CREATE VIRTUAL TABLE IF NOT EXISTS log_lines USING fts5(line)"))
+        return false;
+    db.exec("CREATE TABLE IF NOT EXISTS log_runs("
+            "id INTEGER PRIMARY KEY, name TEXT, number INT UNSIGNED, completedAt INT)");
+    db.exec("CREATE UNIQUE INDEX IF NOT EXISTS idx_log_runs_name ON log_runs(name, number)");
+    db.exec("CREATE INDEX IF NOT EXISTS idx_log_runs_completion ON log_runs(completedAt)");
+    db.exec("CREATE INDEX IF NOT EXISTS idx_log_runs_name_completion ON log_runs(name, completedAt)");
+    return true;
+}
+
+void LogIndex::add(Database& db, const std::string& job, uint num, time_t completedAt, const std::string& log) {
+    addLines(db, begin(db, job, num, completedAt), 0, log);
+}
+
+long LogIndex::begin(Database& db, const std::string& job, uint num, time_t completedAt) {
+    remove(db, job, num);
+    db.stmt("INSERT INTO log_runs(name, number, completedAt) VALUES(?,?,?)")
+     .bind(job, num, completedAt)
+     .exec();
+    long id = 0;
+    db.stmt("SELECT id FROM log_runs WHERE name = ? AND number = ?")
+     .bind(job, num)
+     .fetch<long>([&](long i){ id = i; });
+    return id;
+}
+
+void LogIndex::addLines(Database& db, long id, uint64_t firstLine, const std::string& text) {
+    long lineNo = static_cast<long>(firstLine);
+    std::string line;
+    for(size_t start = 0; start < text.size() && lineNo < (1L << LINE_BITS); ++lineNo) {
+        size_t end = text.find('\n', start);
+        if(end == std::string::npos)
+            end = text.size();
+        line.clear();
+        stripEscapes(text.data() + start, end - start, line);
+        if(!line.empty()) {
+            db.stmt("INSERT INTO log_lines(rowid, line) VALUES(?,?)")
+             .bind((id << LINE_BITS) | lineNo, line)
+             .exec();
+        }
+        start = end + 1;
+    }
+}
+
+void LogIndex::remove(Database& db, const std::string& job, uint num) {
+    long id = -1;
+    db.stmt("SELECT id FROM log_runs WHERE name = ? AND number = ?")
+     .bind(job, num)
+     .fetch<long>([&](long i){ id = i; });
+    if(id < 0)
+        return;
+    db.stmt("DELETE FROM log_lines WHERE rowid >= ? AND rowid < ?")
+     .bind(id << LINE_BITS, (id + 1) << LINE_BITS)
+     .exec();
+    db.stmt("DELETE FROM log_runs WHERE name = ? AND number = ?")
+     .bind(job, num)
+     .exec();
+}
+
+std::vector<LogIndex::Match> LogIndex::search(Database& db, const std::string& query, const std::string& job,
+                                              time_t from, time_t to, uint limit, bool& more) {
+    std::vector<Match> matches;
+    more = false;
+    // the range of ids of the runs in the time window. Since ids are
+    // assigned in order of completion, this bounds the rowids to visit
+    long first = 0, last = -1;
+    auto range = [&](long lo, long hi){
+        first = lo;
+        last = hi;
+    };
+    if(job.empty()) {
+        db.stmt("SELECT MIN(id), MAX(id) FROM log_runs WHERE completedAt >= ? AND completedAt <= ?")
+         .bind(from, to)
+         .fetch<long,long>(range);
+    } else {
+        db.stmt("SELECT MIN(id), MAX(id) FROM log_runs WHERE name = ? AND completedAt >= ? AND completedAt <= ?")
+         .bind(job, from, to)
+         .fetch<long,long>(range);
+    }
+    // no runs in the window, MIN and MAX are NULL
+    if(last < first || last == 0)
+        return matches;
+    db.stmt("SELECT r.name, r.number, r.completedAt, l.rowid, l.line FROM log_lines l "
+            "JOIN log_runs r ON r.id = (l.rowid >> ?) "
+            "WHERE log_lines MATCH ? AND l.rowid >= ? AND l.rowid < ? "
+            "AND (? = '' OR r.name = ?) AND r.completedAt >= ? AND r.completedAt <= ? "
+            "ORDER BY l.rowid LIMIT ?")
+     .bind(LINE_BITS, phrase(query), first << LINE_BITS, (last + 1) << LINE_BITS, job, job, from, to, limit + 1)
+     .fetch<std::string,uint,time_t,long,std::string>([&](std::string name, uint number, time_t completed, long rowid, std::string text){
+        if(matches.size() == limit) {
+            more = true;
+            return;
+        }
+        matches.push_back({name, number, completed, uint(rowid & ((1L << LINE_BITS) - 1)), text});
+    });
+    return matches;
+}
@@ -0,0 +1,76 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_LOGINDEX_H_
+#define LAMINAR_LOGINDEX_H_
+
+#include <stdint.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+class Database;
+
+// Full-text index of the output of completed runs, kept in the database
+// in an SQLite FTS5 table with one row per line, so that runs which
+// printed a given text can be found without decompressing their logs.
+//
+// The index assigns each run an id in order of completion. The rowid of a
+// line combines the run's id and the line number, so that a search within
+// a time window only visits the lines of runs completed within it.
+class LogIndex {
+public:
+    struct Match {
+        std::string job;
+        uint number;
+        time_t completedAt;
+        // counting from 0
+        uint line;
+        std::string text;
+    };
+
+    // Creates the index tables if necessary. Returns false if the SQLite
+    // library does not support FTS5
+    static bool create(Database& db);
+
+    // Adds the lines of a run's log, with escape sequences removed
+    static void add(Database& db, const std::string& job, uint num, time_t completedAt, const std::string& log);
+
+    // Adds a run to the index without any lines, replacing any lines it
+    // had, and returns its id. Together with addLines, this allows a long
+    // log to be indexed in parts, each in its own transaction
+    static long begin(Database& db, const std::string& job, uint num, time_t completedAt);
+    // Adds the lines in text to the run with the given id. The first of
+    // them is line number firstLine of the log
+    static void addLines(Database& db, long id, uint64_t firstLine, const std::string& text);
+
+    static void remove(Database& db, const std::string& job, uint num);
+
+    // Finds lines containing all the words of query in a sequence, in
+    // runs of job (any job if empty) completed between from and to
+    // inclusive. Matches are returned oldest first. At most limit are
+    // returned; more is set if there were further matches.
+    static std::vector<Match> search(Database& db, const std::string& query, const std::string& job,
+                                     time_t from, time_t to, uint limit, bool& more);
+
+    // the line number part of a rowid has this many bits, so lines beyond
+    // this are not indexed
+    static const int LINE_BITS = 24;
+};
+
+#endif // LAMINAR_LOGINDEX_H_
@@ -27,6 +27,10 @@ static void laminar_quit(int) {
     laminar->stop();
 }
 
+static void laminar_profile(int) {
+    laminar->dumpProfile();
+}
+
 int main(int argc, char** argv) {
     for(int i = 1; i < argc; ++i) {
         if(strcmp(argv[i], "-v") == 0) {
@@ -38,6 +42,7 @@ int main(int argc, char** argv) {
     kj::UnixEventPort::captureChildExit();
     signal(SIGINT, &laminar_quit);
     signal(SIGTERM, &laminar_quit);
+    signal(SIGUSR1, &laminar_profile);
 
     laminar->run();
 
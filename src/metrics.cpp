@@ -0,0 +1,133 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "metrics.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+Metrics metrics;
+
+namespace {
+
+std::string number(double v) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.17g", v);
+    return buf;
+}
+
+}
+
+Histogram::Histogram(std::vector<double> bounds) :
+    bounds(bounds),
+    counts(bounds.size() + 1),
+    sum(0)
+{
+}
+
+void Histogram::observe(double value) {
+    size_t i = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+    std::lock_guard<std::mutex> lock(mutex);
+    counts[i]++;
+    sum += value;
+}
+
+void Histogram::write(std::string& out, const std::string& name, const std::string& labels) const {
+    std::string sep = labels.empty() ? "" : labels + ",";
+    std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t cumulative = 0;
+    for(size_t i = 0; i < counts.size(); ++i) {
+        cumulative += counts[i];
+        std::string le = i < bounds.size() ? number(bounds[i]) : "+Inf";
+        out += name + "_bucket{" + sep + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+    }
+    out += name + "_sum" + suffix + " " + number(sum) + "\n";
+    out += name + "_count" + suffix + " " + std::to_string(cumulative) + "\n";
+}
+
+std::vector<double> Histogram::latencyBuckets() {
+    return {0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+}
+
+const char* LoopProfile::takeSlowest(double& seconds) {
+    const char* name = slowest;
+    seconds = slowestSeconds;
+    slowest = nullptr;
+    slowestSeconds = 0;
+    return name;
+}
+
+void LoopProfile::stalled(const char* name) {
+    handlerMap[name].stalls++;
+}
+
+LoopSection::LoopSection(const char* name) :
+    name(name),
+    parent(metrics.loop.current),
+    start(std::chrono::steady_clock::now()),
+    nested(std::chrono::steady_clock::duration::zero())
+{
+    metrics.loop.current = this;
+}
+
+LoopSection::~LoopSection() {
+    LoopProfile& profile = metrics.loop;
+    std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start;
+    double self = std::chrono::duration<double>(elapsed - nested).count();
+    LoopProfile::Handler& h = profile.handlerMap[name];
+    h.seconds += self;
+    h.calls++;
+    h.max = std::max(h.max, self);
+    if(self > profile.slowestSeconds) {
+        profile.slowest = name;
+        profile.slowestSeconds = self;
+    }
+    if(parent)
+        parent->nested += elapsed;
+    profile.current = parent;
+}
+
+void MetricsWriter::family(const char* name, const char* type, const char* help) {
+    out += std::string("# HELP ") + name + " " + help + "\n";
+    out += std::string("# TYPE ") + name + " " + type + "\n";
+}
+
+void MetricsWriter::sample(const char* name, const std::string& labels, double value) {
+    out += name;
+    if(!labels.empty())
+        out += "{" + labels + "}";
+    out += " " + number(value) + "\n";
+}
+
+void MetricsWriter::histogram(const char* name, const std::string& labels, const Histogram& h) {
+    h.write(out, name, labels);
+}
+
+std::string MetricsWriter::label(const char* name, const std::string& value) {
+    std::string res = std::string(name) + "=\"";
+    for(char c : value) {
+        if(c == '\\' || c == '"')
+            res += '\\';
+        if(c == '\n')
+            res += "\\n";
+        else
+            res += c;
+    }
+    return res + "\"";
+}
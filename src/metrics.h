@@ -0,0 +1,182 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_METRICS_H_
+#define LAMINAR_METRICS_H_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Distribution of observed values over fixed buckets, in the sense of a
+// Prometheus histogram. May be observed from any thread
+class Histogram {
+public:
+    // bounds are the inclusive upper bounds of the buckets in increasing
+    // order. A final bucket for all larger values is implied
+    explicit Histogram(std::vector<double> bounds = latencyBuckets());
+
+    void observe(double value);
+
+    // Appends the _bucket, _sum and _count samples of the histogram to
+    // out. labels is either empty or a list of comma-separated name="value"
+    // pairs which is added to each sample
+    void write(std::string& out, const std::string& name, const std::string& labels) const;
+
+    // suitable for durations in seconds from 100us to 10s
+    static std::vector<double> latencyBuckets();
+
+private:
+    mutable std::mutex mutex;
+    std::vector<double> bounds;
+    // per bucket, not cumulative. The last is that of the implied bucket
+    std::vector<uint64_t> counts;
+    double sum;
+};
+
+// Observes the time between its construction and destruction in seconds
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& h) :
+        histogram(h),
+        start(std::chrono::steady_clock::now())
+    {}
+    ~ScopedTimer() {
+        histogram.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+private:
+    Histogram& histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+class LoopSection;
+
+// Time spent on the event loop by each kind of handler, so that a stall
+// of the loop can be attributed to what caused it. Must only be used from
+// the thread running the event loop
+class LoopProfile {
+public:
+    struct Handler {
+        // time spent in the handler itself, excluding nested sections
+        double seconds = 0;
+        uint64_t calls = 0;
+        // the longest single call
+        double max = 0;
+        // number of stalls the handler was found responsible for
+        uint64_t stalls = 0;
+    };
+    struct Less {
+        bool operator()(const char* a, const char* b) const { return strcmp(a, b) < 0; }
+    };
+    typedef std::map<const char*, Handler, Less> HandlerMap;
+
+    // Returns the name of the handler whose call took longest since the
+    // last call to this function, or nullptr if there was none, in which
+    // case the loop was blocked by something not enclosed by a LoopSection
+    const char* takeSlowest(double& seconds);
+    // counts a stall towards the given handler
+    void stalled(const char* name);
+
+    const HandlerMap& handlers() const { return handlerMap; }
+
+private:
+    friend class LoopSection;
+    HandlerMap handlerMap;
+    LoopSection* current = nullptr;
+    const char* slowest = nullptr;
+    double slowestSeconds = 0;
+};
+
+// Attributes the time between its construction and destruction to the
+// named handler in the LoopProfile. Sections may be nested, the time is
+// then attributed to the innermost. name must be a string literal
+class LoopSection {
+public:
+    explicit LoopSection(const char* name);
+    ~LoopSection();
+    LoopSection(const LoopSection&) = delete;
+    LoopSection& operator=(const LoopSection&) = delete;
+private:
+    const char* name;
+    LoopSection* parent;
+    std::chrono::steady_clock::time_point start;
+    // time spent in nested sections
+    std::chrono::steady_clock::duration nested;
+};
+
+// Serializes metrics in the Prometheus text exposition format (version
+// 0.0.4), which OpenMetrics consumers also accept
+class MetricsWriter {
+public:
+    // Starts a metric family. Must precede its samples. type is one of
+    // "counter", "gauge" or "histogram"
+    void family(const char* name, const char* type, const char* help);
+    void sample(const char* name, const std::string& labels, double value);
+    void histogram(const char* name, const std::string& labels, const Histogram& h);
+
+    // content type of the serialized form
+    static const char* contentType() { return "text/plain; version=0.0.4; charset=utf-8"; }
+
+    const std::string& str() const { return out; }
+
+    // Formats a label pair for use in the labels argument, escaping the
+    // value as the format requires
+    static std::string label(const char* name, const std::string& value);
+
+private:
+    std::string out;
+};
+
+// Instruments updated where the events they measure happen. Gauges which
+// can be derived from the daemon's state are instead computed when the
+// metrics are requested (see Laminar::getMetrics)
+struct Metrics {
+    // seconds between a run being queued and started
+    Histogram queueWait{{1, 5, 15, 30, 60, 120, 300, 600, 1800, 3600, 7200}};
+    // duration of preparing a run to start on a node
+    Histogram dispatch;
+    // duration of Laminar::sendStatus, indexed by MonitorScope::Type
+    Histogram sendStatus[5];
+    // time spent stepping an SQLite statement, summed over its rows
+    Histogram statement{{0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1}};
+    // bytes of output produced by runs
+    std::atomic<uint64_t> logBytes{0};
+    // open websocket connections and the bytes queued for them
+    std::atomic<int64_t> websocketClients{0};
+    std::atomic<int64_t> websocketQueuedBytes{0};
+    // websocket clients disconnected for being too slow
+    std::atomic<uint64_t> websocketDropped{0};
+    // bytes ever queued for websocket clients, and those discarded unsent
+    // by a client's queue being replaced or dropped
+    std::atomic<uint64_t> websocketQueuedBytesTotal{0};
+    std::atomic<uint64_t> websocketDroppedBytes{0};
+    // how late the event loop's watchdog timer fired
+    Histogram loopLag{{0.001, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10}};
+    LoopProfile loop;
+};
+
+// the process-wide instruments
+extern Metrics metrics;
+
+#endif // LAMINAR_METRICS_H_
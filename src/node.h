@@ -19,11 +19,42 @@
 #ifndef LAMINAR_NODE_H_
 #define LAMINAR_NODE_H_
 
+#include <functional>
 #include <string>
+#include <map>
 #include <set>
+#include <memory>
+#include <unordered_map>
+#include <kj/async.h>
 
 class Run;
 
+// Executes runs on another host on behalf of a Node. Implemented by the
+// RPC layer for each connected laminar-agent
+class Agent {
+public:
+    virtual ~Agent() {}
+
+    // Executes all remaining scripts of the run. Their output is passed to
+    // onOutput and the exit status of each to Run::reaped. The promise
+    // resolves once all scripts have exited. If the agent is lost, the run
+    // fails as if a script had exited with status 1
+    virtual kj::Promise<void> execute(Run& run, std::function<void(const char*, size_t)> onOutput) = 0;
+
+    // terminates the scripts of a run being executed
+    virtual void abort(const Run& run) = 0;
+};
+
+// Counts of named resources such as "gpu"
+typedef std::map<std::string, int> ResourceMap;
+
+// What a run occupies on its node while it executes
+struct Demand {
+    // number of executors
+    int slots = 1;
+    ResourceMap resources;
+};
+
 // Represents a group of executors. Currently almost unnecessary POD
 // abstraction, but may be enhanced in the future to support e.g. tags
 class Node {
@@ -34,10 +65,17 @@ public:
     int numExecutors;
     int busyExecutors = 0;
     std::set<std::string> tags;
+    // named resources this node has, and how many of them are in use
+    ResourceMap resources;
+    ResourceMap busyResources;
+    // if set, runs on this node are executed by a remote agent
+    std::shared_ptr<Agent> agent;
 
     // Attempts to queue the given run to this node. Returns true if succeeded.
     bool queue(const Run& run);
 };
 
+// Node name to node object map
+typedef std::unordered_map<std::string, std::shared_ptr<Node>> NodeMap;
 
 #endif // LAMINAR_NODE_H_
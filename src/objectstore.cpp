@@ -0,0 +1,157 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "objectstore.h"
+#include "log.h"
+#include "sha256.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OBJECT_IO_BUFSIZE 65536
+
+namespace {
+
+bool copyFd(int in, int out) {
+    char buf[OBJECT_IO_BUFSIZE];
+    ssize_t n;
+    while((n = read(in, buf, sizeof(buf))) > 0) {
+        for(ssize_t done = 0; done < n;) {
+            ssize_t w = write(out, buf + done, n - done);
+            if(w < 0)
+                return false;
+            done += w;
+        }
+    }
+    return n == 0;
+}
+
+}
+
+bool ObjectStore::open(std::string path) {
+    if(mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        LLOG(ERROR, "Could not create object store", path, strerror(errno));
+        return false;
+    }
+    dir = path;
+    return true;
+}
+
+std::string ObjectStore::add(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        return std::string();
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return std::string();
+    }
+
+    Sha256 hash;
+    char buf[OBJECT_IO_BUFSIZE];
+    ssize_t n;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+        hash.update(buf, n);
+    if(n < 0) {
+        close(fd);
+        return std::string();
+    }
+    std::string digest = hash.hexdigest();
+
+    // objects are spread over 256 directories by their first byte
+    std::string sub = dir + "/" + digest.substr(0, 2);
+    mkdir(sub.c_str(), 0755);
+    std::string obj = sub + "/" + digest.substr(2);
+
+    struct stat ost;
+    if(stat(obj.c_str(), &ost) != 0) {
+        if(st.st_nlink == 1 && link(path.c_str(), obj.c_str()) == 0) {
+            // the archived file itself becomes the object
+            fchmod(fd, 0444);
+            close(fd);
+            return digest;
+        }
+        if(errno != EEXIST) {
+            // Store a private copy. Temporary files start with a dot, so
+            // that collect() leaves them alone
+            std::string tmp = sub + "/.tmpXXXXXX";
+            int out = mkstemp(&tmp[0]);
+            bool ok = out != -1 && lseek(fd, 0, SEEK_SET) == 0 && copyFd(fd, out) && fchmod(out, 0444) == 0;
+            if(out != -1)
+                close(out);
+            ok = ok && (link(tmp.c_str(), obj.c_str()) == 0 || errno == EEXIST);
+            unlink(tmp.c_str());
+            if(!ok) {
+                LLOG(WARNING, "Could not add to object store", path, strerror(errno));
+                close(fd);
+                return std::string();
+            }
+        }
+    } else if(ost.st_dev == st.st_dev && ost.st_ino == st.st_ino) {
+        close(fd);
+        return digest;
+    }
+    close(fd);
+    return linkTo(obj, path) ? digest : std::string();
+}
+
+bool ObjectStore::linkTo(const std::string& obj, const std::string& path) {
+    // the file is replaced atomically, so it never appears to be missing
+    std::string tmp = path + ".laminar-link";
+    if(link(obj.c_str(), tmp.c_str()) != 0) {
+        LLOG(WARNING, "Could not link to object", path, strerror(errno));
+        return false;
+    }
+    if(rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+uintmax_t ObjectStore::collect() {
+    uintmax_t reclaimed = 0;
+    DIR* top = opendir(dir.c_str());
+    if(!top)
+        return 0;
+    while(struct dirent* d = readdir(top)) {
+        if(d->d_name[0] == '.')
+            continue;
+        std::string sub = dir + "/" + d->d_name;
+        DIR* objects = opendir(sub.c_str());
+        if(!objects)
+            continue;
+        while(struct dirent* o = readdir(objects)) {
+            if(o->d_name[0] == '.')
+                continue;
+            std::string obj = sub + "/" + o->d_name;
+            struct stat st;
+            if(lstat(obj.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 && unlink(obj.c_str()) == 0)
+                reclaimed += st.st_size;
+        }
+        closedir(objects);
+    }
+    closedir(top);
+    return reclaimed;
+}
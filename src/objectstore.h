@@ -0,0 +1,56 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_OBJECTSTORE_H_
+#define LAMINAR_OBJECTSTORE_H_
+
+#include <stdint.h>
+#include <string>
+
+// Content-addressed store of archived files. Each distinct content is
+// kept once, as a file named by its SHA-256, and archived files with that
+// content become hardlinks to it. An object's link count is therefore
+// one more than the number of archived files referring to it, and an
+// object with a link count of 1 may be removed.
+class ObjectStore {
+public:
+    // Objects are kept below dir, which is created if necessary. It must
+    // be on the same filesystem as the files added to it.
+    bool open(std::string dir);
+
+    // Replaces the file at path with a hardlink to the object of the same
+    // content, first adding it to the store if it is new. A file which
+    // has other hardlinks (e.g. into a workspace) is copied into the store
+    // rather than linked, so that changes through the other links cannot
+    // alter the object. Objects are read-only. Returns the SHA-256 of the
+    // content, or an empty string if the file was left as it was.
+    std::string add(const std::string& path);
+
+    // Removes objects which are no longer referenced by any archived
+    // file. Returns the number of bytes reclaimed. May run concurrently
+    // with add().
+    uintmax_t collect();
+
+private:
+    // Makes path a hardlink to the object at obj. Returns false on failure
+    bool linkTo(const std::string& obj, const std::string& path);
+
+    std::string dir;
+};
+
+#endif // LAMINAR_OBJECTSTORE_H_
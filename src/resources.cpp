@@ -17,12 +17,56 @@
 /// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
 ///
 #include "resources.h"
+#include "sha256.h"
 #include <string.h>
+#include <zlib.h>
+
+#ifdef LAMINAR_BROTLI_RESOURCES
+#define BROTLI_VARIANT(name) \
+    extern const char _binary_##name##_br_start[];\
+    extern const char _binary_##name##_br_end[]; \
+    Variant brotli_##name = variant(_binary_ ## name ## _br_start, _binary_ ## name ## _br_end)
+#else
+#define BROTLI_VARIANT(name) \
+    Variant brotli_##name = Variant{nullptr, nullptr, std::string()}
+#endif
 
 #define INIT_RESOURCE(route, name, content_type) \
     extern const char _binary_##name##_z_start[];\
     extern const char _binary_##name##_z_end[]; \
-    resources.emplace(route, Resource{_binary_ ## name ## _z_start, _binary_ ## name ## _z_end, content_type})
+    BROTLI_VARIANT(name); \
+    resources.emplace(route, Resource{variant(_binary_ ## name ## _z_start, _binary_ ## name ## _z_end), brotli_##name, content_type, \
+        fingerprint(_binary_ ## name ## _z_start, _binary_ ## name ## _z_end)})
+
+// The entity tag of each variant is computed once at startup from its
+// data, which is small enough for this to be negligible
+Resources::Variant Resources::variant(const char* start, const char* end) {
+    Sha256 h;
+    h.update(start, end - start);
+    return {start, end, "\"" + h.hexdigest().substr(0, 16) + "\""};
+}
+
+// The fingerprint which cmake/fingerprint.cmake puts into URLs is taken
+// over the uncompressed content, so inflate the gzip variant to hash it
+std::string Resources::fingerprint(const char* start, const char* end) {
+    Sha256 h;
+    z_stream strm{};
+    if(inflateInit2(&strm, 15 + 32) != Z_OK)
+        return std::string();
+    strm.next_in = (Bytef*) start;
+    strm.avail_in = end - start;
+    char buf[16384];
+    int res;
+    do {
+        strm.next_out = (Bytef*) buf;
+        strm.avail_out = sizeof(buf);
+        res = inflate(&strm, Z_NO_FLUSH);
+        h.update(buf, sizeof(buf) - strm.avail_out);
+    } while(res == Z_OK);
+    inflateEnd(&strm);
+    // an empty fingerprint never matches a query
+    return res == Z_STREAM_END ? h.hexdigest().substr(0, 16) : std::string();
+}
 
 #define CONTENT_TYPE_HTML "text/html; charset=utf-8"
 #define CONTENT_TYPE_ICO  "image/x-icon"
@@ -40,7 +84,6 @@ Resources::Resources()
     INIT_RESOURCE("/js/ansi_up.js", js_ansi_up_js, CONTENT_TYPE_JS);
     INIT_RESOURCE("/js/vue.min.js", js_vue_min_js, CONTENT_TYPE_JS);
     INIT_RESOURCE("/js/vue-router.min.js", js_vue_router_min_js, CONTENT_TYPE_JS);
-    INIT_RESOURCE("/js/ansi_up.js", js_ansi_up_js, CONTENT_TYPE_JS);
     INIT_RESOURCE("/js/Chart.min.js", js_Chart_min_js, CONTENT_TYPE_JS);
     INIT_RESOURCE("/css/bootstrap.min.css", css_bootstrap_min_css, CONTENT_TYPE_CSS);
 }
@@ -49,7 +92,13 @@ inline bool beginsWith(std::string haystack, const char* needle) {
     return strncmp(haystack.c_str(), needle, strlen(needle)) == 0;
 }
 
-bool Resources::handleRequest(std::string path, const char** start, const char** end, const char** content_type) {
+bool Resources::handleRequest(std::string path, bool acceptBrotli, Response& response) const {
+    size_t query = path.find('?');
+    std::string version;
+    if(query != std::string::npos && path.compare(query + 1, 2, "v=") == 0)
+        version = path.substr(query + 3, path.find('&', query) - query - 3);
+    path = path.substr(0, query);
+
     // need to keep the list of "application links" synchronised with the angular
     // application. We cannot return a 404 for any of these
     auto it = beginsWith(path,"/jobs")
@@ -57,12 +106,18 @@ bool Resources::handleRequest(std::string path, const char** start, const char**
             : resources.find(path);
 
     if(it != resources.end()) {
-        *start = it->second.start;
-        *end = it->second.end;
-        *content_type = it->second.content_type;
+        bool brotli = acceptBrotli && it->second.brotli.start;
+        const Variant& v = brotli ? it->second.brotli : it->second.gzip;
+        response.start = v.start;
+        response.end = v.end;
+        response.etag = v.etag.c_str();
+        response.contentType = it->second.content_type;
+        response.contentEncoding = brotli ? "br" : "gzip";
+        // a stale or mistyped fingerprint must not be cached for good,
+        // or the wrong content would stick to that URL
+        response.immutable = !version.empty() && version == it->second.fingerprint;
         return true;
     }
 
     return false;
 }
-
@@ -29,17 +29,44 @@ class Resources {
 public:
     Resources();
 
-    // If a resource is known for the given path, set start and end to the
-    // binary data to send to the client, and content_type to its MIME
-    // type. Function returns false if no resource for the given path exists
-    bool handleRequest(std::string path, const char** start, const char** end, const char** content_type);
+    // What to send in response to a request for a resource
+    struct Response {
+        // the compressed content
+        const char* start;
+        const char* end;
+        const char* contentType;
+        // "gzip" or "br"
+        const char* contentEncoding;
+        // quoted entity tag, which changes with the content
+        const char* etag;
+        // whether the request carried the current fingerprint of the
+        // content (see cmake/fingerprint.cmake), so that the response may
+        // be cached indefinitely
+        bool immutable;
+    };
+
+    // If a resource is known for the given path, which may include a
+    // query string, fill response with its content in the best encoding
+    // available. Brotli is only chosen if the client accepts it. Function
+    // returns false if no resource for the given path exists
+    bool handleRequest(std::string path, bool acceptBrotli, Response& response) const;
 
 private:
-    struct Resource {
+    struct Variant {
         const char* start;
         const char* end;
+        std::string etag;
+    };
+    struct Resource {
+        Variant gzip;
+        // start is nullptr if there is no brotli variant
+        Variant brotli;
         const char* content_type;
+        // first 16 hex digits of the SHA-256 of the uncompressed content
+        std::string fingerprint;
     };
+    static Variant variant(const char* start, const char* end);
+    static std::string fingerprint(const char* start, const char* end);
     std::unordered_map<std::string, const Resource> resources;
 };
 
@@ -491,15 +491,25 @@ var Job = function() {
 }();
 
 const Run = function() {
+  // number of lines of the log fetched at once
+  const LOG_PAGE_LINES = 1000;
   var state = {
     job: { artifacts: [] },
     latestNum: null,
     log: '',
+    // number of the first line shown, earlier lines are fetched on request
+    logFirstLine: 0,
     autoscroll: false
   };
   var firstLog = false;
+  // incremented whenever another log is opened, so that a late response
+  // for the previous one is ignored
+  var logGeneration = 0;
+  var formatLog = function(d) {
+    return ansi_up.ansi_to_html(d.replace(/</g,'&lt;').replace(/>/g,'&gt;'));
+  };
   var logHandler = function(vm, d) {
-    state.log += ansi_up.ansi_to_html(d.replace(/</g,'&lt;').replace(/>/g,'&gt;'));
+    state.log += formatLog(d);
     vm.$forceUpdate();
     if (!firstLog) {
       firstLog = true;
@@ -507,6 +517,45 @@ const Run = function() {
       window.scrollTo(0, document.body.scrollHeight);
     }
   };
+  // receives the log from the given byte offset onward, then its output
+  // as it is produced
+  var followLog = function(vm, path, offset) {
+    vm.logws = wsp(path + '/log?offset=' + offset);
+    vm.logws.onmessage = function(msg) {
+      logHandler(vm, msg.data);
+    };
+  };
+  // Shows the last lines of a run's log and follows it. Only these are
+  // transferred, however long the log is
+  var openLog = function(vm, route) {
+    var generation = ++logGeneration;
+    state.log = '';
+    state.logFirstLine = 0;
+    firstLog = false;
+    vm.logPath = '/log/' + route.params.name + '/' + route.params.number;
+    var path = route.path;
+    var fallback = function() {
+      if (generation === logGeneration)
+        followLog(vm, path, 0);
+    };
+    fetch(vm.logPath + '?tail=' + LOG_PAGE_LINES).then(res => {
+      if (!res.ok)
+        return fallback();
+      return res.text().then(text => {
+        if (generation !== logGeneration)
+          return;
+        state.logFirstLine = +res.headers.get('X-Log-Line');
+        logHandler(vm, text);
+        followLog(vm, path, res.headers.get('X-Log-End'));
+      });
+    }).catch(fallback);
+  };
+  var closeLog = function(vm) {
+    logGeneration++;
+    if (vm.logws)
+      vm.logws.close();
+    vm.logws = null;
+  };
 
   return {
     template: '#run',
@@ -533,28 +582,39 @@ const Run = function() {
       runComplete: function(run) {
         return !!run && (run.result === 'aborted' || run.result === 'failed' || run.result === 'success');
       },
+      artifacts_page: function(page) {
+        // answered with a status message containing that page
+        this.ws.send(JSON.stringify({ page: page, field: 'number', order: 'dsc' }));
+      },
+      log_earlier: function() {
+        var generation = logGeneration;
+        var last = state.logFirstLine;
+        var first = Math.max(0, last - LOG_PAGE_LINES);
+        fetch(this.logPath + '?lines=' + first + '-' + last).then(res => {
+          if (!res.ok)
+            return;
+          return res.text().then(text => {
+            if (generation !== logGeneration)
+              return;
+            state.log = formatLog(text) + state.log;
+            state.logFirstLine = first;
+            this.$forceUpdate();
+          });
+        });
+      },
     },
     beforeRouteEnter(to, from, next) {
       next(vm => {
-        state.log = '';
-        vm.logws = wsp(to.path + '/log');
-        vm.logws.onmessage = function(msg) {
-          logHandler(vm, msg.data);
-        }
+        openLog(vm, to);
       });
     },
     beforeRouteUpdate(to, from, next) {
-      var vm = this;
-      vm.logws.close();
-      state.log = '';
-      vm.logws = wsp(to.path + '/log');
-      vm.logws.onmessage = function(msg) {
-        logHandler(vm, msg.data);
-      }
+      closeLog(this);
+      openLog(this, to);
       next();
     },
     beforeRouteLeave(to, from, next) {
-      this.logws.close();
+      closeLog(this);
       next();
     }
   };
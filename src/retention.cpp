@@ -0,0 +1,40 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "retention.h"
+
+std::vector<uint> expiredRuns(const RetentionPolicy& policy, const std::vector<CompletedRun>& runs, time_t now) {
+    std::vector<uint> expired;
+    if(!policy.limited())
+        return expired;
+    time_t cutoff = policy.keepDays ? now - time_t(policy.keepDays) * 86400 : 0;
+    bool seenSuccess = false;
+    for(size_t i = 0; i < runs.size(); ++i) {
+        const CompletedRun& r = runs[i];
+        bool lastSuccess = !seenSuccess && r.result == RunState::SUCCESS;
+        seenSuccess = seenSuccess || r.result == RunState::SUCCESS;
+        if(policy.keepRuns && i < policy.keepRuns)
+            continue;
+        if(policy.keepDays && r.completedAt >= cutoff)
+            continue;
+        if(policy.keepLastSuccess && lastSuccess)
+            continue;
+        expired.push_back(r.number);
+    }
+    return expired;
+}
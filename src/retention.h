@@ -0,0 +1,52 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_RETENTION_H_
+#define LAMINAR_RETENTION_H_
+
+#include "run.h"
+
+#include <string>
+#include <time.h>
+#include <vector>
+
+// Which completed runs of a job are kept, as set in the job's .conf file
+// (KEEP_RUNS, KEEP_DAYS and KEEP_LAST_SUCCESS). A run is kept if any of
+// the limits keeps it. Without KEEP_RUNS or KEEP_DAYS, all runs are kept.
+struct RetentionPolicy {
+    // number of most recent runs to keep, 0 for no limit
+    uint keepRuns = 0;
+    // runs completed within this many days are kept, 0 for no limit
+    uint keepDays = 0;
+    // whether the most recent successful run is always kept
+    bool keepLastSuccess = true;
+
+    bool limited() const { return keepRuns > 0 || keepDays > 0; }
+};
+
+struct CompletedRun {
+    uint number;
+    time_t completedAt;
+    RunState result;
+};
+
+// Selects the runs which the policy does not keep. runs must be ordered
+// newest first. Returns their numbers in the same order.
+std::vector<uint> expiredRuns(const RetentionPolicy& policy, const std::vector<CompletedRun>& runs, time_t now);
+
+#endif // LAMINAR_RETENTION_H_
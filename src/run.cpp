@@ -20,10 +20,18 @@
 #include "node.h"
 #include "conf.h"
 #include "log.h"
+#include "supervisor.h"
 
 #include <iostream>
+#include <errno.h>
+#include <map>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
 
 #include <boost/filesystem.hpp>
 namespace fs = boost::filesystem;
@@ -58,69 +66,179 @@ std::string Run::reason() const {
     return reasonMsg;
 }
 
-bool Run::step() {
-    if(!scripts.size())
-        return true;
+// posix_spawn_file_actions_addchdir_np
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_CHDIR
+#endif
 
-    currentScript = scripts.front();
-    scripts.pop();
+// clone3 with CLONE_INTO_CGROUP, Linux 5.7
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+#define HAVE_CLONE_INTO_CGROUP
+#endif
 
-    int pfd[2];
-    pipe(pfd);
+namespace {
+
+// Starts path with posix_spawn, which avoids copying the page tables of
+// laminard. The child gets out as its stdout and stderr and, if status is
+// not -1, status as SUPERVISOR_STATUS_FD. If cwd is null the child stays
+// in the current directory. Returns -1 and sets errno on failure
+pid_t spawn(const char* path, char* const argv[], char* const envp[], const char* cwd, int out, int status) {
+#ifndef HAVE_SPAWN_CHDIR
+    if(cwd) {
+        errno = ENOSYS;
+        return -1;
+    }
+#endif
+    pid_t pid = -1;
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out, 1);
+    posix_spawn_file_actions_adddup2(&actions, out, 2);
+    if(status != -1)
+        posix_spawn_file_actions_adddup2(&actions, status, SUPERVISOR_STATUS_FD);
+#ifdef HAVE_SPAWN_CHDIR
+    if(cwd)
+        posix_spawn_file_actions_addchdir_np(&actions, cwd);
+#endif
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    // reset signal mask (SIGCHLD blocked in Laminar::start)
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    // set pgid == pid for easy killing on abort
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+    if(int err = posix_spawn(&pid, path, &actions, &attr, argv, envp)) {
+        errno = err;
+        pid = -1;
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return pid;
+}
+
+// Creates a child process like fork. If cgroup is not null, the child is
+// created directly in it where the kernel supports it, and otherwise
+// joins it by writing to its cgroup.procs before returning (in the child)
+pid_t forkInto(const Cgroup* cgroup) {
+#ifdef HAVE_CLONE_INTO_CGROUP
+    if(cgroup) {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = cgroup->dirFd();
+        long pid = syscall(SYS_clone3, &args, sizeof(args));
+        // older kernels reject clone3 or the cgroup field of its arguments
+        if(pid != -1 || (errno != ENOSYS && errno != E2BIG && errno != EINVAL))
+            return pid;
+    }
+#endif
     pid_t pid = fork();
+    if(pid == 0 && cgroup)
+        write(cgroup->procsFd(), "0", 1);
+    return pid;
+}
+
+// As spawn, but with fork, and in cgroup if it is not null. Failure to
+// execute path is reported on out and results in an exit status of 1
+pid_t forkExec(const char* path, char* const argv[], char* const envp[], const char* cwd, int out, int status, const Cgroup* cgroup) {
+    // only async-signal-safe functions may be called in the child, so
+    // the error message is prepared beforehand. LLOG cannot be used in
+    // any case because stdout/stderr are captured
+    std::string err = std::string("[laminar] Failed to execute ") + path + "\n";
+    pid_t pid = forkInto(cgroup);
     if(pid == 0) { // child
-        // reset signal mask (SIGCHLD blocked in Laminar::start)
         sigset_t mask;
         sigemptyset(&mask);
         sigaddset(&mask, SIGCHLD);
         sigprocmask(SIG_UNBLOCK, &mask, nullptr);
-
-        // set pgid == pid for easy killing on abort
         setpgid(0, 0);
+        dup2(out, 1);
+        dup2(out, 2);
+        if(status != -1)
+            dup2(status, SUPERVISOR_STATUS_FD);
+        if(cwd)
+            chdir(cwd);
+        execve(path, argv, envp);
+        write(2, err.data(), err.size());
+        _exit(1);
+    }
+    return pid;
+}
 
-        close(pfd[0]);
-        dup2(pfd[1], 1);
-        dup2(pfd[1], 2);
-        close(pfd[1]);
-        std::string buildNum = std::to_string(build);
+}
 
-        std::string PATH = (fs::path(laminarHome)/"cfg"/"scripts").string() + ":";
-        if(const char* p = getenv("PATH")) {
-            PATH.append(p);
-        }
+bool Run::step() {
+    if(!scripts.size())
+        return true;
 
-        chdir(currentScript.cwd.c_str());
+    if(environment.empty())
+        buildEnvironment();
+    // the only variable which may change between steps
+    environment[resultVar] = "RESULT=" + to_string(result);
+    std::vector<char*> envp;
+    for(std::string& var : environment)
+        envp.push_back(&var[0]);
+    envp.push_back(nullptr);
 
-        // conf file env vars
-        for(std::string file : env) {
-            StringMap vars = parseConfFile(file.c_str());
-            for(auto& it : vars) {
-                setenv(it.first.c_str(), it.second.c_str(), true);
-            }
-        }
-        // parameterized vars
-        for(auto& pair : params) {
-            setenv(pair.first.c_str(), pair.second.c_str(), false);
+    // Descriptors are created close-on-exec so that concurrently started
+    // children do not inherit the pipes of other runs
+    int pfd[2];
+    pipe2(pfd, O_CLOEXEC);
+
+    if(!supervisor.empty()) {
+        // hand all remaining scripts to a single supervisor process
+        std::vector<std::string> args;
+        args.push_back(supervisor);
+        for(std::queue<Script> q = scripts; !q.empty(); q.pop()) {
+            args.push_back(q.front().path);
+            args.push_back(q.front().cwd);
         }
+        std::vector<char*> argv;
+        for(std::string& arg : args)
+            argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
 
-        setenv("PATH", PATH.c_str(), true);
-        setenv("RUN", buildNum.c_str(), true);
-        setenv("JOB", name.c_str(), true);
-        if(!node->name.empty())
-            setenv("NODE", node->name.c_str(), true);
-        setenv("RESULT", to_string(result).c_str(), true);
-        setenv("LAST_RESULT", to_string(lastResult).c_str(), true);
-        setenv("WORKSPACE", (fs::path(laminarHome)/"run"/name/"workspace").string().c_str(), true);
-        setenv("ARCHIVE", (fs::path(laminarHome)/"archive"/name/buildNum.c_str()).string().c_str(), true);
-
-        fprintf(stderr, "[laminar] Executing %s\n", currentScript.path.c_str());
-        execl(currentScript.path.c_str(), currentScript.path.c_str(), NULL);
-        // cannot use LLOG because stdout/stderr are captured
-        fprintf(stderr, "[laminar] Failed to execute %s\n", currentScript.path.c_str());
-        _exit(1);
+        int sfd[2];
+        pipe2(sfd, O_CLOEXEC);
+        pid_t pid = cgroup ? forkExec(supervisor.c_str(), argv.data(), envp.data(), nullptr, pfd[1], sfd[1], cgroup.get())
+                           : spawn(supervisor.c_str(), argv.data(), envp.data(), nullptr, pfd[1], sfd[1]);
+        close(sfd[1]);
+        if(pid != -1) {
+            LLOG(INFO, "Spawned supervisor", name, build, pid);
+            std::queue<Script>().swap(scripts);
+            close(pfd[1]);
+            current_pid = pid;
+            output_fd = pfd[0];
+            status_fd = sfd[0];
+            return false;
+        }
+        LLOG(ERROR, "Could not start supervisor, executing scripts directly", supervisor, strerror(errno));
+        close(sfd[0]);
+        supervisor.clear();
     }
 
-    LLOG(INFO, "Forked", currentScript.path, currentScript.cwd, pid);
+    currentScript = scripts.front();
+    scripts.pop();
+    status_fd = -1;
+    char* const argv[] = { const_cast<char*>(currentScript.path.c_str()), nullptr };
+
+    std::string msg = "[laminar] Executing " + currentScript.path + "\n";
+    write(pfd[1], msg.data(), msg.size());
+
+    // If posix_spawn fails, fall back to fork so that the failure is
+    // reported in the log and reaped like any other failed script.
+    // posix_spawn cannot place the child in a cgroup, so runs which have
+    // one are started with clone3 (Linux 5.7), or fork on older kernels
+    pid_t pid = -1;
+    if(!cgroup)
+        pid = spawn(currentScript.path.c_str(), argv, envp.data(), currentScript.cwd.c_str(), pfd[1], -1);
+    if(pid == -1)
+        pid = forkExec(currentScript.path.c_str(), argv, envp.data(), currentScript.cwd.c_str(), pfd[1], -1, cgroup.get());
+
+    LLOG(INFO, "Spawned", currentScript.path, currentScript.cwd, pid);
     close(pfd[1]);
 
     current_pid = pid;
@@ -128,17 +246,109 @@ bool Run::step() {
     return false;
 }
 
-void Run::addScript(std::string scriptPath, std::string scriptWorkingDir) {
-    scripts.push({scriptPath, scriptWorkingDir});
+void Run::statusReceived(const char* buf, size_t sz) {
+    // frames may be split across reads
+    statusBuf.append(buf, sz);
+    size_t i = 0;
+    for(; i + sizeof(SupervisorFrame) <= statusBuf.size(); i += sizeof(SupervisorFrame)) {
+        SupervisorFrame frame;
+        memcpy(&frame, statusBuf.data() + i, sizeof(frame));
+        reaped(frame.status);
+    }
+    statusBuf.erase(0, i);
+}
+
+void Run::buildEnvironment() {
+    // Assembled once per run rather than in each child. Variables from
+    // conf files override those of laminard's environment, parameters
+    // override neither, and laminar's own variables override everything
+    std::map<std::string, std::string> vars;
+    for(char** e = environ; *e; ++e) {
+        const char* eq = strchr(*e, '=');
+        if(eq)
+            vars[std::string(*e, eq - *e)] = eq + 1;
+    }
+    std::string PATH = (fs::path(laminarHome)/"cfg"/"scripts").string() + ":";
+    PATH.append(vars["PATH"]);
+
+    // conf file env vars
+    for(auto& it : envVariables())
+        vars[it.first] = it.second;
+    // parameterized vars
+    for(auto& pair : params)
+        vars.emplace(pair.first, pair.second);
+
+    std::string buildNum = std::to_string(build);
+    vars["PATH"] = PATH;
+    vars["RUN"] = buildNum;
+    vars["JOB"] = name;
+    if(!node->name.empty())
+        vars["NODE"] = node->name;
+    vars["RESULT"] = to_string(result);
+    vars["LAST_RESULT"] = to_string(lastResult);
+    vars["WORKSPACE"] = workspace.empty() ? (fs::path(laminarHome)/"run"/name/"workspace").string() : workspace;
+    vars["ARCHIVE"] = (fs::path(laminarHome)/"archive"/name/buildNum.c_str()).string();
+
+    environment.clear();
+    for(auto& it : vars) {
+        if(it.first == "RESULT")
+            resultVar = environment.size();
+        environment.push_back(it.first + "=" + it.second);
+    }
+}
+
+void Run::addScript(std::string scriptPath, std::string scriptWorkingDir, bool init) {
+    scripts.push({scriptPath, scriptWorkingDir, init});
 }
 
 void Run::addEnv(std::string path) {
     env.push_back(path);
 }
 
+void Run::setEnv(std::string name, std::string value) {
+    envVars[name] = value;
+}
+
+std::map<std::string, std::string> Run::envVariables() const {
+    std::map<std::string, std::string> vars;
+    for(const std::string& file : env) {
+        StringMap conf = parseConfFile(file.c_str());
+        for(auto& it : conf)
+            vars[it.first] = it.second;
+    }
+    for(auto& it : envVars)
+        vars[it.first] = it.second;
+    return vars;
+}
+
+std::vector<Run::Script> Run::takeScripts() {
+    std::vector<Script> taken;
+    for(; !scripts.empty(); scripts.pop())
+        taken.push_back(scripts.front());
+    return taken;
+}
+
+kj::Promise<void> Run::whenStarted() {
+    if(build)
+        return kj::READY_NOW;
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    startWaiters.push_back(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+}
+
 void Run::abort() {
+    // no script has been started yet whose exit status would be recorded
+    if(preparing)
+        result = RunState::ABORTED;
     // clear all pending scripts
     std::queue<Script>().swap(scripts);
+    if(node && node->agent) {
+        node->agent->abort(*this);
+        return;
+    }
+    // processes which left the process group are only found via the cgroup
+    if(cgroup && cgroup->kill())
+        return;
     // if the Maybe is empty, wait() was already called on this process
     KJ_IF_MAYBE(p, current_pid) {
         kill(-*p, SIGTERM);
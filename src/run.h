@@ -22,12 +22,17 @@
 #include <string>
 #include <queue>
 #include <list>
+#include <map>
 #include <functional>
 #include <ostream>
 #include <unordered_map>
 #include <memory>
+#include <vector>
 #include <kj/async.h>
 
+#include "cgroup.h"
+#include "runlog.h"
+
 enum class RunState {
     UNKNOWN,
     PENDING,
@@ -55,15 +60,33 @@ public:
     // more to be done.
     bool step();
 
-    // adds a script to the queue of scripts to be executed by this run
-    void addScript(std::string scriptPath, std::string scriptWorkingDir);
+    // adds a script to the queue of scripts to be executed by this run.
+    // init marks the script which initializes the workspace
+    void addScript(std::string scriptPath, std::string scriptWorkingDir, bool init = false);
 
     // adds a script to the queue using the runDir as the scripts CWD
     void addScript(std::string script) { addScript(script, runDir); }
 
-    // adds an environment file that will be sourced before this run
+    // adds an environment file that will be sourced before this run. All
+    // environment files must be added before the first call to step()
     void addEnv(std::string path);
 
+    // sets a variable as if it had been read from an environment file
+    void setEnv(std::string name, std::string value);
+
+    // the variables from environment files, without those of laminard's
+    // own environment or the parameters
+    std::map<std::string, std::string> envVariables() const;
+
+    struct Script {
+        std::string path;
+        std::string cwd;
+        bool init = false;
+    };
+    // Removes and returns the scripts which have not been executed yet, so
+    // that they can be executed elsewhere
+    std::vector<Script> takeScripts();
+
     // aborts this run
     void abort();
 
@@ -71,6 +94,10 @@ public:
     // may be used to set the run's job status
     void reaped(int status);
 
+    // called with data read from status_fd, which reports the exit status
+    // of each script executed by the supervisor
+    void statusReceived(const char* buf, size_t sz);
+
     std::string reason() const;
 
     std::shared_ptr<Node> node;
@@ -79,28 +106,56 @@ public:
     std::string laminarHome;
     std::string name;
     std::string runDir;
+    // if not empty, the run's private copy of the job's workspace, which
+    // its scripts get as $WORKSPACE instead of the shared one
+    std::string workspace;
+    // whether the run has started but is still waiting for its workspace
+    bool preparing = false;
     std::string parentName;
     int parentBuild = 0;
     std::string reasonMsg;
     uint build = 0;
-    std::string log;
+    // queued runs of higher priority are started first
+    int priority = 0;
+    // identifies the run's records in the Laminar's journal
+    uint64_t journalId = 0;
+    RunLog log;
     kj::Maybe<pid_t> current_pid;
     int output_fd;
+    // When not empty, the path of a laminar-supervisor binary which is used
+    // to execute all the scripts of this run in one child process. In that
+    // case status_fd receives the exit status of each script, otherwise
+    // it is -1
+    std::string supervisor;
+    int status_fd = -1;
+    // if set, every process of this run is started in this cgroup and
+    // abort() kills all of its members
+    std::unique_ptr<Cgroup> cgroup;
     std::unordered_map<std::string, std::string> params;
     kj::Promise<void> timeout = kj::NEVER_DONE;
-    kj::PromiseFulfillerPair<void> started = kj::newPromiseAndFulfiller<void>();
+    // Resolves when the run is started, or at once if it already has been.
+    // May be called more than once if queue requests were coalesced into
+    // this run
+    kj::Promise<void> whenStarted();
+    // fulfilled by the Laminar when it starts the run
+    std::vector<kj::Own<kj::PromiseFulfiller<void>>> startWaiters;
 
     time_t queuedAt;
     time_t startedAt;
 private:
-    struct Script {
-        std::string path;
-        std::string cwd;
-    };
+    // computes the environment of this run's scripts
+    void buildEnvironment();
 
     std::queue<Script> scripts;
     Script currentScript;
     std::list<std::string> env;
+    std::map<std::string, std::string> envVars;
+    // "NAME=value" strings passed to each script
+    std::vector<std::string> environment;
+    // index of the RESULT variable in environment
+    size_t resultVar = 0;
+    // partial frame received from the supervisor
+    std::string statusBuf;
 };
 
 
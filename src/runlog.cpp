@@ -0,0 +1,479 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "runlog.h"
+#include "log.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <functional>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+// Amount of recent output retained in memory
+#define LOG_TAIL_SIZE 65536
+// Size of the buffers passed to zlib and to read/write
+#define LOG_IO_BUFSIZE 16384
+// The compressor is fully flushed, creating a LogCheckpoint, after at
+// least this much output since the previous one. Reading any part of a log
+// therefore decompresses at most this much more than the part itself
+#define LOG_CHECKPOINT_INTERVAL (1024 * 1024)
+
+namespace {
+
+bool writeAll(int fd, const char* data, size_t sz) {
+    while(sz > 0) {
+        ssize_t n = ::write(fd, data, sz);
+        if(n <= 0)
+            return false;
+        data += n;
+        sz -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Collects the part of a log selected by a LogRange from its text, which
+// is passed in consecutive chunks starting at a known offset and line
+class Slicer {
+public:
+    Slicer(const LogRange& range, uint64_t offset, uint64_t line, LogSlice& out) :
+        range(range),
+        pos(offset),
+        line(line),
+        out(out),
+        capturing(false)
+    {}
+
+    // Returns false once the end of the range has been reached
+    bool feed(const char* data, size_t n) {
+        if(!capturing) {
+            size_t skip = 0;
+            if(range.unit == LogRange::BYTES) {
+                skip = static_cast<size_t>(std::min<uint64_t>(n, range.first > pos ? range.first - pos : 0));
+                line += static_cast<uint64_t>(std::count(data, data + skip, '\n'));
+            } else {
+                while(line < range.first && skip < n) {
+                    const char* nl = static_cast<const char*>(memchr(data + skip, '\n', n - skip));
+                    if(!nl) {
+                        skip = n;
+                        break;
+                    }
+                    skip = static_cast<size_t>(nl - data) + 1;
+                    line++;
+                }
+            }
+            data += skip;
+            n -= skip;
+            pos += skip;
+            if(range.unit == LogRange::BYTES ? pos < range.first : line < range.first)
+                return true;
+            capturing = true;
+            out.offset = pos;
+            out.line = line;
+        }
+        size_t take = 0;
+        if(range.unit == LogRange::BYTES) {
+            take = static_cast<size_t>(std::min<uint64_t>(n, range.last > pos ? range.last - pos : 0));
+        } else {
+            while(take < n && line < range.last) {
+                const char* nl = static_cast<const char*>(memchr(data + take, '\n', n - take));
+                if(!nl) {
+                    take = n;
+                    break;
+                }
+                take = static_cast<size_t>(nl - data) + 1;
+                line++;
+            }
+        }
+        bool full = false;
+        if(range.limit && out.text.size() + take >= range.limit) {
+            take = range.limit - out.text.size();
+            full = true;
+        }
+        out.text.append(data, take);
+        pos += take;
+        if(full)
+            return false;
+        return range.unit == LogRange::BYTES ? pos < range.last : line < range.last;
+    }
+
+    // must be called after the last chunk
+    void finish() {
+        if(!capturing) {
+            out.offset = pos;
+            out.line = line;
+        }
+    }
+
+private:
+    const LogRange& range;
+    uint64_t pos;
+    uint64_t line;
+    LogSlice& out;
+    bool capturing;
+};
+
+// replaces a tail selection by the line range it refers to
+LogRange resolve(LogRange range, uint64_t lines) {
+    if(range.tail) {
+        range.unit = LogRange::LINES;
+        range.first = lines > range.tail ? lines - range.tail : 0;
+        range.last = UINT64_MAX;
+    }
+    return range;
+}
+
+// the last checkpoint before the start of the range
+const LogCheckpoint& checkpointFor(const LogLines& index, const LogRange& range) {
+    size_t i = 0;
+    for(size_t c = 1; c < index.checkpoints.size(); ++c) {
+        const LogCheckpoint& cp = index.checkpoints[c];
+        // a checkpoint may be in the middle of the line it counts, so the
+        // line it is in can only be read from an earlier one
+        if(range.unit == LogRange::BYTES ? cp.offset > range.first : cp.line >= range.first)
+            break;
+        i = c;
+    }
+    return index.checkpoints[i];
+}
+
+uint64_t countLines(const std::string& log) {
+    uint64_t n = static_cast<uint64_t>(std::count(log.begin(), log.end(), '\n'));
+    return n + (!log.empty() && log.back() != '\n' ? 1 : 0);
+}
+
+// reads up to n bytes of the compressed log at offset into buf, returning
+// the number read or 0 at its end
+typedef std::function<size_t(uint64_t offset, char* buf, size_t n)> ReadFn;
+
+// Decompresses the log from checkpoint cp onward into slicer, until it
+// has its range or the compressed data ends
+bool inflateFrom(const LogCheckpoint& cp, ReadFn read, Slicer& slicer) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // at the start of the file, the gzip or zlib header is detected,
+    // otherwise this is a raw deflate stream
+    if(inflateInit2(&strm, cp.compressedOffset == 0 ? 15 + 32 : -15) != Z_OK)
+        return false;
+    char in[LOG_IO_BUFSIZE];
+    char out[LOG_IO_BUFSIZE];
+    uint64_t offset = cp.compressedOffset;
+    int res = Z_OK;
+    for(bool more = true; more && res == Z_OK;) {
+        if(strm.avail_in == 0) {
+            size_t n = read(offset, in, sizeof(in));
+            if(n == 0)
+                break;
+            offset += n;
+            strm.next_in = reinterpret_cast<Bytef*>(in);
+            strm.avail_in = static_cast<uInt>(n);
+        }
+        strm.next_out = reinterpret_cast<Bytef*>(out);
+        strm.avail_out = sizeof(out);
+        res = ::inflate(&strm, Z_NO_FLUSH);
+        more = slicer.feed(out, sizeof(out) - strm.avail_out);
+    }
+    inflateEnd(&strm);
+    return res == Z_OK || res == Z_STREAM_END;
+}
+
+}
+
+bool LogLines::write(const std::string& path) const {
+    // written to a temporary file first so that an index is never found
+    // half-written
+    std::string tmp = path + ".tmp";
+    FILE* f = fopen(tmp.c_str(), "we");
+    if(!f)
+        return false;
+    fprintf(f, "laminar-log-index 1\n%llu %llu\n", (unsigned long long) size, (unsigned long long) lines);
+    for(const LogCheckpoint& cp : checkpoints) {
+        fprintf(f, "%llu %llu %llu\n", (unsigned long long) cp.offset, (unsigned long long) cp.line,
+                (unsigned long long) cp.compressedOffset);
+    }
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+    if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool LogLines::read(const std::string& path) {
+    FILE* f = fopen(path.c_str(), "re");
+    if(!f)
+        return false;
+    unsigned version = 0;
+    unsigned long long s, l, o, ln, c;
+    bool ok = fscanf(f, "laminar-log-index %u %llu %llu", &version, &s, &l) == 3 && version == 1;
+    if(ok) {
+        size = s;
+        lines = l;
+        checkpoints.clear();
+        while(fscanf(f, "%llu %llu %llu", &o, &ln, &c) == 3)
+            checkpoints.push_back({o, ln, c});
+        // the first checkpoint is always the start of the log
+        ok = !checkpoints.empty() && checkpoints[0].compressedOffset == 0;
+    }
+    fclose(f);
+    return ok;
+}
+
+RunLog::RunLog() :
+    fd(-1),
+    streaming(false),
+    dirty(false),
+    totalSize(0),
+    compressedSize(0),
+    newlines(0),
+    lineEnded(true)
+{
+    index.checkpoints.push_back({0, 0, 0});
+}
+
+RunLog::~RunLog() {
+    if(streaming)
+        deflateEnd(&strm);
+    if(fd != -1)
+        ::close(fd);
+}
+
+bool RunLog::open(std::string path) {
+    // a run whose start failed may open its log again
+    if(streaming) {
+        deflateEnd(&strm);
+        streaming = false;
+    }
+    if(fd != -1) {
+        ::close(fd);
+        fd = -1;
+    }
+    filePath = path;
+    fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(fd == -1) {
+        LLOG(ERROR, "Could not open log file", path, strerror(errno));
+        return false;
+    }
+    memset(&strm, 0, sizeof(strm));
+    // 15 window bits plus 16 selects a gzip header so that the file can
+    // be handed directly to anything that understands gzip
+    if(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        LLOG(ERROR, "Could not initialize log compression", path);
+        ::close(fd);
+        fd = -1;
+        return false;
+    }
+    streaming = true;
+    return true;
+}
+
+void RunLog::append(const char* data, size_t sz) {
+    totalSize += sz;
+    if(sz > 0) {
+        newlines += static_cast<uint64_t>(std::count(data, data + sz, '\n'));
+        lineEnded = data[sz - 1] == '\n';
+    }
+    index.size = totalSize;
+    index.lines = newlines + (lineEnded ? 0 : 1);
+    tailBuf.append(data, sz);
+    // trim occasionally rather than on every append
+    if(tailBuf.size() > 2 * LOG_TAIL_SIZE)
+        tailBuf.erase(0, tailBuf.size() - LOG_TAIL_SIZE);
+
+    if(!streaming)
+        return;
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    strm.avail_in = static_cast<uInt>(sz);
+    flush(Z_NO_FLUSH);
+    dirty = true;
+    if(totalSize - index.checkpoints.back().offset >= LOG_CHECKPOINT_INTERVAL) {
+        flush(Z_FULL_FLUSH);
+        dirty = false;
+        index.checkpoints.push_back({totalSize, newlines, compressedSize});
+    }
+}
+
+void RunLog::finish() {
+    if(!streaming)
+        return;
+    flush(Z_FINISH);
+    deflateEnd(&strm);
+    streaming = false;
+    dirty = false;
+    hexdigest = hash.hexdigest();
+}
+
+bool RunLog::moveTo(std::string dest) {
+    if(fd == -1)
+        return false;
+    // only rename the file at filePath if it is still the one being written
+    struct stat byPath, byFd;
+    if(stat(filePath.c_str(), &byPath) == 0 && fstat(fd, &byFd) == 0
+            && byPath.st_dev == byFd.st_dev && byPath.st_ino == byFd.st_ino
+            && ::rename(filePath.c_str(), dest.c_str()) == 0) {
+        return true;
+    }
+    // otherwise (including an attempt to rename across filesystems), write
+    // a copy and rename that into place so dest never appears half-written
+    std::string tmp = dest + ".tmp";
+    int out = ::open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if(out == -1)
+        return false;
+    std::string data = compressed();
+    bool ok = writeAll(out, data.data(), data.size());
+    ok = (::close(out) == 0) && ok;
+    if(!ok || ::rename(tmp.c_str(), dest.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string RunLog::compressed() {
+    if(dirty) {
+        flush(Z_SYNC_FLUSH);
+        dirty = false;
+    }
+    std::string result;
+    if(fd == -1)
+        return result;
+    char buf[LOG_IO_BUFSIZE];
+    off_t offset = 0;
+    for(ssize_t n; (n = ::pread(fd, buf, sizeof(buf), offset)) > 0; offset += n)
+        result.append(buf, static_cast<size_t>(n));
+    return result;
+}
+
+std::string RunLog::read() {
+    if(fd == -1)
+        return tail();
+    std::string zipped = compressed();
+    std::string log;
+    log.reserve(totalSize);
+    if(!inflateLog(zipped.data(), zipped.size(), log)) {
+        LLOG(ERROR, "Failed to uncompress log", filePath);
+    }
+    return log;
+}
+
+bool RunLog::slice(const LogRange& range, LogSlice& out) {
+    out.size = index.size;
+    out.lines = index.lines;
+    if(fd == -1) {
+        // only the tail is available
+        out.text = tail();
+        out.offset = totalSize - out.text.size();
+        return false;
+    }
+    if(dirty) {
+        flush(Z_SYNC_FLUSH);
+        dirty = false;
+    }
+    LogRange r = resolve(range, index.lines);
+    const LogCheckpoint& cp = checkpointFor(index, r);
+    Slicer slicer(r, cp.offset, cp.line, out);
+    bool ok = inflateFrom(cp, [this](uint64_t offset, char* buf, size_t n) -> size_t {
+        ssize_t res = ::pread(fd, buf, n, static_cast<off_t>(offset));
+        return res > 0 ? static_cast<size_t>(res) : 0;
+    }, slicer);
+    slicer.finish();
+    return ok;
+}
+
+std::string RunLog::tail() const {
+    if(tailBuf.size() <= LOG_TAIL_SIZE)
+        return tailBuf;
+    return tailBuf.substr(tailBuf.size() - LOG_TAIL_SIZE);
+}
+
+void RunLog::flush(int mode) {
+    // Drain the compressor until it no longer fills the output buffer, which
+    // means all of the input has been consumed (or for Z_FINISH, that the
+    // stream has been terminated)
+    char buf[LOG_IO_BUFSIZE];
+    do {
+        strm.next_out = reinterpret_cast<Bytef*>(buf);
+        strm.avail_out = sizeof(buf);
+        ::deflate(&strm, mode);
+        size_t n = sizeof(buf) - strm.avail_out;
+        hash.update(buf, n);
+        if(n > 0 && !writeAll(fd, buf, n)) {
+            LLOG(ERROR, "Failed to write log file", filePath, strerror(errno));
+        }
+        compressedSize += n;
+    } while(strm.avail_out == 0);
+}
+
+bool inflateLog(const void* data, size_t sz, std::string& out) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    // 15 window bits plus 32 enables automatic detection of zlib or gzip
+    // headers. Laminar previously stored logs compressed in zlib format.
+    if(inflateInit2(&strm, 15 + 32) != Z_OK)
+        return false;
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(data));
+    strm.avail_in = static_cast<uInt>(sz);
+    char buf[LOG_IO_BUFSIZE];
+    int res;
+    do {
+        strm.next_out = reinterpret_cast<Bytef*>(buf);
+        strm.avail_out = sizeof(buf);
+        res = ::inflate(&strm, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - strm.avail_out);
+    } while(res == Z_OK && (strm.avail_in > 0 || strm.avail_out == 0));
+    inflateEnd(&strm);
+    // Z_OK or Z_BUF_ERROR here means the input ended before the end of the
+    // compressed stream, which is expected for a log still being written
+    return res == Z_STREAM_END || res == Z_OK || res == Z_BUF_ERROR;
+}
+
+bool sliceLog(const void* data, size_t sz, const LogLines* index, const LogRange& range, LogSlice& out) {
+    if(!index) {
+        std::string log;
+        if(!inflateLog(data, sz, log))
+            return false;
+        sliceText(log, range, out);
+        return true;
+    }
+    out.size = index->size;
+    out.lines = index->lines;
+    LogRange r = resolve(range, index->lines);
+    const LogCheckpoint& cp = checkpointFor(*index, r);
+    Slicer slicer(r, cp.offset, cp.line, out);
+    bool ok = inflateFrom(cp, [data, sz](uint64_t offset, char* buf, size_t n) -> size_t {
+        if(offset >= sz)
+            return 0;
+        size_t len = std::min<size_t>(n, sz - offset);
+        memcpy(buf, static_cast<const char*>(data) + offset, len);
+        return len;
+    }, slicer);
+    slicer.finish();
+    return ok;
+}
+
+void sliceText(const std::string& log, const LogRange& range, LogSlice& out) {
+    out.size = log.size();
+    out.lines = countLines(log);
+    LogRange r = resolve(range, out.lines);
+    Slicer slicer(r, 0, 0, out);
+    slicer.feed(log.data(), log.size());
+    slicer.finish();
+}
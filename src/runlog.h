@@ -0,0 +1,170 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_RUNLOG_H_
+#define LAMINAR_RUNLOG_H_
+
+#include "sha256.h"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// A point in a compressed log from which it can be decompressed without
+// the data before it, because the compressor was fully flushed there
+struct LogCheckpoint {
+    // uncompressed offset and the number of lines before it
+    uint64_t offset;
+    uint64_t line;
+    // offset in the compressed file at which a raw deflate stream starts,
+    // or 0 for the start of the file
+    uint64_t compressedOffset;
+};
+
+// Locates the lines of a compressed log, so that any part of it can be
+// read by decompressing only from the checkpoint before that part. It is
+// stored next to the log in a file of the same name with ".idx" appended
+struct LogLines {
+    // uncompressed bytes
+    uint64_t size = 0;
+    // a final line without a newline also counts
+    uint64_t lines = 0;
+    std::vector<LogCheckpoint> checkpoints;
+
+    bool write(const std::string& path) const;
+    // Returns false if the file does not exist or is invalid, as for
+    // logs stored before indexes were written
+    bool read(const std::string& path);
+};
+
+// Selects part of a log, either by byte offsets or by line numbers
+// counting from 0. The default selects all of it
+struct LogRange {
+    enum Unit { BYTES, LINES };
+    Unit unit = BYTES;
+    uint64_t first = 0;
+    // exclusive
+    uint64_t last = UINT64_MAX;
+    // if not 0, selects the last tail lines instead of first to last
+    uint64_t tail = 0;
+    // if not 0, at most this many bytes are returned
+    size_t limit = 0;
+};
+
+struct LogSlice {
+    // where the text starts in the log
+    uint64_t offset = 0;
+    uint64_t line = 0;
+    std::string text;
+    // of the whole log when it was read
+    uint64_t size = 0;
+    uint64_t lines = 0;
+};
+
+// Streams the output of a run through a gzip compressor into a file, so
+// that the complete log of a run never needs to be held in memory. Only
+// a bounded tail of the most recent output is kept.
+class RunLog {
+public:
+    RunLog();
+    ~RunLog();
+
+    RunLog(const RunLog&) = delete;
+    RunLog& operator=(const RunLog&) = delete;
+
+    // Creates (or truncates) the file at path which will receive the
+    // compressed log. Returns false if the file could not be opened, in
+    // which case only the tail of the log will be available.
+    bool open(std::string path);
+
+    // compresses and appends output to the log
+    void append(const char* data, size_t sz);
+
+    // Terminates the compressed stream. No more data may be appended.
+    void finish();
+
+    // Fetches the compressed log as it currently exists in the file. The
+    // compressor is flushed first so that the result can be decompressed
+    // up to the most recently appended byte.
+    std::string compressed();
+
+    // Fetches and decompresses the whole log
+    std::string read();
+
+    // Decompresses the selected part of the log as written so far. Only the
+    // data after the checkpoint before it is read. Returns false on error
+    bool slice(const LogRange& range, LogSlice& out);
+
+    // the checkpoints written so far and the size of the log
+    const LogLines& lineIndex() const { return index; }
+
+    // SHA-256 of the compressed file. Only valid after finish()
+    const std::string& digest() const { return hexdigest; }
+
+    // Moves the finished log file to dest. If a script removed or replaced
+    // the file in the rundir, dest is instead written from the open
+    // descriptor. Returns false on failure. Once finish() has been called,
+    // this may run in another thread concurrently with read().
+    bool moveTo(std::string dest);
+
+    // the most recent output, at most LOG_TAIL_SIZE bytes
+    std::string tail() const;
+
+    // number of (uncompressed) bytes appended so far
+    size_t size() const { return totalSize; }
+
+    // the path the log was written to while the run was in progress
+    const std::string& path() const { return filePath; }
+
+private:
+    void flush(int mode);
+
+    std::string filePath;
+    // The file is always accessed via this descriptor rather than its path
+    // because the file lives in the rundir where scripts may remove it
+    int fd;
+    z_stream strm;
+    Sha256 hash;
+    std::string hexdigest;
+    bool streaming;
+    // whether data was appended since the last flush
+    bool dirty;
+    size_t totalSize;
+    std::string tailBuf;
+    // bytes written to the file
+    uint64_t compressedSize;
+    uint64_t newlines;
+    // whether the last byte appended was a newline
+    bool lineEnded;
+    LogLines index;
+};
+
+// Decompresses zlib or gzip formatted data, appending the result to out.
+// A truncated stream, such as that of a log which is still being written,
+// is decompressed as far as possible. Returns false on a data error.
+bool inflateLog(const void* data, size_t sz, std::string& out);
+
+// Decompresses the selected part of a stored log. If index is null, as
+// for logs stored without one, the whole log is decompressed
+bool sliceLog(const void* data, size_t sz, const LogLines* index, const LogRange& range, LogSlice& out);
+
+// Selects part of an uncompressed log
+void sliceText(const std::string& log, const LogRange& range, LogSlice& out);
+
+#endif // LAMINAR_RUNLOG_H_
@@ -0,0 +1,314 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "scheduler.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+namespace {
+
+// whether a job with the given tags may run on the node
+bool nodeAccepts(const Node& node, const std::set<std::string>& tags) {
+    // if the node has no tags, allow the build
+    if(node.tags.size() == 0)
+        return true;
+    // otherwise, allow the build if job and node have a tag in common.
+    // A job without tags therefore cannot run on a node with tags
+    for(const std::string& tag : tags) {
+        if(node.tags.find(tag) != node.tags.end())
+            return true;
+    }
+    return false;
+}
+
+int count(const ResourceMap& m, const std::string& name) {
+    auto it = m.find(name);
+    return it == m.end() ? 0 : it->second;
+}
+
+// whether avail has at least as much of everything as need
+bool covers(const Demand& avail, const Demand& need) {
+    if(avail.slots < need.slots)
+        return false;
+    for(const auto& r : need.resources) {
+        if(count(avail.resources, r.first) < r.second)
+            return false;
+    }
+    return true;
+}
+
+// adds (or with sign -1, subtracts) d to a
+void add(Demand& a, const Demand& d, int sign) {
+    a.slots += sign * d.slots;
+    for(const auto& r : d.resources)
+        a.resources[r.first] += sign * r.second;
+}
+
+Demand capacity(const Node& node) {
+    Demand d;
+    d.slots = node.numExecutors;
+    d.resources = node.resources;
+    return d;
+}
+
+Demand available(const Node& node) {
+    Demand d = capacity(node);
+    d.slots -= node.busyExecutors;
+    for(const auto& r : node.busyResources)
+        d.resources[r.first] -= r.second;
+    return d;
+}
+
+}
+
+ResourceMap parseResources(const std::string& list) {
+    ResourceMap m;
+    std::istringstream iss(list);
+    std::string item;
+    while(std::getline(iss, item, ',')) {
+        size_t colon = item.find(':');
+        std::string name = item.substr(0, colon);
+        if(name.empty())
+            continue;
+        m[name] = colon == std::string::npos ? 1 : atoi(item.c_str() + colon + 1);
+    }
+    return m;
+}
+
+Scheduler::Scheduler() :
+    nextSeq(0)
+{
+    classes.resize(1);
+}
+
+void Scheduler::configure(const NodeMap& nodes, const TagMap& jobTags, const DemandMap& jobDemands) {
+    classes.clear();
+    classByJob.clear();
+    // the class of jobs without tags
+    classes.resize(1);
+    std::map<std::set<std::string>, uint> classByTags;
+    classByTags[std::set<std::string>()] = 0;
+    for(const auto& it : jobTags) {
+        auto c = classByTags.find(it.second);
+        if(c == classByTags.end()) {
+            c = classByTags.emplace(it.second, static_cast<uint>(classes.size())).first;
+            classes.push_back(TagClass{it.second, {}});
+        }
+        classByJob[it.first] = c->second;
+    }
+    allNodes.clear();
+    for(const auto& it : nodes)
+        allNodes.push_back(it.second);
+    for(TagClass& c : classes) {
+        for(const std::shared_ptr<Node>& node : allNodes) {
+            if(nodeAccepts(*node, c.tags))
+                c.nodes.push_back(node);
+        }
+    }
+    demands = jobDemands;
+
+    // runs which are already queued may now belong to a different class
+    auto& byOrder = runs.get<0>();
+    for(auto it = byOrder.begin(); it != byOrder.end(); ++it) {
+        uint c = classOf(it->run->name);
+        if(c != it->tagClass)
+            byOrder.modify(it, [c](QueuedRun& q){ q.tagClass = c; });
+    }
+}
+
+void Scheduler::queue(std::shared_ptr<Run> run) {
+    uint c = classOf(run->name);
+    runs.insert(QueuedRun{nextSeq++, c, run->priority, run});
+}
+
+std::shared_ptr<Run> Scheduler::coalesce(const Run& run, bool* raised) {
+    auto& byName = runs.get<2>();
+    auto range = byName.equal_range(run.name);
+    for(auto it = range.first; it != range.second; ++it) {
+        if(it->run->params != run.params)
+            continue;
+        std::shared_ptr<Run> queued = it->run;
+        if(run.priority > it->priority) {
+            int p = run.priority;
+            queued->priority = p;
+            byName.modify(it, [p](QueuedRun& q){ q.priority = p; });
+            if(raised)
+                *raised = true;
+        }
+        return queued;
+    }
+    return nullptr;
+}
+
+void Scheduler::dispatch(StartFn start) {
+    time_t now = time(nullptr);
+    // Every run needs at least one executor, so a class can start no more
+    // runs once all of its nodes are busy
+    auto exhausted = [this](uint c) {
+        for(const std::shared_ptr<Node>& node : classes[c].nodes) {
+            if(node->busyExecutors < node->numExecutors)
+                return false;
+        }
+        return true;
+    };
+    auto& byClass = runs.get<1>();
+    // The cursor of each class points at its first run which has not yet
+    // been tried in this dispatch
+    std::vector<Queue::nth_index<1>::type::iterator> cursors;
+    std::vector<bool> done;
+    for(uint c = 0; c < classes.size(); ++c) {
+        cursors.push_back(byClass.lower_bound(boost::make_tuple(c)));
+        done.push_back(exhausted(c));
+    }
+    // Jobs of each class a run of which did not fit. Room only shrinks
+    // during a dispatch, so their later runs cannot fit either
+    std::vector<std::set<std::string>> blocked(classes.size());
+
+    bool reserved = false;
+    Reservation res;
+    for(;;) {
+        // the class whose next run comes first in the queue
+        int best = -1;
+        for(uint c = 0; c < classes.size(); ++c) {
+            if(done[c])
+                continue;
+            if(cursors[c] == byClass.end() || cursors[c]->tagClass != c) {
+                done[c] = true;
+                continue;
+            }
+            if(best == -1 || cursors[c]->order() < cursors[best]->order())
+                best = static_cast<int>(c);
+        }
+        if(best == -1)
+            return;
+
+        auto it = cursors[best];
+        if(blocked[best].count(it->name())) {
+            ++cursors[best];
+            continue;
+        }
+        const Demand& demand = demandOf(it->run->name);
+        uint duration = estimate ? estimate(it->run->name) : 0;
+        time_t expectedEnd = duration ? now + duration : 0;
+
+        std::shared_ptr<Node> node;
+        // whether the run uses resources the reservation leaves spare
+        bool usesSpare = false;
+        for(const std::shared_ptr<Node>& n : classes[best].nodes) {
+            if(!covers(available(*n), demand))
+                continue;
+            if(reserved && n == res.node) {
+                bool endsFirst = expectedEnd && res.shadow && expectedEnd <= res.shadow;
+                if(!endsFirst && !covers(res.spare, demand))
+                    continue;
+                usesSpare = !endsFirst;
+            }
+            node = n;
+            break;
+        }
+
+        if(!node) {
+            // the first run which cannot start gets the reservation
+            if(!reserved)
+                reserved = reserve(best, demand, res);
+            blocked[best].insert(it->name());
+            ++cursors[best];
+            continue;
+        }
+
+        std::shared_ptr<Run> run = it->run;
+        int queueIndex = static_cast<int>(runs.get<0>().rank(runs.project<0>(it)));
+        if(!start(node, run, queueIndex)) {
+            ++cursors[best];
+            continue;
+        }
+        node->busyExecutors += demand.slots;
+        for(const auto& r : demand.resources)
+            node->busyResources[r.first] += r.second;
+        if(usesSpare)
+            add(res.spare, demand, -1);
+        running[run.get()] = Started{node, demand, expectedEnd};
+        cursors[best] = byClass.erase(it);
+        if(node->busyExecutors >= node->numExecutors) {
+            // classes sharing the node may now have none left
+            for(uint c = 0; c < classes.size(); ++c) {
+                if(!done[c])
+                    done[c] = exhausted(c);
+            }
+        }
+    }
+}
+
+void Scheduler::finished(const Run* run) {
+    auto it = running.find(run);
+    if(it == running.end())
+        return;
+    Node& node = *it->second.node;
+    node.busyExecutors -= it->second.demand.slots;
+    for(const auto& r : it->second.demand.resources)
+        node.busyResources[r.first] -= r.second;
+    running.erase(it);
+}
+
+bool Scheduler::reserve(uint tagClass, const Demand& demand, Reservation& res) const {
+    const time_t UNKNOWN = std::numeric_limits<time_t>::max();
+    time_t best = 0;
+    for(const std::shared_ptr<Node>& node : classes[tagClass].nodes) {
+        if(!covers(capacity(*node), demand))
+            continue;
+        // runs on this node in the order in which they are expected to end
+        std::vector<const Started*> onNode;
+        for(const auto& it : running) {
+            if(it.second.node == node)
+                onNode.push_back(&it.second);
+        }
+        auto end = [&](const Started* s) { return s->expectedEnd ? s->expectedEnd : UNKNOWN; };
+        std::sort(onNode.begin(), onNode.end(), [&](const Started* a, const Started* b){
+            return end(a) < end(b);
+        });
+        Demand avail = available(*node);
+        time_t shadow = UNKNOWN;
+        for(const Started* s : onNode) {
+            add(avail, s->demand, 1);
+            if(covers(avail, demand)) {
+                shadow = end(s);
+                break;
+            }
+        }
+        if(res.node && shadow >= best)
+            continue;
+        best = shadow;
+        res.node = node;
+        res.shadow = shadow == UNKNOWN ? 0 : shadow;
+        res.spare = avail;
+        add(res.spare, demand, -1);
+    }
+    return bool(res.node);
+}
+
+uint Scheduler::classOf(const std::string& job) const {
+    auto it = classByJob.find(job);
+    return it == classByJob.end() ? 0 : it->second;
+}
+
+const Demand& Scheduler::demandOf(const std::string& job) const {
+    auto it = demands.find(job);
+    return it == demands.end() ? defaultDemand : it->second;
+}
@@ -0,0 +1,180 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SCHEDULER_H_
+#define LAMINAR_SCHEDULER_H_
+
+#include "node.h"
+#include "run.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <time.h>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/ranked_index.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/composite_key.hpp>
+#include <boost/multi_index/member.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+
+typedef std::unordered_map<std::string, std::set<std::string>> TagMap;
+typedef std::unordered_map<std::string, Demand> DemandMap;
+
+// Parses a list of resources in the form "name:count,name:count". A name
+// without a count counts as 1
+ResourceMap parseResources(const std::string& list);
+
+// Holds runs waiting for an executor and decides which node runs them.
+//
+// Each run occupies the number of executors ("slots") and named
+// resources its job demands on its node until it finishes. Jobs with the
+// same set of tags can run on the same set of nodes, so the nodes
+// eligible for each such "tag class" are computed when the configuration
+// is loaded.
+//
+// Dispatch scans the queue in order of priority, and of queueing among
+// runs of equal priority, and starts each run on the first eligible node
+// which has room for it. Each tag class is scanned separately and merged
+// into that order, so that a class none of whose nodes has a free
+// executor is not scanned at all. Smaller runs may therefore
+// overtake a large one which does not fit yet (backfilling). To prevent
+// the large run from being starved, the oldest run which cannot start
+// holds a reservation on the eligible node expected to have room for it
+// soonest, based on the estimated durations of the runs on that node.
+// Runs after it in the queue may only start on that node if they are
+// expected to finish before then, or if they fit into what the reserved
+// run leaves spare.
+class Scheduler {
+public:
+    struct QueuedRun {
+        // increases monotonically with each queued run
+        uint64_t seq;
+        uint tagClass;
+        // copied from the run, higher is dispatched first
+        int priority;
+        std::shared_ptr<Run> run;
+        const std::string& name() const { return run->name; }
+        std::pair<int, uint64_t> order() const { return std::make_pair(-priority, seq); }
+    };
+
+private:
+    struct _queued_index : boost::multi_index::indexed_by<
+        // all queued runs in the order they are dispatched, with O(log n)
+        // lookup of a run's position
+        boost::multi_index::ranked_unique<boost::multi_index::const_mem_fun<QueuedRun, std::pair<int, uint64_t>, &QueuedRun::order>>,
+        // per tag class in the order they are dispatched
+        boost::multi_index::ordered_unique<boost::multi_index::composite_key<QueuedRun,
+            boost::multi_index::member<QueuedRun, uint, &QueuedRun::tagClass>,
+            boost::multi_index::const_mem_fun<QueuedRun, std::pair<int, uint64_t>, &QueuedRun::order>
+        >>,
+        // by job name
+        boost::multi_index::ordered_non_unique<boost::multi_index::const_mem_fun<QueuedRun, const std::string&, &QueuedRun::name>>
+    > {};
+    typedef boost::multi_index_container<QueuedRun, _queued_index> Queue;
+
+public:
+    Scheduler();
+
+    // Recomputes which nodes may run which jobs and what each job demands.
+    // Must be called whenever nodes, job tags or demands change. Jobs not
+    // found in jobDemands occupy one executor and no other resources
+    void configure(const NodeMap& nodes, const TagMap& jobTags, const DemandMap& jobDemands = DemandMap());
+
+    // Returns the expected duration of a run of the given job in seconds,
+    // or 0 if unknown
+    typedef std::function<uint(const std::string&)> EstimateFn;
+    void setEstimator(EstimateFn fn) { estimate = fn; }
+
+    // Queues the run with its current priority
+    void queue(std::shared_ptr<Run> run);
+
+    // Returns a queued run of the same job as run and with the same
+    // parameters, or nullptr if there is none. If run has a higher
+    // priority, the queued run is raised to it and *raised, if given, is
+    // set to true
+    std::shared_ptr<Run> coalesce(const Run& run, bool* raised = nullptr);
+
+    // Called by dispatch to start the given run on the given node. The
+    // third argument is the run's position in the queue, counting from 0
+    // for the first to be dispatched. Returns false if the run could not
+    // be started, in which case it remains queued.
+    typedef std::function<bool(std::shared_ptr<Node>, std::shared_ptr<Run>, int)> StartFn;
+
+    // Starts as many queued runs as there is room for on their nodes. The
+    // executors and resources of each started run are taken from its node
+    // until finished() is called
+    void dispatch(StartFn start);
+
+    // Returns the executors and resources of a run started by dispatch
+    // to its node
+    void finished(const Run* run);
+
+    // all queued runs in the order they are dispatched
+    const Queue::nth_index<0>::type& queued() const { return runs.get<0>(); }
+    size_t queuedCount(const std::string& job) const { return runs.get<2>().count(job); }
+
+private:
+    uint classOf(const std::string& job) const;
+    const Demand& demandOf(const std::string& job) const;
+
+    struct Reservation {
+        std::shared_ptr<Node> node;
+        // when the reserved run is expected to fit, 0 if unknown
+        time_t shadow;
+        // what remains on the node at that time once the reserved run has
+        // started
+        Demand spare;
+    };
+    // Finds the reservation for a run of the given class and demand.
+    // Returns false if no eligible node could ever run it
+    bool reserve(uint tagClass, const Demand& demand, Reservation& res) const;
+
+    struct TagClass {
+        std::set<std::string> tags;
+        // eligible nodes in the order in which they should be tried
+        std::vector<std::shared_ptr<Node>> nodes;
+    };
+    // the first class is that of jobs without tags
+    std::vector<TagClass> classes;
+    // jobs not found here have no tags
+    std::unordered_map<std::string, uint> classByJob;
+    DemandMap demands;
+    Demand defaultDemand;
+    std::vector<std::shared_ptr<Node>> allNodes;
+    EstimateFn estimate;
+
+    struct Started {
+        std::shared_ptr<Node> node;
+        Demand demand;
+        // 0 if unknown
+        time_t expectedEnd;
+    };
+    std::unordered_map<const Run*, Started> running;
+
+    Queue runs;
+    uint64_t nextSeq;
+};
+
+#endif // LAMINAR_SCHEDULER_H_
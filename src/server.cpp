@@ -20,6 +20,7 @@
 #include "interface.h"
 #include "laminar.capnp.h"
 #include "resources.h"
+#include "metrics.h"
 #include "log.h"
 
 #include <capnp/ez-rpc.h>
@@ -28,17 +29,53 @@
 #include <kj/async-io.h>
 #include <kj/async-unix.h>
 #include <kj/threadlocal.h>
+#include <kj/vector.h>
 
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
 #include <sys/signal.h>
 #include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <strings.h>
+#include <time.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
 
 #include <rapidjson/document.h>
 
-// Size of buffer used to read from file descriptors. Should be
-// a multiple of sizeof(struct signalfd_siginfo) == 128
+// Initial and maximum size of the buffer used to read from each file
+// descriptor. Should be multiples of sizeof(struct signalfd_siginfo) == 128.
+// The maximum is the default capacity of a pipe
 #define PROC_IO_BUFSIZE 4096
+#define PROC_IO_MAX_BUFSIZE 65536
+
+// Number of threads available to Server::runInBackground
+#define NUM_BACKGROUND_THREADS 4
+
+// Maximum number of bytes of a log returned by one request for a part of it
+#define LOG_SLICE_LIMIT (4 * 1024 * 1024)
+
+// Default number of bytes which may be queued for a websocket client
+// before it is considered too slow (see LAMINAR_CLIENT_QUEUE_LIMIT)
+#define CLIENT_QUEUE_LIMIT_DEFAULT (4 * 1024 * 1024)
+// Log output queued for a slow client is merged into frames of up to
+// this size
+#define LOG_FRAME_SIZE 65536
+
+// Number of writes to a tailLog client which may await an answer, as
+// OUTPUT_WINDOW in agent.cpp
+#define TAIL_LOG_WINDOW 8
+
+// The event loop's watchdog timer fires this often
+#define WATCHDOG_INTERVAL_MS 50
+
+// A late watchdog timer is logged as a stall of the loop beyond this
+#define STALL_THRESHOLD_MS_DEFAULT 250
 
 namespace {
 
@@ -53,18 +90,381 @@ LaminarCi::JobResult fromRunState(RunState state) {
     }
 }
 
+ParamMap toParamMap(capnp::List<LaminarCi::JobParam>::Reader list) {
+    ParamMap params;
+    for(auto p : list) {
+        params[p.getName().cStr()] = p.getValue().cStr();
+    }
+    return params;
+}
+
+// Formats t as an HTTP-date (RFC 7231 section 7.1.1.1)
+std::string httpDate(time_t t) {
+    struct tm tm;
+    char buf[32];
+    gmtime_r(&t, &tm);
+    strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    return buf;
+}
+
+// Parses an HTTP-date in its preferred format. Returns -1 on failure
+time_t parseHttpDate(const std::string& date) {
+    struct tm tm = {};
+    if(!strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return -1;
+    return timegm(&tm);
+}
+
+// whether etag is in the list of entity tags of an If-None-Match header
+bool etagMatches(const std::string& list, const std::string& etag) {
+    if(list == "*")
+        return true;
+    for(size_t pos = list.find(etag); pos != std::string::npos; pos = list.find(etag, pos + 1)) {
+        // also matches the weak form W/"..." as If-None-Match requires
+        char next = pos + etag.size() < list.size() ? list[pos + etag.size()] : ',';
+        if(next == ',' || next == ' ')
+            return true;
+    }
+    return false;
+}
+
+// whether an Accept-Encoding header value allows the given content coding
+bool acceptsEncoding(const std::string& accept, const char* coding) {
+    size_t len = strlen(coding);
+    for(size_t pos = 0; pos < accept.size();) {
+        size_t end = accept.find(',', pos);
+        if(end == std::string::npos)
+            end = accept.size();
+        size_t b = accept.find_first_not_of(' ', pos);
+        if(b < end && strncasecmp(accept.c_str() + b, coding, len) == 0) {
+            size_t q = accept.find_first_not_of(' ', b + len);
+            if(q >= end)
+                return true;
+            // "gzip;q=0" explicitly refuses it
+            if(accept.compare(q, 3, ";q=") == 0)
+                return strtod(accept.c_str() + q + 3, nullptr) > 0;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+// The decoded value of a parameter in the query string of url, or an
+// empty string if absent
+std::string queryParam(const std::string& url, const char* name) {
+    size_t len = strlen(name);
+    size_t pos = url.find('?');
+    while(pos != std::string::npos) {
+        ++pos;
+        size_t end = url.find('&', pos);
+        if(url.compare(pos, len, name) == 0 && url[pos + len] == '=') {
+            std::string value;
+            size_t stop = end == std::string::npos ? url.size() : end;
+            for(size_t i = pos + len + 1; i < stop; ++i) {
+                if(url[i] == '+') {
+                    value += ' ';
+                } else if(url[i] == '%' && i + 2 < stop && isxdigit(url[i+1]) && isxdigit(url[i+2])) {
+                    value += static_cast<char>(strtol(url.substr(i + 1, 2).c_str(), nullptr, 16));
+                    i += 2;
+                } else {
+                    value += url[i];
+                }
+            }
+            return value;
+        }
+        pos = end;
+    }
+    return std::string();
+}
+
+// Parses the query string of a request for part of a log: tail=N for the
+// last N lines, lines=A-B or bytes=A-B for lines or bytes from A up to but
+// excluding B. B may be omitted for the rest of the log. Returns false if
+// none of these is given
+bool parseLogRange(const std::string& url, LogRange& range) {
+    std::string tail = queryParam(url, "tail");
+    if(!tail.empty()) {
+        range.tail = strtoull(tail.c_str(), nullptr, 10);
+        return range.tail > 0;
+    }
+    std::string spec = queryParam(url, "lines");
+    range.unit = LogRange::LINES;
+    if(spec.empty()) {
+        spec = queryParam(url, "bytes");
+        range.unit = LogRange::BYTES;
+    }
+    size_t dash = spec.find('-');
+    if(dash == std::string::npos)
+        return false;
+    range.first = strtoull(spec.c_str(), nullptr, 10);
+    if(dash + 1 < spec.size())
+        range.last = strtoull(spec.c_str() + dash + 1, nullptr, 10);
+    return true;
+}
+
+enum RangeResult { RANGE_IGNORE, RANGE_UNSATISFIABLE, RANGE_OK };
+
+// Parses the value of a Range header for a resource of the given size.
+// Only a single byte range is supported, requests for several ranges are
+// answered with the whole resource as RFC 7233 permits
+RangeResult parseRange(const std::string& range, uint64_t size, uint64_t& first, uint64_t& last) {
+    if(range.compare(0, 6, "bytes=") != 0 || range.find(',') != std::string::npos)
+        return RANGE_IGNORE;
+    const char* spec = range.c_str() + 6;
+    const char* dash = strchr(spec, '-');
+    if(!dash)
+        return RANGE_IGNORE;
+    char* end;
+    if(dash == spec) {
+        // the last n bytes
+        uint64_t n = strtoull(dash + 1, &end, 10);
+        if(end == dash + 1 || *end)
+            return RANGE_IGNORE;
+        if(n == 0 || size == 0)
+            return RANGE_UNSATISFIABLE;
+        first = n < size ? size - n : 0;
+        last = size - 1;
+        return RANGE_OK;
+    }
+    first = strtoull(spec, &end, 10);
+    if(end != dash)
+        return RANGE_IGNORE;
+    last = size - 1;
+    if(dash[1]) {
+        last = strtoull(dash + 1, &end, 10);
+        if(*end || last < first)
+            return RANGE_IGNORE;
+        last = std::min(last, size - 1);
+    }
+    if(first >= size)
+        return RANGE_UNSATISFIABLE;
+    return RANGE_OK;
 }
 
+}
+
+// Receives the output of a run executed by a laminar-agent
+class RunOutputImpl : public LaminarCi::RunOutput::Server {
+public:
+    RunOutputImpl(Run& run, std::function<void(const char*, size_t)> onOutput, std::shared_ptr<bool> done) :
+        run(run),
+        onOutput(onOutput),
+        done(done)
+    {}
+
+    kj::Promise<void> write(WriteContext context) override {
+        // the agent may hold on to this capability after the run finished
+        if(!*done) {
+            auto data = context.getParams().getData();
+            onOutput(reinterpret_cast<const char*>(data.begin()), data.size());
+        }
+        return kj::READY_NOW;
+    }
+
+    kj::Promise<void> status(StatusContext context) override {
+        if(!*done)
+            run.reaped(context.getParams().getStatus());
+        return kj::READY_NOW;
+    }
+
+private:
+    Run& run;
+    std::function<void(const char*, size_t)> onOutput;
+    std::shared_ptr<bool> done;
+};
+
+// Laminar's handle to a connected laminar-agent
+class AgentImpl : public Agent, public kj::TaskSet::ErrorHandler {
+public:
+    AgentImpl(LaminarCi::Agent::Client client) :
+        client(kj::mv(client)),
+        tasks(*this)
+    {}
+
+    kj::Promise<void> execute(Run& run, std::function<void(const char*, size_t)> onOutput) override {
+        auto req = client.executeRequest();
+        req.setJobName(run.name);
+        req.setBuildNum(run.build);
+        std::vector<Run::Script> scripts = run.takeScripts();
+        auto list = req.initScripts(scripts.size());
+        for(size_t i = 0; i < scripts.size(); ++i) {
+            // scripts are small, and sent from the configuration at the
+            // time the run starts just as local runs would execute them
+            std::ifstream in(scripts[i].path, std::ios::binary);
+            std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            list[i].setName(scripts[i].path.substr(scripts[i].path.rfind('/') + 1));
+            list[i].setContent(kj::arrayPtr(reinterpret_cast<const kj::byte*>(content.data()), content.size()));
+            list[i].setInit(scripts[i].init);
+        }
+        std::map<std::string, std::string> env = run.envVariables();
+        auto envList = req.initEnv(env.size());
+        size_t i = 0;
+        for(const auto& it : env) {
+            envList[i].setName(it.first);
+            envList[i++].setValue(it.second);
+        }
+        auto params = req.initParams(run.params.size());
+        i = 0;
+        for(const auto& it : run.params) {
+            params[i].setName(it.first);
+            params[i++].setValue(it.second);
+        }
+        req.setLastResult(fromRunState(run.lastResult));
+        std::shared_ptr<bool> done = std::make_shared<bool>(false);
+        req.setOutput(kj::heap<RunOutputImpl>(run, onOutput, done));
+        return req.send().then([done](capnp::Response<LaminarCi::Agent::ExecuteResults>){
+            *done = true;
+        }, [done,&run](kj::Exception&& e){
+            *done = true;
+            LLOG(ERROR, "Lost agent executing run", run.name, run.build, e.getDescription());
+            // as if a script had exited with status 1
+            run.reaped(W_EXITCODE(1, 0));
+        });
+    }
+
+    void abort(const Run& run) override {
+        auto req = client.abortRequest();
+        req.setJobName(run.name);
+        req.setBuildNum(run.build);
+        tasks.add(req.send().ignoreResult());
+    }
+
+private:
+    void taskFailed(kj::Exception&& exception) override {
+        LLOG(WARNING, "Request to agent failed", exception);
+    }
+
+    LaminarCi::Agent::Client client;
+    kj::TaskSet tasks;
+};
+
+// Exists for as long as the agent which registered it is connected
+class AgentSessionImpl : public LaminarCi::AgentSession::Server {
+public:
+    AgentSessionImpl(LaminarInterface& laminar, std::shared_ptr<Agent> agent) :
+        laminar(laminar),
+        agent(agent)
+    {}
+
+    ~AgentSessionImpl() override {
+        laminar.deregisterAgent(agent.get());
+    }
+
+    kj::Promise<void> ping(PingContext) override {
+        return kj::READY_NOW;
+    }
+
+private:
+    LaminarInterface& laminar;
+    std::shared_ptr<Agent> agent;
+};
+
+// Streams a run's log to a tailLog client. Registered with Laminar as a
+// client of the run's log. At most TAIL_LOG_WINDOW writes are in flight at
+// a time, and further output is merged until one of them is answered. A
+// client which lets more than queueLimit bytes accumulate that way is
+// dropped, which fails its tailLog call
+class LogTail : public LaminarClient, public kj::TaskSet::ErrorHandler {
+public:
+    LogTail(LaminarInterface& laminar, LaminarCi::LogOutput::Client output, std::string job, uint num, size_t queueLimit) :
+        laminar(laminar),
+        output(kj::mv(output)),
+        queueLimit(queueLimit),
+        writes(*this),
+        dropped(kj::newPromiseAndFulfiller<void>())
+    {
+        scope = MonitorScope(MonitorScope::LOG, job, num);
+        laminar.registerClient(this);
+    }
+    ~LogTail() noexcept(false) override {
+        laminar.deregisterClient(this);
+    }
+
+    void sendMessage(Message payload) override {
+        if(isDropped)
+            return;
+        queued.append(*payload);
+        // A single message larger than the limit is always accepted
+        if(queued.size() > queueLimit && queued.size() > payload->size()) {
+            drop(KJ_EXCEPTION(OVERLOADED, "Log client too slow", queued.size()));
+            return;
+        }
+        send();
+    }
+
+    // resolves once everything sent so far has been received
+    kj::Promise<void> drain() {
+        if(inFlight == 0 && queued.empty())
+            return kj::READY_NOW;
+        auto paf = kj::newPromiseAndFulfiller<void>();
+        drained.push_back(kj::mv(paf.fulfiller));
+        return kj::mv(paf.promise);
+    }
+
+    // rejected if the client is dropped. May only be called once
+    kj::Promise<void> whenDropped() {
+        return kj::mv(dropped.promise);
+    }
+
+private:
+    void send() {
+        if(queued.empty() || inFlight >= TAIL_LOG_WINDOW)
+            return;
+        auto req = output.writeRequest();
+        req.setData(kj::arrayPtr(reinterpret_cast<const kj::byte*>(queued.data()), queued.size()));
+        queued.clear();
+        inFlight++;
+        writes.add(req.send().ignoreResult().then([this]{
+            inFlight--;
+            send();
+            if(inFlight == 0 && queued.empty()) {
+                for(auto& f : drained)
+                    f->fulfill();
+                drained.clear();
+            }
+        }));
+    }
+
+    void drop(kj::Exception&& e) {
+        LLOG(WARNING, "Dropping log client", scope.job, scope.num, e.getDescription());
+        isDropped = true;
+        queued.clear();
+        for(auto& f : drained)
+            f->reject(kj::cp(e));
+        drained.clear();
+        dropped.fulfiller->reject(kj::mv(e));
+    }
+
+    // a write which failed means the client is gone
+    void taskFailed(kj::Exception&& exception) override {
+        if(!isDropped)
+            drop(kj::mv(exception));
+    }
+
+    LaminarInterface& laminar;
+    LaminarCi::LogOutput::Client output;
+    size_t queueLimit;
+    std::string queued;
+    size_t inFlight = 0;
+    bool isDropped = false;
+    kj::TaskSet writes;
+    kj::PromiseFulfillerPair<void> dropped;
+    std::vector<kj::Own<kj::PromiseFulfiller<void>>> drained;
+};
+
 // This is the implementation of the Laminar Cap'n Proto RPC interface.
 // As such, it implements the pure virtual interface generated from
 // laminar.capnp with calls to the LaminarInterface
-class RpcImpl : public LaminarCi::Server, public LaminarWaiter {
+class RpcImpl : public LaminarCi::Server, public LaminarWaiter, public kj::TaskSet::ErrorHandler {
 public:
     RpcImpl(LaminarInterface& l) :
         LaminarCi::Server(),
-        laminar(l)
+        laminar(l),
+        notifications(*this)
     {
         laminar.registerWaiter(this);
+        const char* limit = getenv("LAMINAR_CLIENT_QUEUE_LIMIT");
+        tailQueueLimit = limit ? static_cast<size_t>(atol(limit)) : CLIENT_QUEUE_LIMIT_DEFAULT;
     }
 
     ~RpcImpl() override {
@@ -73,12 +473,10 @@ public:
 
     // Queue a job, without waiting for it to start
     kj::Promise<void> queue(QueueContext context) override {
+        LoopSection section("rpc queue");
         std::string jobName = context.getParams().getJobName();
         LLOG(INFO, "RPC queue", jobName);
-        ParamMap params;
-        for(auto p : context.getParams().getParams()) {
-            params[p.getName().cStr()] = p.getValue().cStr();
-        }
+        ParamMap params = toParamMap(context.getParams().getParams());
         LaminarCi::MethodResult result = laminar.queueJob(jobName, params)
                 ? LaminarCi::MethodResult::SUCCESS
                 : LaminarCi::MethodResult::FAILED;
@@ -88,15 +486,13 @@ public:
 
     // Start a job, without waiting for it to finish
     kj::Promise<void> start(StartContext context) override {
+        LoopSection section("rpc start");
         std::string jobName = context.getParams().getJobName();
         LLOG(INFO, "RPC start", jobName);
-        ParamMap params;
-        for(auto p : context.getParams().getParams()) {
-            params[p.getName().cStr()] = p.getValue().cStr();
-        }
+        ParamMap params = toParamMap(context.getParams().getParams());
         std::shared_ptr<Run> run = laminar.queueJob(jobName, params);
         if(Run* r = run.get()) {
-            return r->started.promise.then([context,r]() mutable {
+            return r->whenStarted().then([context,r]() mutable {
                 context.getResults().setResult(LaminarCi::MethodResult::SUCCESS);
                 context.getResults().setBuildNum(r->build);
             });
@@ -108,12 +504,10 @@ public:
 
     // Start a job and wait for the result
     kj::Promise<void> run(RunContext context) override {
+        LoopSection section("rpc run");
         std::string jobName = context.getParams().getJobName();
         LLOG(INFO, "RPC run", jobName);
-        ParamMap params;
-        for(auto p : context.getParams().getParams()) {
-            params[p.getName().cStr()] = p.getValue().cStr();
-        }
+        ParamMap params = toParamMap(context.getParams().getParams());
         std::shared_ptr<Run> run = laminar.queueJob(jobName, params);
         if(const Run* r = run.get()) {
             runWaiters[r].emplace_back(kj::newPromiseAndFulfiller<RunState>());
@@ -129,6 +523,7 @@ public:
 
     // Set a parameter on a running build
     kj::Promise<void> set(SetContext context) override {
+        LoopSection section("rpc set");
         std::string jobName = context.getParams().getJobName();
         uint buildNum = context.getParams().getBuildNum();
         LLOG(INFO, "RPC set", jobName, buildNum);
@@ -143,6 +538,7 @@ public:
 
     // Take a named lock
     kj::Promise<void> lock(LockContext context) override {
+        LoopSection section("rpc lock");
         std::string lockName = context.getParams().getLockName();
         LLOG(INFO, "RPC lock", lockName);
         auto& lockList = locks[lockName];
@@ -154,6 +550,7 @@ public:
 
     // Release a named lock
     kj::Promise<void> release(ReleaseContext context) override {
+        LoopSection section("rpc release");
         std::string lockName = context.getParams().getLockName();
         LLOG(INFO, "RPC release", lockName);
         auto& lockList = locks[lockName];
@@ -166,17 +563,179 @@ public:
             lockList.front().fulfiller->fulfill();
         return kj::READY_NOW;
     }
+
+    // Make a laminar-agent available as a node
+    kj::Promise<void> registerAgent(RegisterAgentContext context) override {
+        LoopSection section("rpc registerAgent");
+        auto params = context.getParams();
+        std::string name = params.getName();
+        LLOG(INFO, "RPC registerAgent", name);
+        std::set<std::string> tags;
+        for(auto t : params.getTags())
+            tags.insert(t.cStr());
+        std::shared_ptr<Agent> agent = std::make_shared<AgentImpl>(params.getAgent());
+        KJ_REQUIRE(laminar.registerAgent(name, params.getExecutors(), tags, agent), "A node with this name already exists", name);
+        context.getResults().setSession(kj::heap<AgentSessionImpl>(laminar, agent));
+        return kj::READY_NOW;
+    }
+
+    // Queue several jobs with one call
+    kj::Promise<void> queueBatch(QueueBatchContext context) override {
+        LoopSection section("rpc queueBatch");
+        auto jobs = context.getParams().getJobs();
+        LLOG(INFO, "RPC queueBatch", jobs.size());
+        auto results = context.getResults().initResults(jobs.size());
+        for(uint i = 0; i < jobs.size(); ++i) {
+            bool queued = laminar.queueJob(jobs[i].getJobName(), toParamMap(jobs[i].getParams())) != nullptr;
+            results.set(i, queued ? LaminarCi::MethodResult::SUCCESS : LaminarCi::MethodResult::FAILED);
+        }
+        return kj::READY_NOW;
+    }
+
+    // Start several jobs and wait for all of their results
+    kj::Promise<void> runBatch(RunBatchContext context) override {
+        LoopSection section("rpc runBatch");
+        auto jobs = context.getParams().getJobs();
+        LLOG(INFO, "RPC runBatch", jobs.size());
+        kj::Maybe<LaminarCi::RunListener::Client> listener;
+        if(context.getParams().hasListener())
+            listener = context.getParams().getListener();
+        struct Outcome { std::string job; uint build; RunState result; };
+        std::shared_ptr<std::vector<Outcome>> outcomes = std::make_shared<std::vector<Outcome>>(jobs.size());
+        kj::Vector<kj::Promise<void>> pending;
+        for(uint i = 0; i < jobs.size(); ++i) {
+            Outcome& o = (*outcomes)[i];
+            o.job = jobs[i].getJobName();
+            o.build = 0;
+            o.result = RunState::UNKNOWN;
+            std::shared_ptr<Run> run = laminar.queueJob(o.job, toParamMap(jobs[i].getParams()));
+            if(!run)
+                continue;
+            runWaiters[run.get()].emplace_back(kj::newPromiseAndFulfiller<RunState>());
+            pending.add(runWaiters[run.get()].back().promise.then([this,outcomes,i,run,listener](RunState state) mutable {
+                Outcome& o = (*outcomes)[i];
+                o.build = run->build;
+                o.result = state;
+                KJ_IF_MAYBE(l, listener) {
+                    auto req = l->completedRequest();
+                    setRunResult(req.initRun(), o.job, o.build, o.result);
+                    notifications.add(req.send().ignoreResult());
+                }
+            }));
+        }
+        return kj::joinPromises(pending.releaseAsArray()).then([context,outcomes]() mutable {
+            auto results = context.getResults().initResults(outcomes->size());
+            for(uint i = 0; i < outcomes->size(); ++i) {
+                const Outcome& o = (*outcomes)[i];
+                setRunResult(results[i], o.job, o.build, o.result);
+            }
+        });
+    }
+
+    // Subscribe to run starts and completions
+    kj::Promise<void> watch(WatchContext context) override {
+        LoopSection section("rpc watch");
+        std::string jobName = context.getParams().getJobName();
+        LLOG(INFO, "RPC watch", jobName);
+        watches.push_back(Watch{jobName, context.getParams().getListener()});
+        context.getResults().setHandle(kj::heap<WatchHandle>(watches, std::prev(watches.end())));
+        return kj::READY_NOW;
+    }
+
+    // Stream the log of a run
+    kj::Promise<void> tailLog(TailLogContext context) override {
+        LoopSection section("rpc tailLog");
+        std::string jobName = context.getParams().getJobName();
+        uint buildNum = context.getParams().getBuildNum();
+        LLOG(INFO, "RPC tailLog", jobName, buildNum);
+        kj::Own<LogTail> tail = kj::heap<LogTail>(laminar, context.getParams().getOutput(), jobName, buildNum, tailQueueLimit);
+        LogTail* t = tail.get();
+        kj::Promise<void> dropped = t->whenDropped();
+        // the log so far
+        laminar.sendStatus(t);
+        if(!laminar.runInProgress(jobName, buildNum))
+            return t->drain().exclusiveJoin(kj::mv(dropped)).attach(kj::mv(tail));
+        auto& waiters = logWaiters[std::make_pair(jobName, buildNum)];
+        waiters.emplace_back(kj::newPromiseAndFulfiller<RunState>());
+        return waiters.back().promise.then([t](RunState){
+            // all output was sent before the run completed
+            return t->drain();
+        }).exclusiveJoin(kj::mv(dropped)).attach(kj::mv(tail));
+    }
+
 private:
+    struct Watch {
+        // empty for all jobs
+        std::string job;
+        LaminarCi::RunListener::Client listener;
+    };
+
+    // Ends a watch when released by the client
+    class WatchHandle : public LaminarCi::Handle::Server {
+    public:
+        WatchHandle(std::list<Watch>& watches, std::list<Watch>::iterator it) :
+            watches(watches),
+            it(it)
+        {}
+        ~WatchHandle() override {
+            watches.erase(it);
+        }
+    private:
+        std::list<Watch>& watches;
+        std::list<Watch>::iterator it;
+    };
+
+    static void setRunResult(LaminarCi::RunResult::Builder b, const std::string& job, uint build, RunState result) {
+        b.setJobName(job);
+        b.setBuildNum(build);
+        b.setResult(fromRunState(result));
+    }
+
+    // Implements LaminarWaiter::started
+    void started(const Run* r) override {
+        for(Watch& w : watches) {
+            if(!w.job.empty() && w.job != r->name)
+                continue;
+            auto req = w.listener.startedRequest();
+            req.setJobName(r->name);
+            req.setBuildNum(r->build);
+            notifications.add(req.send().ignoreResult());
+        }
+    }
+
     // Implements LaminarWaiter::complete
     void complete(const Run* r) override {
         for(kj::PromiseFulfillerPair<RunState>& w : runWaiters[r])
             w.fulfiller->fulfill(RunState(r->result));
         runWaiters.erase(r);
+        auto logs = logWaiters.find(std::make_pair(r->name, r->build));
+        if(logs != logWaiters.end()) {
+            for(kj::PromiseFulfillerPair<RunState>& w : logs->second)
+                w.fulfiller->fulfill(RunState(r->result));
+            logWaiters.erase(logs);
+        }
+        for(Watch& w : watches) {
+            if(!w.job.empty() && w.job != r->name)
+                continue;
+            auto req = w.listener.completedRequest();
+            setRunResult(req.initRun(), r->name, r->build, r->result);
+            notifications.add(req.send().ignoreResult());
+        }
+    }
+
+    // Implements kj::TaskSet::ErrorHandler for notifications, which fail
+    // if the client went away
+    void taskFailed(kj::Exception&& exception) override {
+        LLOG(INFO, "Could not notify RPC client", exception.getDescription());
     }
 private:
     LaminarInterface& laminar;
     std::unordered_map<std::string, std::list<kj::PromiseFulfillerPair<void>>> locks;
     std::unordered_map<const Run*, std::list<kj::PromiseFulfillerPair<RunState>>> runWaiters;
+    std::map<std::pair<std::string, uint>, std::list<kj::PromiseFulfillerPair<RunState>>> logWaiters;
+    std::list<Watch> watches;
+    kj::TaskSet notifications;
+    size_t tailQueueLimit;
 };
 
 // This is the implementation of the HTTP/Websocket interface. It creates
@@ -189,7 +748,10 @@ public:
     HttpImpl(LaminarInterface& laminar, kj::HttpHeaderTable&tbl) :
         laminar(laminar),
         responseHeaders(tbl)
-    {}
+    {
+        const char* limit = getenv("LAMINAR_CLIENT_QUEUE_LIMIT");
+        clientQueueLimit = limit ? static_cast<size_t>(atol(limit)) : CLIENT_QUEUE_LIMIT_DEFAULT;
+    }
     virtual ~HttpImpl() {}
 
 private:
@@ -198,30 +760,103 @@ private:
     // or is cancelled
     class WebsocketClient : public LaminarClient {
     public:
-        WebsocketClient(LaminarInterface& laminar, kj::Own<kj::WebSocket>&& ws) :
+        WebsocketClient(LaminarInterface& laminar, kj::Own<kj::WebSocket>&& ws, size_t queueLimit) :
             laminar(laminar),
-            ws(kj::mv(ws))
-        {}
+            ws(kj::mv(ws)),
+            queueLimit(queueLimit),
+            disconnect(kj::newPromiseAndFulfiller<void>())
+        {
+            metrics.websocketClients++;
+        }
         ~WebsocketClient() override {
             laminar.deregisterClient(this);
+            metrics.websocketClients--;
+            metrics.websocketQueuedBytes -= queuedBytes;
         }
-        virtual void sendMessage(std::string payload) override {
-            messages.push_back(kj::mv(payload));
+        virtual void sendMessage(Message payload) override {
+            if(dropped)
+                return;
+            queuedBytes += payload->size();
+            metrics.websocketQueuedBytes += payload->size();
+            totalQueuedBytes += payload->size();
+            metrics.websocketQueuedBytesTotal += payload->size();
+            if(scope.type == MonitorScope::LOG && !messages.empty() && payload->size() < LOG_FRAME_SIZE) {
+                // The writer hasn't caught up yet. Rather than queueing
+                // many small chunks, merge them into larger frames
+                if(!frame || frame->size() + payload->size() > LOG_FRAME_SIZE) {
+                    frame = std::make_shared<std::string>();
+                    frame->reserve(LOG_FRAME_SIZE);
+                    messages.push_back(frame);
+                }
+                frame->append(*payload);
+            } else {
+                messages.push_back(kj::mv(payload));
+                // any later output must follow this message
+                frame = nullptr;
+            }
+            // A single message larger than the limit is always accepted
+            if(queuedBytes > queueLimit && messages.size() > 1)
+                overflow();
             // sendMessage might be called several times before the event loop
             // gets a chance to act on the fulfiller. So store the payload here
             // where it can be fetched later and don't pass the payload with the
             // fulfiller because subsequent calls to fulfill() are ignored.
             fulfiller->fulfill();
         }
+        // Called when more than queueLimit bytes are waiting to be sent.
+        // A status client only needs the latest state, so its queue is
+        // replaced with a fresh snapshot. A log client can't skip output,
+        // and neither can a status client which is still too slow to
+        // receive that snapshot, so they are disconnected.
+        void overflow() {
+            if(scope.type != MonitorScope::LOG && !collapsed) {
+                discardQueue();
+                collapsed = true;
+                laminar.sendStatus(this);
+                return;
+            }
+            discardQueue();
+            dropped = true;
+            metrics.websocketDropped++;
+            LLOG(WARNING, "Disconnecting slow websocket client", totalQueuedBytes, droppedBytes);
+            disconnect.fulfiller->fulfill();
+        }
+        // discards messages which the writer has not yet started sending
+        void discardQueue() {
+            for(const Message& m : messages) {
+                queuedBytes -= m->size();
+                metrics.websocketQueuedBytes -= m->size();
+                droppedBytes += m->size();
+                metrics.websocketDroppedBytes += m->size();
+            }
+            messages.clear();
+            frame = nullptr;
+        }
         LaminarInterface& laminar;
         kj::Own<kj::WebSocket> ws;
-        std::list<std::string> messages;
+        std::list<Message> messages;
         kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+        // log output still being collected into a frame. It is only
+        // modified until the writer takes the queue
+        std::shared_ptr<std::string> frame;
+        size_t queueLimit;
+        // bytes queued but not yet written, including any being written
+        size_t queuedBytes = 0;
+        // counters over the lifetime of the connection
+        uint64_t totalQueuedBytes = 0;
+        uint64_t droppedBytes = 0;
+        // whether the queue was replaced by a snapshot which has not yet
+        // been taken by the writer
+        bool collapsed = false;
+        bool dropped = false;
+        // fulfilled to close the connection of a client which is too slow
+        kj::PromiseFulfillerPair<void> disconnect;
     };
 
     kj::Promise<void> websocketRead(WebsocketClient& lc)
     {
         return lc.ws->receive().then([&lc,this](kj::WebSocket::Message&& message) {
+            LoopSection section("websocket read");
             KJ_SWITCH_ONEOF(message) {
                 KJ_CASE_ONEOF(str, kj::String) {
                     rapidjson::Document d;
@@ -250,12 +885,20 @@ private:
         auto paf = kj::newPromiseAndFulfiller<void>();
         lc.fulfiller = kj::mv(paf.fulfiller);
         return paf.promise.then([this,&lc]{
+            LoopSection section("websocket write");
             kj::Promise<void> p = kj::READY_NOW;
-            std::list<std::string> messages = kj::mv(lc.messages);
-            for(std::string& s : messages) {
-                p = p.then([&s,&lc]{
-                    kj::String str = kj::str(s);
-                    return lc.ws->send(str).attach(kj::mv(str));
+            std::list<Message> messages = kj::mv(lc.messages);
+            lc.messages.clear();
+            lc.frame = nullptr;
+            lc.collapsed = false;
+            for(const Message& m : messages) {
+                // the message buffer may be shared with other clients and
+                // is sent directly from there
+                p = p.then([&m,&lc]{
+                    return lc.ws->send(kj::ArrayPtr<const char>(m->data(), m->size()));
+                }).then([&m,&lc]{
+                    lc.queuedBytes -= m->size();
+                    metrics.websocketQueuedBytes -= m->size();
                 });
             }
             return p.attach(kj::mv(messages)).then([this,&lc]{
@@ -265,6 +908,11 @@ private:
     }
 
     kj::Promise<void> websocketUpgraded(WebsocketClient& lc, std::string resource) {
+        // a log may be requested from an offset, typically the end of the
+        // part of it fetched with /log/<job>/<num>?tail=N, so that only
+        // newer output is sent
+        std::string offset = queryParam(resource, "offset");
+        resource = resource.substr(0, resource.find('?'));
         // convert the requested URL to a MonitorScope
         if(resource.substr(0, 5) == "/jobs") {
             if(resource.length() == 5) {
@@ -286,12 +934,14 @@ private:
                     }
                     if(split2 != std::string::npos && resource.compare(split2, 4, "/log") == 0) {
                         lc.scope.type = MonitorScope::LOG;
+                        lc.scope.offset = strtoull(offset.c_str(), nullptr, 10);
                     }
                 }
             }
         }
         laminar.registerClient(&lc);
-        kj::Promise<void> connection = websocketRead(lc).exclusiveJoin(websocketWrite(lc));
+        kj::Promise<void> connection = websocketRead(lc).exclusiveJoin(websocketWrite(lc))
+                .exclusiveJoin(kj::mv(lc.disconnect.promise));
         // registerClient can happen after a successful websocket handshake.
         // However, the connection might not be closed gracefully, so the
         // corresponding deregister operation happens in the WebsocketClient
@@ -303,21 +953,83 @@ private:
     virtual kj::Promise<void> request(kj::HttpMethod method, kj::StringPtr url, const kj::HttpHeaders& headers,
             kj::AsyncInputStream& requestBody, Response& response) override
     {
+        LoopSection section("http request");
         std::string resource = url.cStr();
         if(headers.isWebSocket()) {
             responseHeaders.clear();
-            kj::Own<WebsocketClient> lc = kj::heap<WebsocketClient>(laminar, response.acceptWebSocket(responseHeaders));
+            kj::Own<WebsocketClient> lc = kj::heap<WebsocketClient>(laminar, response.acceptWebSocket(responseHeaders), clientQueueLimit);
             return websocketUpgraded(*lc, resource).attach(kj::mv(lc));
         } else {
             // handle regular HTTP request
-            const char* start, *end, *content_type;
+            Resources::Response res;
             responseHeaders.clear();
             if(resource.compare(0, strlen("/archive/"), "/archive/") == 0) {
-                kj::Own<MappedFile> file = laminar.getArtefact(resource.substr(strlen("/archive/")));
-                if(file->address() != nullptr) {
-                    responseHeaders.add("Content-Transfer-Encoding", "binary");
-                    auto stream = response.send(200, "OK", responseHeaders, file->size());
-                    return stream->write(file->address(), file->size()).attach(kj::mv(file)).attach(kj::mv(stream));
+                std::string path = resource.substr(strlen("/archive/"));
+                // a precompressed sibling is served instead if the client
+                // accepts it. Either response depends on Accept-Encoding
+                // once the sibling exists
+                if(path.size() < 3 || path.compare(path.size() - 3, 3, ".gz") != 0) {
+                    kj::Own<MappedFile> file = laminar.getArtefact(path + ".gz");
+                    if(file->address() != nullptr) {
+                        responseHeaders.add("Vary", "Accept-Encoding");
+                        if(acceptsEncoding(headerValue(headers, "Accept-Encoding"), "gzip")) {
+                            responseHeaders.add("Content-Encoding", "gzip");
+                            return sendFile(kj::mv(file), headers, response);
+                        }
+                    }
+                }
+                kj::Own<MappedFile> file = laminar.getArtefact(path);
+                if(file->address() != nullptr)
+                    return sendFile(kj::mv(file), headers, response);
+            } else if(resource.compare(0, strlen("/log/"), "/log/") == 0) {
+                // /log/<job>/<num> serves a finished log exactly as it is
+                // stored, leaving decompression to the client
+                size_t split = resource.find('/', strlen("/log/"));
+                if(split != std::string::npos) {
+                    std::string job = resource.substr(strlen("/log/"), split - strlen("/log/"));
+                    uint num = static_cast<uint>(atoi(resource.c_str() + split + 1));
+                    // with a query string, the selected part is served
+                    // decompressed, also while the run is in progress. The
+                    // headers tell where it is in the log
+                    LogRange range;
+                    if(parseLogRange(resource, range)) {
+                        range.limit = LOG_SLICE_LIMIT;
+                        LogSlice slice;
+                        if(!laminar.getLogSlice(job, num, range, slice))
+                            return response.sendError(404, "Not Found", responseHeaders);
+                        responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "text/plain; charset=utf-8");
+                        responseHeaders.add("Cache-Control", "no-cache");
+                        responseHeaders.add("X-Log-Offset", kj::str(slice.offset));
+                        responseHeaders.add("X-Log-End", kj::str(slice.offset + slice.text.size()));
+                        responseHeaders.add("X-Log-Line", kj::str(slice.line));
+                        responseHeaders.add("X-Log-Size", kj::str(slice.size));
+                        responseHeaders.add("X-Log-Lines", kj::str(slice.lines));
+                        std::string body = kj::mv(slice.text);
+                        auto stream = response.send(200, "OK", responseHeaders, body.size());
+                        return stream->write(body.data(), body.size()).attach(kj::mv(body)).attach(kj::mv(stream));
+                    }
+                    kj::Own<MappedFile> file = laminar.getLog(job, num);
+                    if(file->address() != nullptr) {
+                        responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "text/plain; charset=utf-8");
+                        responseHeaders.add("Content-Encoding", "gzip");
+                        return sendFile(kj::mv(file), headers, response);
+                    }
+                }
+            } else if(resource.compare("/metrics") == 0) {
+                responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, MetricsWriter::contentType());
+                std::string body = laminar.getMetrics();
+                auto stream = response.send(200, "OK", responseHeaders, body.size());
+                return stream->write(body.data(), body.size()).attach(kj::mv(body)).attach(kj::mv(stream));
+            } else if(resource.compare(0, strlen("/search?"), "/search?") == 0) {
+                // /search?q=<phrase>[&job=<job>][&from=<time>][&to=<time>]
+                std::string from = queryParam(resource, "from");
+                std::string to = queryParam(resource, "to");
+                std::string body = laminar.searchLogs(queryParam(resource, "q"), queryParam(resource, "job"),
+                        from.empty() ? 0 : atol(from.c_str()), to.empty() ? time(nullptr) : atol(to.c_str()));
+                if(!body.empty()) {
+                    responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "application/json");
+                    auto stream = response.send(200, "OK", responseHeaders, body.size());
+                    return stream->write(body.data(), body.size()).attach(kj::mv(body)).attach(kj::mv(stream));
                 }
             } else if(resource.compare("/custom/style.css") == 0) {
                 responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, "text/css; charset=utf-8");
@@ -325,20 +1037,89 @@ private:
                 std::string css = laminar.getCustomCss();
                 auto stream = response.send(200, "OK", responseHeaders, css.size());
                 return stream->write(css.data(), css.size()).attach(kj::mv(css)).attach(kj::mv(stream));
-            } else if(resources.handleRequest(resource, &start, &end, &content_type)) {
-                responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, content_type);
-                responseHeaders.add("Content-Encoding", "gzip");
+            } else if(resources.handleRequest(resource, acceptsEncoding(headerValue(headers, "Accept-Encoding"), "br"), res)) {
+                responseHeaders.set(kj::HttpHeaderId::CONTENT_TYPE, res.contentType);
+                responseHeaders.add("Content-Encoding", res.contentEncoding);
+                responseHeaders.add("Vary", "Accept-Encoding");
+                responseHeaders.add("ETag", res.etag);
+                // a fingerprinted URL always refers to the same content, any
+                // other must be revalidated so that an upgrade takes effect
+                responseHeaders.add("Cache-Control", res.immutable
+                        ? "public, max-age=31536000, immutable" : "no-cache");
+                std::string ifNoneMatch = headerValue(headers, "If-None-Match");
+                if(!ifNoneMatch.empty() && etagMatches(ifNoneMatch, res.etag)) {
+                    response.send(304, "Not Modified", responseHeaders, uint64_t(0));
+                    return kj::READY_NOW;
+                }
                 responseHeaders.add("Content-Transfer-Encoding", "binary");
-                auto stream = response.send(200, "OK", responseHeaders, end-start);
-                return stream->write(start, end-start).attach(kj::mv(stream));
+                auto stream = response.send(200, "OK", responseHeaders, res.end - res.start);
+                return stream->write(res.start, res.end - res.start).attach(kj::mv(stream));
             }
             return response.sendError(404, "Not Found", responseHeaders);
         }
     }
 
+    // value of a request header which is not in the header table, or an
+    // empty string if absent
+    static std::string headerValue(const kj::HttpHeaders& headers, const char* name) {
+        std::string value;
+        headers.forEach([&](kj::StringPtr n, kj::StringPtr v){
+            if(strcasecmp(n.cStr(), name) == 0)
+                value = v.cStr();
+        });
+        return value;
+    }
+
+    // Sends a file in responseHeaders' encoding, answering conditional
+    // requests (If-None-Match, If-Modified-Since) and single byte ranges.
+    // Only the requested part of the mapping is written
+    kj::Promise<void> sendFile(kj::Own<MappedFile> file, const kj::HttpHeaders& headers, Response& response) {
+        std::string etag = file->etag();
+        std::string lastModified = httpDate(file->mtime());
+        responseHeaders.add("ETag", kj::heapString(etag));
+        responseHeaders.add("Last-Modified", kj::heapString(lastModified));
+        responseHeaders.add("Accept-Ranges", "bytes");
+
+        std::string ifNoneMatch = headerValue(headers, "If-None-Match");
+        std::string ifModifiedSince = headerValue(headers, "If-Modified-Since");
+        bool notModified = !ifNoneMatch.empty() ? etagMatches(ifNoneMatch, etag)
+                : !ifModifiedSince.empty() && file->mtime() <= parseHttpDate(ifModifiedSince);
+        if(notModified) {
+            response.send(304, "Not Modified", responseHeaders, uint64_t(0));
+            return kj::READY_NOW;
+        }
+
+        uint64_t size = file->size();
+        uint64_t first = 0, last = size - 1;
+        std::string range = headerValue(headers, "Range");
+        std::string ifRange = headerValue(headers, "If-Range");
+        // If-Range asks for the whole file if it changed since the client
+        // received the part it has
+        if(!range.empty() && (ifRange.empty() || ifRange == etag || ifRange == lastModified)) {
+            switch(parseRange(range, size, first, last)) {
+            case RANGE_UNSATISFIABLE:
+                responseHeaders.add("Content-Range", kj::str("bytes */", size));
+                return response.sendError(416, "Range Not Satisfiable", responseHeaders);
+            case RANGE_OK: {
+                responseHeaders.add("Content-Range", kj::str("bytes ", first, "-", last, "/", size));
+                responseHeaders.add("Content-Transfer-Encoding", "binary");
+                auto stream = response.send(206, "Partial Content", responseHeaders, last - first + 1);
+                const char* start = static_cast<const char*>(file->address()) + first;
+                return stream->write(start, last - first + 1).attach(kj::mv(file)).attach(kj::mv(stream));
+            }
+            case RANGE_IGNORE:
+                break;
+            }
+        }
+        responseHeaders.add("Content-Transfer-Encoding", "binary");
+        auto stream = response.send(200, "OK", responseHeaders, size);
+        return stream->write(file->address(), size).attach(kj::mv(file)).attach(kj::mv(stream));
+    }
+
     LaminarInterface& laminar;
     Resources resources;
     kj::HttpHeaders responseHeaders;
+    size_t clientQueueLimit;
 };
 
 // Context for an RPC connection
@@ -367,8 +1148,13 @@ Server::Server(LaminarInterface& li, kj::StringPtr rpcBindAddress,
     listeners(kj::heap<kj::TaskSet>(*this)),
     childTasks(*this),
     httpConnections(*this),
+    stopWorkers(false),
+    nextWorkId(0),
     httpReady(kj::newPromiseAndFulfiller<void>())
 {
+    const char* threshold = getenv("LAMINAR_STALL_THRESHOLD_MS");
+    stallThreshold = (threshold ? atoi(threshold) : STALL_THRESHOLD_MS_DEFAULT) / 1000.0;
+
     // RPC task
     if(rpcBindAddress.startsWith("unix:"))
         unlink(rpcBindAddress.slice(strlen("unix:")).cStr());
@@ -391,13 +1177,59 @@ Server::Server(LaminarInterface& li, kj::StringPtr rpcBindAddress,
     // handle watched paths
     {
         inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
-        pathWatch = readDescriptor(inotify_fd, [this](const char*, size_t){
-            laminarInterface.notifyConfigChanged();
-        });
+        pathWatch = readDescriptor(inotify_fd, [this](const char* buf, size_t sz){
+            LoopSection section("inotify");
+            // a read from an inotify descriptor always returns whole events
+            for(size_t i = 0; i + sizeof(struct inotify_event) <= sz; ) {
+                const struct inotify_event* e = reinterpret_cast<const struct inotify_event*>(buf + i);
+                i += sizeof(struct inotify_event) + e->len;
+                // the watch ends when its directory is removed. It is
+                // watched again if it is created anew
+                if(e->mask & IN_IGNORED)
+                    watchedPaths.erase(e->wd);
+                auto dir = watchedPaths.find(e->wd);
+                if(e->mask & IN_Q_OVERFLOW || dir == watchedPaths.end() || e->len == 0) {
+                    // events were lost, let everything be reloaded
+                    laminarInterface.notifyConfigChanged(std::string());
+                } else {
+                    laminarInterface.notifyConfigChanged(dir->second + "/" + e->name);
+                }
+            }
+        }).eagerlyEvaluate(nullptr);
+    }
+
+    // background threads
+    {
+        efd_work = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        // every read of the eventfd may correspond to several completions
+        workWatch = readDescriptor(efd_work, [this](const char*, size_t){
+            backgroundWorkDone();
+        }).eagerlyEvaluate(nullptr);
+        for(int i = 0; i < NUM_BACKGROUND_THREADS; ++i)
+            workers.emplace_back(&Server::backgroundWorker, this);
+    }
+
+    // event loop monitoring
+    {
+        watchdogTask = watchdog().eagerlyEvaluate(nullptr);
+        efd_profile = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+        profileWatch = readDescriptor(efd_profile, [](const char*, size_t){
+            for(const auto& it : metrics.loop.handlers()) {
+                const LoopProfile::Handler& h = it.second;
+                LLOG(WARNING, "Event loop profile", it.first, h.seconds, h.calls, h.max, h.stalls);
+            }
+        }).eagerlyEvaluate(nullptr);
     }
 }
 
 Server::~Server() {
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        stopWorkers = true;
+    }
+    workAvailable.notify_all();
+    for(std::thread& t : workers)
+        t.join();
 }
 
 void Server::start() {
@@ -431,18 +1263,96 @@ void Server::stop() {
     eventfd_write(efd_quit, 1);
 }
 
+void Server::dumpProfile() {
+    eventfd_write(efd_profile, 1);
+}
+
+kj::Promise<void> Server::watchdog() {
+    auto start = std::chrono::steady_clock::now();
+    return ioContext.provider->getTimer().afterDelay(WATCHDOG_INTERVAL_MS * kj::MILLISECONDS).then([this,start]{
+        double lag = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                - WATCHDOG_INTERVAL_MS / 1000.0;
+        lag = std::max(lag, 0.0);
+        metrics.loopLag.observe(lag);
+        double seconds;
+        const char* slowest = metrics.loop.takeSlowest(seconds);
+        if(lag > stallThreshold) {
+            // nothing measured means the loop was blocked outside of any
+            // LoopSection
+            if(!slowest)
+                slowest = "unknown";
+            metrics.loop.stalled(slowest);
+            LLOG(WARNING, "Event loop stalled", lag, slowest, seconds);
+        }
+        return watchdog();
+    });
+}
+
 kj::Promise<void> Server::readDescriptor(int fd, std::function<void(const char*,size_t)> cb) {
     auto event = this->ioContext.lowLevelProvider->wrapInputFd(fd, kj::LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
-    auto buffer = kj::heapArrayBuilder<char>(PROC_IO_BUFSIZE);
-    return handleFdRead(event, buffer.asPtr().begin(), cb).attach(std::move(event)).attach(std::move(buffer));
+    auto buffer = kj::heap<std::vector<char>>(PROC_IO_BUFSIZE);
+    return handleFdRead(event, buffer.get(), cb).attach(std::move(event)).attach(std::move(buffer));
 }
 
 void Server::addTask(kj::Promise<void>&& task) {
     childTasks.add(kj::mv(task));
 }
 
+kj::Promise<void> Server::runInBackground(std::function<void()> work) {
+    uint64_t id = nextWorkId++;
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    workFulfillers.emplace(id, kj::mv(paf.fulfiller));
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        pendingWork.push({id, kj::mv(work)});
+    }
+    workAvailable.notify_one();
+    return kj::mv(paf.promise);
+}
+
+void Server::backgroundWorker() {
+    for(;;) {
+        BackgroundWork work;
+        {
+            std::unique_lock<std::mutex> lock(workMutex);
+            workAvailable.wait(lock, [this]{ return stopWorkers || !pendingWork.empty(); });
+            if(stopWorkers)
+                return;
+            work = kj::mv(pendingWork.front());
+            pendingWork.pop();
+        }
+        try {
+            work.fn();
+        } catch(std::exception& e) {
+            LLOG(ERROR, "Background work failed", e.what());
+        }
+        {
+            std::lock_guard<std::mutex> lock(workMutex);
+            finishedWork.push_back(work.id);
+        }
+        eventfd_write(efd_work, 1);
+    }
+}
+
+void Server::backgroundWorkDone() {
+    LoopSection section("background work");
+    std::vector<uint64_t> finished;
+    {
+        std::lock_guard<std::mutex> lock(workMutex);
+        std::swap(finished, finishedWork);
+    }
+    for(uint64_t id : finished) {
+        auto it = workFulfillers.find(id);
+        if(it != workFulfillers.end()) {
+            it->second->fulfill();
+            workFulfillers.erase(it);
+        }
+    }
+}
+
 kj::Promise<void> Server::addTimeout(int seconds, std::function<void ()> cb) {
     return ioContext.lowLevelProvider->getTimer().afterDelay(seconds * kj::SECONDS).then([cb](){
+        LoopSection section("timeout");
         cb();
     }).eagerlyEvaluate(nullptr);
 }
@@ -452,7 +1362,11 @@ kj::Promise<int> Server::onChildExit(kj::Maybe<pid_t> &pid) {
 }
 
 void Server::addWatchPath(const char* dpath) {
-    inotify_add_watch(inotify_fd, dpath, IN_ONLYDIR | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE);
+    // files replaced by renaming (as many editors do) are moves
+    int wd = inotify_add_watch(inotify_fd, dpath, IN_ONLYDIR | IN_CLOSE_WRITE | IN_CREATE
+                               | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    if(wd != -1)
+        watchedPaths[wd] = dpath;
 }
 
 kj::Promise<void> Server::acceptRpcClient(kj::Own<kj::ConnectionReceiver>&& listener) {
@@ -467,12 +1381,23 @@ kj::Promise<void> Server::acceptRpcClient(kj::Own<kj::ConnectionReceiver>&& list
 
 // returns a promise which will read a chunk of data from the file descriptor
 // wrapped by stream and invoke the provided callback with the read data.
-// Repeats until ::read returns <= 0
-kj::Promise<void> Server::handleFdRead(kj::AsyncInputStream* stream, char* buffer, std::function<void(const char*,size_t)> cb) {
-    return stream->tryRead(buffer, 1, PROC_IO_BUFSIZE).then([this,stream,buffer,cb](size_t sz) {
+// Repeats until ::read returns <= 0. A read which fills the buffer suggests
+// that more data is waiting, so the buffer is doubled up to
+// PROC_IO_MAX_BUFSIZE, and a descriptor producing a lot of output is read
+// with fewer, larger reads. Once the output slows down again, reads that
+// use less than a quarter of the buffer halve it back towards
+// PROC_IO_BUFSIZE, so an idle descriptor does not keep a large buffer
+kj::Promise<void> Server::handleFdRead(kj::AsyncInputStream* stream, std::vector<char>* buffer, std::function<void(const char*,size_t)> cb) {
+    return stream->tryRead(buffer->data(), 1, buffer->size()).then([this,stream,buffer,cb](size_t sz) {
         if(sz > 0) {
-            cb(buffer, sz);
-            return handleFdRead(stream, kj::mv(buffer), cb);
+            cb(buffer->data(), sz);
+            if(sz == buffer->size() && buffer->size() < PROC_IO_MAX_BUFSIZE)
+                buffer->resize(buffer->size() * 2);
+            else if(sz < buffer->size() / 4 && buffer->size() > PROC_IO_BUFSIZE) {
+                buffer->resize(buffer->size() / 2);
+                buffer->shrink_to_fit();
+            }
+            return handleFdRead(stream, buffer, cb);
         }
         return kj::Promise<void>(kj::READY_NOW);
     });
@@ -24,6 +24,13 @@
 #include <capnp/message.h>
 #include <capnp/capability.h>
 #include <functional>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <unordered_map>
 
 struct LaminarInterface;
 
@@ -39,12 +46,20 @@ public:
     ~Server();
     void start();
     void stop();
+    // Logs the time spent in each handler on the event loop (see
+    // LoopProfile). May be called in signal context
+    void dumpProfile();
 
     // add a file descriptor to be monitored for output. The callback will be
     // invoked with the read data
     kj::Promise<void> readDescriptor(int fd, std::function<void(const char*,size_t)> cb);
 
     void addTask(kj::Promise<void> &&task);
+    // Runs work on a background thread, so that blocking operations such
+    // as compression, database writes or filesystem walks don't stall the
+    // event loop. The returned promise resolves in the event loop once the
+    // work has completed. The work must not touch any event loop objects.
+    kj::Promise<void> runInBackground(std::function<void()> work);
     // add a one-shot timer callback
     kj::Promise<void> addTimeout(int seconds, std::function<void()> cb);
 
@@ -55,10 +70,18 @@ public:
 
 private:
     kj::Promise<void> acceptRpcClient(kj::Own<kj::ConnectionReceiver>&& listener);
-    kj::Promise<void> handleFdRead(kj::AsyncInputStream* stream, char* buffer, std::function<void(const char*,size_t)> cb);
+    kj::Promise<void> handleFdRead(kj::AsyncInputStream* stream, std::vector<char>* buffer, std::function<void(const char*,size_t)> cb);
+    // Measures how late a timer fires on the event loop. When it is later
+    // than stallThreshold, the handler which ran longest is blamed
+    kj::Promise<void> watchdog();
 
     void taskFailed(kj::Exception&& exception) override;
 
+    // executed by each background thread
+    void backgroundWorker();
+    // called in the event loop when background work has finished
+    void backgroundWorkDone();
+
 private:
     int efd_quit;
     capnp::Capability::Client rpcInterface;
@@ -73,6 +96,34 @@ private:
     kj::Maybe<kj::Promise<void>> reapWatch;
     int inotify_fd;
     kj::Maybe<kj::Promise<void>> pathWatch;
+    // watch descriptor to watched directory
+    std::unordered_map<int, std::string> watchedPaths;
+
+    // Background work is handed to the threads via a queue. Threads
+    // report completion by pushing the work's id to another queue and
+    // signalling efd_work, which wakes the event loop.
+    struct BackgroundWork {
+        uint64_t id;
+        std::function<void()> fn;
+    };
+    std::vector<std::thread> workers;
+    std::mutex workMutex;
+    std::condition_variable workAvailable;
+    std::queue<BackgroundWork> pendingWork;
+    std::vector<uint64_t> finishedWork;
+    bool stopWorkers;
+    // only accessed from the event loop
+    uint64_t nextWorkId;
+    std::unordered_map<uint64_t, kj::Own<kj::PromiseFulfiller<void>>> workFulfillers;
+    int efd_work;
+    kj::Maybe<kj::Promise<void>> workWatch;
+
+    kj::Maybe<kj::Promise<void>> watchdogTask;
+    // in seconds
+    double stallThreshold;
+    // signalled by dumpProfile
+    int efd_profile;
+    kj::Maybe<kj::Promise<void>> profileWatch;
 
     // TODO: restructure so this isn't necessary
     friend class ServerTest;
@@ -0,0 +1,49 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SHA256_H_
+#define LAMINAR_SHA256_H_
+
+#include <string>
+#include <stdint.h>
+
+// Minimal incremental SHA-256, used to name content-addressed files.
+// Usage:
+//   Sha256 h;
+//   h.update(data, size);
+//   std::string name = h.hexdigest();
+class Sha256 {
+public:
+    Sha256();
+
+    void update(const void* data, size_t sz);
+
+    // Finalizes the hash and returns it as 64 lowercase hex characters.
+    // No more data may be added afterwards.
+    std::string hexdigest();
+
+private:
+    void transform(const uint8_t* block);
+
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+    size_t buffered;
+};
+
+#endif // LAMINAR_SHA256_H_
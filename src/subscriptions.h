@@ -0,0 +1,186 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SUBSCRIPTIONS_H_
+#define LAMINAR_SUBSCRIPTIONS_H_
+
+#include "interface.h"
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// Registry of LaminarClients indexed by their MonitorScope, so that an
+// event only needs to visit the clients interested in it. A client's
+// scope type, job and run must not change while it is registered.
+class Subscriptions {
+public:
+    void add(LaminarClient* client) {
+        if(bucket(client->scope).insert(client).second)
+            counts[client->scope.type]++;
+    }
+
+    void remove(LaminarClient* client) {
+        const MonitorScope& scope = client->scope;
+        bool erased = false;
+        switch(scope.type) {
+        case MonitorScope::HOME:
+        case MonitorScope::ALL:
+            erased = global.erase(client);
+            break;
+        case MonitorScope::JOB:
+            erased = eraseFrom(jobs, scope.job, client);
+            break;
+        case MonitorScope::RUN:
+            erased = eraseFrom(runs, scope.job, scope.num, client);
+            break;
+        case MonitorScope::LOG:
+            erased = eraseFrom(logs, scope.job, scope.num, client);
+            break;
+        }
+        if(erased)
+            counts[scope.type]--;
+    }
+
+    // number of registered clients of the given scope type
+    size_t count(MonitorScope::Type type) const { return counts[type]; }
+
+    // Calls f for each client whose scope wantsStatus(job, num)
+    template<typename F>
+    void forStatus(const std::string& job, uint num, F f) const {
+        forGlobal(f);
+        forJob(job, f);
+        auto r = runs.find(job);
+        if(r != runs.end()) {
+            auto n = r->second.find(num);
+            if(n != r->second.end())
+                forEach(n->second, f);
+        }
+    }
+
+    // Calls f for each HOME and ALL client
+    template<typename F>
+    void forGlobal(F f) const {
+        forEach(global, f);
+    }
+
+    // Calls f for each client watching the given job's page
+    template<typename F>
+    void forJob(const std::string& job, F f) const {
+        auto j = jobs.find(job);
+        if(j != jobs.end())
+            forEach(j->second, f);
+    }
+
+    // Calls f for each client watching the given run's page
+    template<typename F>
+    void forRun(const std::string& job, uint num, F f) const {
+        auto r = runs.find(job);
+        if(r != runs.end()) {
+            auto n = r->second.find(num);
+            if(n != r->second.end())
+                forEach(n->second, f);
+        }
+    }
+
+    // Calls f for each client watching any run of the given job
+    template<typename F>
+    void forRunsOf(const std::string& job, F f) const {
+        auto r = runs.find(job);
+        if(r != runs.end()) {
+            for(const auto& n : r->second)
+                forEach(n.second, f);
+        }
+    }
+
+    // whether any client's scope wantsLog(job, num)
+    bool watchingLog(const std::string& job, uint num) const {
+        auto l = logs.find(job);
+        return l != logs.end() && l->second.find(num) != l->second.end();
+    }
+
+    // Calls f for each client whose scope wantsLog(job, num)
+    template<typename F>
+    void forLog(const std::string& job, uint num, F f) const {
+        auto l = logs.find(job);
+        if(l != logs.end()) {
+            auto n = l->second.find(num);
+            if(n != l->second.end())
+                forEach(n->second, f);
+        }
+    }
+
+private:
+    typedef std::unordered_set<LaminarClient*> ClientSet;
+    typedef std::unordered_map<std::string, ClientSet> JobClients;
+    typedef std::unordered_map<std::string, std::unordered_map<uint, ClientSet>> RunClients;
+
+    ClientSet& bucket(const MonitorScope& scope) {
+        switch(scope.type) {
+        case MonitorScope::JOB:
+            return jobs[scope.job];
+        case MonitorScope::RUN:
+            return runs[scope.job][scope.num];
+        case MonitorScope::LOG:
+            return logs[scope.job][scope.num];
+        default:
+            return global;
+        }
+    }
+
+    // empty sets are removed so that finished jobs and runs don't
+    // accumulate entries. Return whether client was found
+    static bool eraseFrom(JobClients& m, const std::string& job, LaminarClient* client) {
+        auto j = m.find(job);
+        if(j == m.end() || !j->second.erase(client))
+            return false;
+        if(j->second.empty())
+            m.erase(j);
+        return true;
+    }
+    static bool eraseFrom(RunClients& m, const std::string& job, uint num, LaminarClient* client) {
+        auto j = m.find(job);
+        if(j == m.end())
+            return false;
+        auto n = j->second.find(num);
+        if(n == j->second.end() || !n->second.erase(client))
+            return false;
+        if(n->second.empty()) {
+            j->second.erase(n);
+            if(j->second.empty())
+                m.erase(j);
+        }
+        return true;
+    }
+
+    // f must not register or deregister clients
+    template<typename F>
+    static void forEach(const ClientSet& set, F& f) {
+        for(LaminarClient* c : set)
+            f(c);
+    }
+
+    // HOME and ALL clients are interested in every status message
+    ClientSet global;
+    JobClients jobs;
+    RunClients runs;
+    RunClients logs;
+    size_t counts[MonitorScope::LOG + 1] = {};
+};
+
+#endif // LAMINAR_SUBSCRIPTIONS_H_
@@ -0,0 +1,90 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "supervisor.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Runs the scripts of a run on behalf of laminard. See supervisor.h
+
+static bool writeFrame(const SupervisorFrame& frame) {
+    const char* p = reinterpret_cast<const char*>(&frame);
+    size_t n = sizeof(frame);
+    while(n > 0) {
+        ssize_t w = write(SUPERVISOR_STATUS_FD, p, n);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 3 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s <script> <cwd> [<script> <cwd>...]\n", argv[0]);
+        return 1;
+    }
+    // scripts must not inherit the status channel
+    fcntl(SUPERVISOR_STATUS_FD, F_SETFD, FD_CLOEXEC);
+
+    // the same rules as Run::reaped
+    const char* result = getenv("RESULT") ?: "success";
+    bool success = strcmp(result, "success") == 0;
+
+    for(int i = 1; i + 1 < argc; i += 2) {
+        const char* script = argv[i];
+        const char* cwd = argv[i + 1];
+        fprintf(stdout, "[laminar] Executing %s\n", script);
+        fflush(stdout);
+        pid_t pid = fork();
+        if(pid == 0) {
+            chdir(cwd);
+            execl(script, script, NULL);
+            fprintf(stderr, "[laminar] Failed to execute %s\n", script);
+            _exit(1);
+        }
+        int status = 1;
+        if(pid > 0) {
+            while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                ;
+        }
+        if(!writeFrame(SupervisorFrame{uint32_t(i / 2), status}))
+            return 1;
+
+        if(success) {
+            if(WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGKILL)) {
+                setenv("RESULT", "aborted", true);
+                success = false;
+            } else if(status != 0) {
+                setenv("RESULT", "failed", true);
+                success = false;
+            }
+        }
+    }
+    return 0;
+}
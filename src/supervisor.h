@@ -0,0 +1,42 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_SUPERVISOR_H_
+#define LAMINAR_SUPERVISOR_H_
+
+#include <stdint.h>
+
+// Protocol between laminard and laminar-supervisor, a helper which
+// executes all the scripts of a run in sequence so that laminard only
+// needs to manage one child process per run. The helper is invoked as
+//   laminar-supervisor <script> <cwd> [<script> <cwd>...]
+// with the environment of the run. The output of all scripts goes to
+// its stdout, and after each script has exited, one SupervisorFrame is
+// written to SUPERVISOR_STATUS_FD. RESULT is updated between scripts in
+// the same way as laminard does when it executes them itself.
+
+const int SUPERVISOR_STATUS_FD = 3;
+
+struct SupervisorFrame {
+    // index of the script in the command line, counting from 0
+    uint32_t step;
+    // as returned by waitpid
+    int32_t status;
+};
+
+#endif // LAMINAR_SUPERVISOR_H_
@@ -0,0 +1,160 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "workspace.h"
+#include "log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CLONE_IO_BUFSIZE 65536
+
+namespace {
+
+// copies the remaining size bytes of in to out, from their current offsets
+bool copyData(int in, int out, off_t size, CloneStats& stats) {
+    while(size > 0) {
+        ssize_t n = copy_file_range(in, nullptr, out, nullptr, size, 0);
+        if(n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            break;
+        if(n <= 0)
+            return n == 0;
+        size -= n;
+        stats.copiedBytes += n;
+    }
+    // not supported between these files, fall back to read and write
+    char buf[CLONE_IO_BUFSIZE];
+    ssize_t n;
+    while((n = read(in, buf, sizeof(buf))) > 0) {
+        for(ssize_t done = 0; done < n;) {
+            ssize_t w = write(out, buf + done, n - done);
+            if(w < 0)
+                return false;
+            done += w;
+        }
+        stats.copiedBytes += n;
+    }
+    return n == 0;
+}
+
+bool cloneFile(int srcDir, int dstDir, const char* name, const struct stat& st, CloneStats& stats) {
+    int in = openat(srcDir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if(in == -1)
+        return false;
+    int out = openat(dstDir, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if(out == -1) {
+        close(in);
+        return false;
+    }
+    bool ok = true;
+    if(ioctl(out, FICLONE, in) == 0)
+        stats.reflinked++;
+    else
+        ok = copyData(in, out, st.st_size, stats);
+    stats.files++;
+    // the mode is set explicitly so that it is not restricted by the umask
+    const struct timespec times[2] = { st.st_atim, st.st_mtim };
+    ok = ok && fchmod(out, st.st_mode & 07777) == 0 && futimens(out, times) == 0;
+    close(in);
+    close(out);
+    return ok;
+}
+
+bool cloneLink(int srcDir, int dstDir, const char* name, const struct stat& st) {
+    std::string target(st.st_size + 1, '\0');
+    ssize_t n = readlinkat(srcDir, name, &target[0], target.size());
+    if(n < 0 || size_t(n) >= target.size())
+        return false;
+    target.resize(n);
+    const struct timespec times[2] = { st.st_atim, st.st_mtim };
+    return symlinkat(target.c_str(), dstDir, name) == 0
+        && utimensat(dstDir, name, times, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+// copies the contents of the directory src into the existing directory dst
+bool cloneDir(int src, int dst, CloneStats& stats) {
+    int fd = dup(src);
+    DIR* dir = fd == -1 ? nullptr : fdopendir(fd);
+    if(!dir) {
+        if(fd != -1)
+            close(fd);
+        return false;
+    }
+    bool ok = true;
+    while(struct dirent* e = readdir(dir)) {
+        const char* name = e->d_name;
+        if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        struct stat st;
+        if(fstatat(src, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            ok = false;
+            break;
+        }
+        if(S_ISREG(st.st_mode)) {
+            ok = cloneFile(src, dst, name, st, stats);
+        } else if(S_ISLNK(st.st_mode)) {
+            ok = cloneLink(src, dst, name, st);
+        } else if(S_ISDIR(st.st_mode)) {
+            ok = false;
+            if(mkdirat(dst, name, 0700) == 0) {
+                int s = openat(src, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                int d = openat(dst, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                // the modification time is set once the contents are in place
+                const struct timespec times[2] = { st.st_atim, st.st_mtim };
+                ok = s != -1 && d != -1 && cloneDir(s, d, stats)
+                    && fchmod(d, st.st_mode & 07777) == 0 && futimens(d, times) == 0;
+                if(s != -1)
+                    close(s);
+                if(d != -1)
+                    close(d);
+            }
+        }
+        if(!ok) {
+            LLOG(ERROR, "Could not clone workspace entry", name, strerror(errno));
+            break;
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+}
+
+bool cloneTree(const std::string& src, const std::string& dst, CloneStats& stats) {
+    int s = open(src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(s == -1)
+        return false;
+    struct stat st;
+    bool ok = false;
+    if(fstat(s, &st) == 0 && mkdir(dst.c_str(), 0700) == 0) {
+        int d = open(dst.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        const struct timespec times[2] = { st.st_atim, st.st_mtim };
+        ok = d != -1 && cloneDir(s, d, stats)
+            && fchmod(d, st.st_mode & 07777) == 0 && futimens(d, times) == 0;
+        if(d != -1)
+            close(d);
+    }
+    close(s);
+    return ok;
+}
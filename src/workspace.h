@@ -0,0 +1,44 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#ifndef LAMINAR_WORKSPACE_H_
+#define LAMINAR_WORKSPACE_H_
+
+#include <stdint.h>
+#include <string>
+
+struct CloneStats {
+    uint64_t files = 0;
+    // files whose data is shared with the source rather than copied
+    uint64_t reflinked = 0;
+    uint64_t copiedBytes = 0;
+};
+
+// Copies the directory tree at src to dst, which must not exist yet, for
+// a run to work in a private copy of its job's workspace. Where the
+// filesystem supports it (btrfs, XFS and others implementing FICLONE),
+// regular files are reflinked, so that the copy shares their data with
+// the source until either is modified. Otherwise they are copied with
+// copy_file_range, which some filesystems also implement by sharing data.
+// Symlinks are recreated as they are, and permissions and modification
+// times are preserved so that incremental builds see unchanged files as
+// such. Special files are skipped. Returns false on failure, in which
+// case dst may be partially populated.
+bool cloneTree(const std::string& src, const std::string& dst, CloneStats& stats);
+
+#endif // LAMINAR_WORKSPACE_H_
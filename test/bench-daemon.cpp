@@ -0,0 +1,297 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "laminar.h"
+#include "laminar.capnp.h"
+
+#include <capnp/ez-rpc.h>
+#include <kj/compat/http.h>
+#include <kj/vector.h>
+
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+namespace fs = boost::filesystem;
+
+// Measures the throughput of a complete laminard running in this process
+// on a temporary LAMINAR_HOME. Usage:
+//   laminar-bench [number of jobs [clients per scope [kind [executors]]]]
+// where kind is one of noop, output, long or mixed (the default, which
+// cycles through the others). One run of each job is queued with a single
+// runBatch RPC while the given number of websocket clients is attached to
+// each MonitorScope. The JOB, RUN and LOG clients follow the first job.
+// Meanwhile a small HTTP request is made every PROBE_INTERVAL_MS; since it
+// is answered by the event loop, its latency reveals how long the loop
+// stalls. Prints a single JSON object.
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const int PROBE_INTERVAL_MS = 20;
+// probes slower than this count towards the stall time
+const double STALL_THRESHOLD_MS = 10;
+const char* const OUTPUT_BYTES = "1048576";
+const char* const LONG_SECONDS = "2";
+
+double msSince(Clock::time_point t) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - t).count();
+}
+
+double percentile(std::vector<double> v, double p) {
+    if(v.empty())
+        return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, size_t(p * v.size()))];
+}
+
+void writeScript(const fs::path& path, const std::string& content) {
+    std::ofstream(path.string()) << "#!/bin/sh\n" << content << "\n";
+    fs::permissions(path, fs::owner_all);
+}
+
+// Records when each run starts, relative to when it was queued. Passed to
+// watch, since runBatch only tells its listener about completions
+class Listener : public LaminarCi::RunListener::Server {
+public:
+    Listener(const Clock::time_point& queued, std::vector<double>& latencies) :
+        queued(queued),
+        latencies(latencies)
+    {}
+    kj::Promise<void> started(StartedContext context) override {
+        latencies.push_back(msSince(queued));
+        return kj::READY_NOW;
+    }
+    kj::Promise<void> completed(CompletedContext context) override {
+        return kj::READY_NOW;
+    }
+    const Clock::time_point& queued;
+    std::vector<double>& latencies;
+};
+
+struct WebsocketClient {
+    std::string url;
+    kj::Own<kj::AsyncIoStream> stream;
+    kj::Own<kj::HttpClient> http;
+    kj::Own<kj::WebSocket> ws;
+    uint64_t bytes = 0;
+};
+
+kj::Promise<kj::Own<kj::AsyncIoStream>> connect(kj::Network& network, const std::string& address) {
+    return network.parseAddress(address).then([](kj::Own<kj::NetworkAddress>&& addr){
+        return addr->connect().attach(kj::mv(addr));
+    });
+}
+
+kj::Promise<void> receive(WebsocketClient& c) {
+    return c.ws->receive().then([&c](kj::WebSocket::Message&& message) -> kj::Promise<void> {
+        KJ_SWITCH_ONEOF(message) {
+            KJ_CASE_ONEOF(str, kj::String) {
+                c.bytes += str.size();
+            }
+            KJ_CASE_ONEOF(data, kj::Array<kj::byte>) {
+                c.bytes += data.size();
+            }
+            KJ_CASE_ONEOF_DEFAULT {
+                // closed
+                return kj::READY_NOW;
+            }
+        }
+        return receive(c);
+    });
+}
+
+kj::Promise<void> open(kj::Network& network, const std::string& address, kj::HttpHeaderTable& table, WebsocketClient& c) {
+    return connect(network, address).then([&](kj::Own<kj::AsyncIoStream>&& stream){
+        c.stream = kj::mv(stream);
+        c.http = kj::newHttpClient(table, *c.stream);
+        return c.http->openWebSocket(c.url, kj::HttpHeaders(table));
+    }).then([&c](kj::HttpClient::WebSocketResponse&& response){
+        KJ_SWITCH_ONEOF(response.webSocketOrBody) {
+            KJ_CASE_ONEOF(ws, kj::Own<kj::WebSocket>) {
+                c.ws = kj::mv(ws);
+            }
+            KJ_CASE_ONEOF_DEFAULT {
+                KJ_FAIL_REQUIRE("websocket refused", c.url, response.statusCode);
+            }
+        }
+    });
+}
+
+// Requests a small resource every PROBE_INTERVAL_MS until done is set
+kj::Promise<void> probe(kj::Timer& timer, kj::HttpClient& http, kj::HttpHeaderTable& table,
+                        const bool& done, std::vector<double>& latencies) {
+    if(done)
+        return kj::READY_NOW;
+    Clock::time_point start = Clock::now();
+    auto req = http.request(kj::HttpMethod::GET, "/favicon.ico", kj::HttpHeaders(table), uint64_t(0));
+    req.body = nullptr;
+    return req.response.then([](kj::HttpClient::Response&& response){
+        return response.body->readAllBytes().attach(kj::mv(response.body));
+    }).then([&,start](kj::Array<kj::byte>&&){
+        latencies.push_back(msSince(start));
+        return timer.afterDelay(PROBE_INTERVAL_MS * kj::MILLISECONDS);
+    }).then([&](){
+        return probe(timer, http, table, done, latencies);
+    });
+}
+
+}
+
+int main(int argc, char** argv) {
+    int nJobs = argc > 1 ? atoi(argv[1]) : 1000;
+    int nClients = argc > 2 ? atoi(argv[2]) : 10;
+    std::string kind = argc > 3 ? argv[3] : "mixed";
+    const char* executors = argc > 4 ? argv[4] : "16";
+    if(nJobs < 1 || nClients < 0) {
+        fprintf(stderr, "Usage: %s [jobs [clients per scope [noop|output|long|mixed [executors]]]]\n", argv[0]);
+        return 1;
+    }
+
+    const char* kinds[] = { "noop", "output", "long" };
+    const std::string scripts[] = {
+        "true",
+        std::string("yes 'laminar benchmark output' | head -c ") + OUTPUT_BYTES,
+        std::string("sleep ") + LONG_SECONDS,
+    };
+    const char* scopeNames[] = { "home", "all", "job", "run", "log" };
+
+    fs::path home = fs::temp_directory_path() / fs::unique_path("laminar-bench-%%%%%%");
+    fs::create_directories(home/"cfg"/"jobs");
+    fs::create_directories(home/"cfg"/"nodes");
+    std::ofstream((home/"cfg"/"nodes"/"bench.conf").string()) << "EXECUTORS=" << executors << "\n";
+    std::vector<std::string> jobs;
+    for(int i = 0; i < nJobs; ++i) {
+        int k = kind == "mixed" ? i % 3 : kind == "output" ? 1 : kind == "long" ? 2 : 0;
+        jobs.push_back(std::string("bench-") + kinds[k] + "-" + std::to_string(i));
+        writeScript(home/"cfg"/"jobs"/(jobs.back() + ".run"), scripts[k]);
+    }
+
+    std::string rpcAddress = "unix:" + (home/"rpc.sock").string();
+    std::string httpAddress = "unix:" + (home/"http.sock").string();
+    setenv("LAMINAR_HOME", home.c_str(), 1);
+    setenv("LAMINAR_BIND_RPC", rpcAddress.c_str(), 1);
+    setenv("LAMINAR_BIND_HTTP", httpAddress.c_str(), 1);
+
+    // The daemon owns an event loop, which must be created and destroyed
+    // in the thread that runs it
+    std::promise<Laminar*> started;
+    std::thread daemon([&]{
+        Laminar laminar;
+        started.set_value(&laminar);
+        laminar.run();
+    });
+    Laminar* laminar = started.get_future().get();
+    while(!fs::exists(home/"rpc.sock") || !fs::exists(home/"http.sock"))
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    std::vector<double> queueLatencies, probeLatencies;
+    // received by each client, in the order of scopeNames
+    std::vector<uint64_t> received(5 * nClients);
+    Clock::time_point start, end;
+    {
+        capnp::EzRpcClient rpc(rpcAddress);
+        kj::WaitScope& waitScope = rpc.getWaitScope();
+        kj::Network& network = rpc.getIoProvider().getNetwork();
+        kj::Timer& timer = rpc.getIoProvider().getTimer();
+        kj::HttpHeaderTable table;
+
+        const std::string urls[] = {
+            "/",
+            "/jobs",
+            "/jobs/" + jobs[0],
+            "/jobs/" + jobs[0] + "/1",
+            "/jobs/" + jobs[0] + "/1/log",
+        };
+        // must be destroyed before table and the event loop, but after
+        // the promises which refer to them
+        std::vector<WebsocketClient> clients(received.size());
+        kj::Vector<kj::Promise<void>> opened;
+        for(int i = 0; i < clients.size(); ++i) {
+            clients[i].url = urls[i / nClients];
+            opened.add(open(network, httpAddress, table, clients[i]));
+        }
+        kj::joinPromises(opened.releaseAsArray()).wait(waitScope);
+        kj::Vector<kj::Promise<void>> receiving;
+        for(WebsocketClient& c : clients)
+            receiving.add(receive(c));
+        kj::Promise<void> receivers = kj::joinPromises(receiving.releaseAsArray()).eagerlyEvaluate(nullptr);
+
+        bool done = false;
+        kj::Own<kj::AsyncIoStream> probeStream = connect(network, httpAddress).wait(waitScope);
+        kj::Own<kj::HttpClient> probeHttp = kj::newHttpClient(table, *probeStream);
+        kj::Promise<void> probing = probe(timer, *probeHttp, table, done, probeLatencies).eagerlyEvaluate(nullptr);
+
+        // watch all jobs for their starts
+        auto watch = rpc.getMain<LaminarCi>().watchRequest();
+        watch.setJobName("");
+        watch.setListener(kj::heap<Listener>(start, queueLatencies));
+        auto handle = watch.send().wait(waitScope).getHandle();
+
+        start = Clock::now();
+        auto req = rpc.getMain<LaminarCi>().runBatchRequest();
+        auto list = req.initJobs(jobs.size());
+        for(int i = 0; i < jobs.size(); ++i)
+            list[i].setJobName(jobs[i]);
+        auto results = req.send().wait(waitScope).getResults();
+        end = Clock::now();
+        for(auto r : results) {
+            if(r.getResult() != LaminarCi::JobResult::SUCCESS)
+                fprintf(stderr, "%s #%u did not succeed\n", r.getJobName().cStr(), r.getBuildNum());
+        }
+
+        // let the last status messages and output arrive
+        timer.afterDelay(200 * kj::MILLISECONDS).wait(waitScope);
+        done = true;
+        probing.wait(waitScope);
+        for(int i = 0; i < clients.size(); ++i)
+            received[i] = clients[i].bytes;
+    }
+    laminar->stop();
+    daemon.join();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double stallTotal = 0;
+    for(double l : probeLatencies)
+        stallTotal += l > STALL_THRESHOLD_MS ? l : 0;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"jobs\":%d,\"kind\":\"%s\",\"clients_per_scope\":%d,\"executors\":%s,", nJobs, kind.c_str(), nClients, executors);
+    printf("\"seconds\":%.3f,\"jobs_per_second\":%.2f,", seconds, nJobs / seconds);
+    printf("\"queue_to_start_ms\":{\"p50\":%.2f,\"p99\":%.2f},", percentile(queueLatencies, 0.5), percentile(queueLatencies, 0.99));
+    printf("\"bytes_per_second_per_client\":{");
+    for(int s = 0; s < 5; ++s) {
+        uint64_t bytes = 0;
+        for(int i = s * nClients; i < (s + 1) * nClients; ++i)
+            bytes += received[i];
+        printf("%s\"%s\":%.0f", s ? "," : "", scopeNames[s], nClients ? bytes / seconds / nClients : 0);
+    }
+    printf("},\"peak_rss_kb\":%ld,", usage.ru_maxrss);
+    printf("\"loop_stall_ms\":{\"max\":%.2f,\"total\":%.2f}}\n", percentile(probeLatencies, 1), stallTotal);
+
+    fs::remove_all(home);
+    return 0;
+}
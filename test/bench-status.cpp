@@ -0,0 +1,103 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include "laminar.h"
+#include "database.h"
+
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace fs = boost::filesystem;
+
+// Measures the time taken by Laminar::sendStatus for each MonitorScope
+// against a database of synthetic builds. Usage:
+//   laminar-bench-status [number of builds]
+// Prints one line per scope: the scope name and mean microseconds per call
+
+namespace {
+
+const int NUM_JOBS = 100;
+const int ITERATIONS = 100;
+
+class BenchClient : public LaminarClient {
+public:
+    void sendMessage(Message payload) override { bytes += payload->size(); }
+    size_t bytes = 0;
+};
+
+void populate(const fs::path& home, long nBuilds) {
+    Database db((home/"laminar.sqlite").string().c_str());
+    db.exec("BEGIN TRANSACTION");
+    time_t now = time(nullptr);
+    for(long i = 0; i < nBuilds; ++i) {
+        std::string name = "job" + std::to_string(i % NUM_JOBS);
+        uint number = static_cast<uint>(i / NUM_JOBS + 1);
+        // spread the builds over the last 30 days, oldest first
+        time_t completed = now - 30 * 86400 + (30 * 86400 * i) / nBuilds;
+        db.stmt("INSERT INTO builds(name, number, node, queuedAt, startedAt, completedAt, "
+                "result, output, outputLen, reason) VALUES(?,?,'',?,?,?,?,'ok',2,'bench')")
+         .bind(name, number, completed - 120, completed - 60, completed,
+               int(i % 7 ? RunState::SUCCESS : RunState::FAILED))
+         .exec();
+    }
+    db.exec("COMMIT");
+}
+
+}
+
+int main(int argc, char** argv) {
+    long nBuilds = argc > 1 ? atol(argv[1]) : 1000000;
+
+    fs::path home = fs::temp_directory_path() / fs::unique_path("laminar-bench-%%%%%%");
+    fs::create_directories(home);
+    setenv("LAMINAR_HOME", home.c_str(), 1);
+
+    {
+        // creates the schema
+        Laminar laminar;
+        populate(home, nBuilds);
+    }
+
+    Laminar laminar;
+    std::string job = "job" + std::to_string(NUM_JOBS / 2);
+    uint num = static_cast<uint>(nBuilds / NUM_JOBS / 2);
+    const struct {
+        const char* name;
+        MonitorScope scope;
+    } scopes[] = {
+        { "home", MonitorScope(MonitorScope::HOME) },
+        { "all", MonitorScope(MonitorScope::ALL) },
+        { "job", MonitorScope(MonitorScope::JOB, job) },
+        { "run", MonitorScope(MonitorScope::RUN, job, num) },
+        { "log", MonitorScope(MonitorScope::LOG, job, num) },
+    };
+    for(const auto& s : scopes) {
+        BenchClient client;
+        client.scope = s.scope;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < ITERATIONS; ++i)
+            laminar.sendStatus(&client);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        printf("%s\t%ld\n", s.name, long(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / ITERATIONS));
+    }
+
+    fs::remove_all(home);
+    return 0;
+}
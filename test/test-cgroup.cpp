@@ -0,0 +1,102 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include "cgroup.h"
+#include "node.h"
+#include "run.h"
+
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// These tests need a writable cgroup2 hierarchy and do nothing otherwise
+class CgroupTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        std::ifstream mounts("/proc/self/mounts");
+        std::string dev, dir, type, rest;
+        while(mounts >> dev >> dir >> type && std::getline(mounts, rest)) {
+            if(type == "cgroup2") {
+                base = dir + "/laminar-test-" + std::to_string(getpid());
+                if(mkdir(base.c_str(), 0755) != 0)
+                    base.clear();
+                break;
+            }
+        }
+        run.node = std::make_shared<Node>();
+    }
+    void TearDown() override {
+        if(!base.empty())
+            rmdir(base.c_str());
+    }
+    std::string script(std::string content) {
+        char tmp[16] = "/tmp/lt.XXXXXX";
+        int fd = mkstemp(tmp);
+        content = "#!/bin/sh\n" + content;
+        write(fd, content.data(), content.size());
+        fchmod(fd, 0755);
+        close(fd);
+        scripts.push_back(tmp);
+        return tmp;
+    }
+    void runAll() {
+        while(!run.step()) {
+            int state = -1;
+            waitpid(run.current_pid.orDefault(0), &state, 0);
+            run.reaped(state);
+            close(run.output_fd);
+        }
+    }
+    ~CgroupTest() noexcept override {
+        for(const std::string& s : scripts)
+            unlink(s.c_str());
+    }
+
+    std::string base;
+    std::vector<std::string> scripts;
+    class Run run;
+};
+
+TEST_F(CgroupTest, KillsEscapedProcesses) {
+    if(base.empty())
+        return;
+    run.cgroup.reset(new Cgroup);
+    ASSERT_TRUE(run.cgroup->create(base + "/run"));
+    run.addScript(script("setsid sleep 1000 >/dev/null 2>&1 &\n"));
+    runAll();
+    EXPECT_EQ(RunState::SUCCESS, run.result);
+    // the daemonized process is still in the run's cgroup
+    std::ifstream procs(base + "/run/cgroup.procs");
+    pid_t pid = 0;
+    EXPECT_TRUE(procs >> pid);
+    EXPECT_TRUE(run.cgroup->kill());
+    EXPECT_TRUE(run.cgroup->remove());
+}
+
+TEST_F(CgroupTest, Usage) {
+    if(base.empty())
+        return;
+    run.cgroup.reset(new Cgroup);
+    ASSERT_TRUE(run.cgroup->create(base + "/run"));
+    run.addScript(script("i=0; while [ $i -lt 20000 ]; do i=$((i+1)); done\n"));
+    runAll();
+    Cgroup::Usage usage = run.cgroup->usage();
+    EXPECT_GT(usage.userUsec + usage.systemUsec, 0);
+    EXPECT_TRUE(run.cgroup->remove());
+}
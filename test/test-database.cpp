@@ -73,3 +73,29 @@ TEST_F(DatabaseTest, MultiRow) {
     });
     EXPECT_EQ(10, i);
 }
+
+TEST_F(DatabaseTest, Rebind) {
+    for(int i = 0; i < 3; ++i) {
+        int n = 0;
+        db.stmt("select ? + 1").bind(i).fetch<int>([&](int r){
+            n++;
+            EXPECT_EQ(i + 1, r);
+        });
+        EXPECT_EQ(1, n);
+    }
+}
+
+TEST_F(DatabaseTest, Reentrant) {
+    ASSERT_TRUE(db.exec("create table test(id int)"));
+    for(int i = 0; i < 3; ++i)
+        EXPECT_TRUE(db.stmt("insert into test values(?)").bind(i).exec());
+    int n = 0;
+    db.stmt("select id from test where id >= ?").bind(0).fetch<int>([&](int){
+        // the same query while the outer statement is still stepping
+        db.stmt("select id from test where id >= ?").bind(2).fetch<int>([&](int r){
+            EXPECT_EQ(2, r);
+        });
+        n++;
+    });
+    EXPECT_EQ(3, n);
+}
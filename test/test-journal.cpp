@@ -0,0 +1,154 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include "journal.h"
+
+namespace fs = boost::filesystem;
+
+class JournalTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        dir = fs::temp_directory_path() / fs::unique_path("lt-journal-%%%%%%");
+        fs::create_directories(dir);
+        path = (dir/"journal").string();
+    }
+    void TearDown() override {
+        fs::remove_all(dir);
+    }
+    std::vector<Journal::Entry> reopen() {
+        Journal j;
+        std::vector<Journal::Entry> pending;
+        EXPECT_TRUE(j.open(path, pending));
+        return pending;
+    }
+    fs::path dir;
+    std::string path;
+};
+
+TEST_F(JournalTest, Pending) {
+    {
+        Journal j;
+        std::vector<Journal::Entry> pending;
+        ASSERT_TRUE(j.open(path, pending));
+        EXPECT_TRUE(pending.empty());
+        uint64_t a = j.queued("a", {{"x", "tab\there\nnewline\\"}}, 100);
+        uint64_t b = j.queued("b", {}, 101);
+        uint64_t c = j.queued("c", {}, 102);
+        j.started(a, 7, "node1", 110);
+        j.started(b, 3, "node1", 111);
+        j.finished(b);
+        j.changed(c, "=priority", "5");
+    }
+    std::vector<Journal::Entry> pending = reopen();
+    ASSERT_EQ(2, pending.size());
+    EXPECT_EQ("a", pending[0].job);
+    EXPECT_EQ("tab\there\nnewline\\", pending[0].params["x"]);
+    EXPECT_EQ(100, pending[0].queuedAt);
+    EXPECT_EQ(7, pending[0].number);
+    EXPECT_EQ(110, pending[0].startedAt);
+    EXPECT_EQ("node1", pending[0].node);
+    EXPECT_EQ("c", pending[1].job);
+    EXPECT_EQ(0, pending[1].number);
+    EXPECT_EQ("5", pending[1].params["=priority"]);
+}
+
+TEST_F(JournalTest, TruncatedRecord) {
+    {
+        Journal j;
+        std::vector<Journal::Entry> pending;
+        ASSERT_TRUE(j.open(path, pending));
+        j.queued("a", {}, 100);
+    }
+    std::ofstream(path, std::ios::app) << "Q\t2\t101\tb";
+    std::vector<Journal::Entry> pending = reopen();
+    ASSERT_EQ(1, pending.size());
+    EXPECT_EQ("a", pending[0].job);
+}
+
+TEST_F(JournalTest, AppendAfterTruncatedRecord) {
+    {
+        Journal j;
+        std::vector<Journal::Entry> pending;
+        ASSERT_TRUE(j.open(path, pending));
+        j.queued("a", {}, 100);
+    }
+    std::ofstream(path, std::ios::app) << "Q\t5\t17";
+    {
+        Journal j;
+        std::vector<Journal::Entry> pending;
+        ASSERT_TRUE(j.open(path, pending));
+        j.queued("c", {}, 102);
+    }
+    std::vector<Journal::Entry> pending = reopen();
+    ASSERT_EQ(2, pending.size());
+    EXPECT_EQ("a", pending[0].job);
+    EXPECT_EQ("c", pending[1].job);
+    EXPECT_EQ(102, pending[1].queuedAt);
+}
+
+TEST_F(JournalTest, Compact) {
+    uint64_t b;
+    {
+        Journal j;
+        std::vector<Journal::Entry> pending;
+        ASSERT_TRUE(j.open(path, pending));
+        uint64_t a = j.queued("a", {}, 100);
+        b = j.queued("b", {}, 101);
+        j.started(b, 3, "node1", 111);
+        j.finished(a);
+        EXPECT_EQ(4, j.length());
+        pending = reopen();
+        j.compact(pending);
+        EXPECT_EQ(0, j.length());
+        // ids continue after those found in the journal
+        EXPECT_LT(b, j.queued("c", {}, 102));
+    }
+    std::vector<Journal::Entry> pending = reopen();
+    ASSERT_EQ(2, pending.size());
+    EXPECT_EQ(b, pending[0].id);
+    EXPECT_EQ(3, pending[0].number);
+    EXPECT_EQ("c", pending[1].job);
+}
+
+TEST_F(JournalTest, AppendWhileCompacting) {
+    {
+        Journal j;
+        std::vector<Journal::Entry> pending;
+        ASSERT_TRUE(j.open(path, pending));
+        uint64_t a = j.queued("a", {}, 100);
+        j.queued("b", {}, 101);
+        pending = reopen();
+        Journal::Compaction c;
+        ASSERT_TRUE(j.startCompact(pending, c));
+        EXPECT_FALSE(j.startCompact(pending, c));
+        j.queued("c", {}, 102);
+        j.finished(a);
+        Journal::writeCompaction(c);
+        // until then, the old journal is complete
+        EXPECT_EQ(2, reopen().size());
+        j.finishCompact(c);
+        EXPECT_EQ(2, j.length());
+    }
+    std::vector<Journal::Entry> pending = reopen();
+    ASSERT_EQ(2, pending.size());
+    EXPECT_EQ("b", pending[0].job);
+    EXPECT_EQ("c", pending[1].job);
+}
@@ -19,11 +19,15 @@
 #include <gtest/gtest.h>
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/document.h>
+#include <boost/filesystem.hpp>
+#include <fstream>
 #include "laminar.h"
 
+namespace fs = boost::filesystem;
+
 class TestLaminarClient : public LaminarClient {
 public:
-    virtual void sendMessage(std::string p) { payload = p; }
+    virtual void sendMessage(Message p) { payload = *p; }
     std::string payload;
 };
 
@@ -41,3 +45,84 @@ TEST_F(LaminarTest, StatusMessageContainsTime) {
     ASSERT_TRUE(d.HasMember("time"));
     EXPECT_GE(1, d["time"].GetInt() - time(nullptr));
 }
+
+TEST(JobStatsTest, Add) {
+    JobStats stats;
+    stats.add(1, 100, 110, RunState::SUCCESS);
+    EXPECT_EQ(1, stats.count);
+    EXPECT_EQ(10, stats.estimatedDuration());
+    stats.add(2, 200, 220, RunState::FAILED);
+    EXPECT_EQ(2, stats.lastNumber);
+    EXPECT_EQ(RunState::FAILED, stats.lastResult);
+    EXPECT_EQ(20, stats.lastDuration);
+    EXPECT_EQ(1, stats.lastSuccessNumber);
+    EXPECT_EQ(2, stats.lastFailedNumber);
+    // the estimate moves towards, but not all the way to, the latest duration
+    EXPECT_LT(10, stats.estimatedDuration());
+    EXPECT_GT(20, stats.estimatedDuration());
+}
+
+// Tests how changes to the configuration, as reported by inotify, are
+// reflected. The events are the ones Server::addWatchPath asks for
+class LaminarConfigTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        char tmpl[] = "/tmp/laminar-test-XXXXXX";
+        home = mkdtemp(tmpl);
+        fs::create_directories(home/"cfg"/"jobs");
+        setenv("LAMINAR_HOME", home.c_str(), 1);
+        laminar = new Laminar;
+    }
+    void TearDown() override {
+        delete laminar;
+        unsetenv("LAMINAR_HOME");
+        fs::remove_all(home);
+    }
+    void write(const std::string& rel) {
+        std::ofstream((home/"cfg"/rel).string()) << "#!/bin/sh\n";
+    }
+    void changed(const std::string& rel) {
+        laminar->notifyConfigChanged((home/"cfg"/rel).string());
+    }
+    bool exists(const std::string& rel) const {
+        return laminar->cfgExists(rel);
+    }
+    fs::path home;
+    Laminar* laminar;
+};
+
+TEST_F(LaminarConfigTest, AddRemove) {
+    EXPECT_FALSE(exists("jobs/foo.run"));
+    write("jobs/foo.run");
+    changed("jobs/foo.run");
+    EXPECT_TRUE(exists("jobs/foo.run"));
+
+    fs::remove(home/"cfg"/"jobs"/"foo.run");
+    changed("jobs/foo.run");
+    EXPECT_FALSE(exists("jobs/foo.run"));
+}
+
+TEST_F(LaminarConfigTest, Rename) {
+    // as an editor saving a file does
+    write("jobs/foo.run.tmp");
+    changed("jobs/foo.run.tmp");
+    fs::rename(home/"cfg"/"jobs"/"foo.run.tmp", home/"cfg"/"jobs"/"foo.run");
+    changed("jobs/foo.run.tmp");
+    changed("jobs/foo.run");
+    EXPECT_FALSE(exists("jobs/foo.run.tmp"));
+    EXPECT_TRUE(exists("jobs/foo.run"));
+}
+
+TEST_F(LaminarConfigTest, DirectoryCreatedLater) {
+    // files can be placed in a new directory before it is watched, so its
+    // creation alone must find them
+    fs::create_directories(home/"cfg"/"nodes");
+    write("nodes/build.conf");
+    changed("nodes");
+    EXPECT_TRUE(exists("nodes/build.conf"));
+
+    // and its removal forgets them
+    fs::remove_all(home/"cfg"/"nodes");
+    changed("nodes");
+    EXPECT_FALSE(exists("nodes/build.conf"));
+}
@@ -0,0 +1,96 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include "logindex.h"
+#include "database.h"
+
+class LogIndexTest : public ::testing::Test {
+protected:
+    LogIndexTest() :
+        ::testing::Test(),
+        db(":memory:")
+    {
+        EXPECT_TRUE(LogIndex::create(db));
+    }
+    std::vector<LogIndex::Match> search(const std::string& query, const std::string& job = "",
+                                        time_t from = 0, time_t to = 1000, uint limit = 10) {
+        bool more;
+        return LogIndex::search(db, query, job, from, to, limit, more);
+    }
+    Database db;
+};
+
+TEST_F(LogIndexTest, Lines) {
+    LogIndex::add(db, "foo", 1, 100, "make all\n\033[31merror: undefined reference\033[0m\r\nfailed\n");
+    auto m = search("undefined reference");
+    ASSERT_EQ(1, m.size());
+    EXPECT_EQ("foo", m[0].job);
+    EXPECT_EQ(1, m[0].number);
+    EXPECT_EQ(100, m[0].completedAt);
+    EXPECT_EQ(1, m[0].line);
+    EXPECT_EQ("error: undefined reference", m[0].text);
+    // a phrase, not a set of words
+    EXPECT_TRUE(search("reference undefined").empty());
+    // FTS5 syntax is taken literally
+    EXPECT_TRUE(search("\"error").size() == 1);
+}
+
+TEST_F(LogIndexTest, Parts) {
+    long id = LogIndex::begin(db, "foo", 1, 100);
+    LogIndex::addLines(db, id, 0, "one\ntwo\n");
+    LogIndex::addLines(db, id, 2, "three\nfour");
+    auto m = search("four");
+    ASSERT_EQ(1, m.size());
+    EXPECT_EQ(3, m[0].line);
+    // beginning again replaces the run's lines
+    LogIndex::begin(db, "foo", 1, 100);
+    EXPECT_TRUE(search("one").empty());
+}
+
+TEST_F(LogIndexTest, Scope) {
+    LogIndex::add(db, "foo", 1, 100, "error\n");
+    LogIndex::add(db, "bar", 1, 200, "ok\nerror\n");
+    LogIndex::add(db, "foo", 2, 300, "error\n");
+    auto m = search("error");
+    ASSERT_EQ(3, m.size());
+    // oldest first
+    EXPECT_EQ("bar", m[1].job);
+    EXPECT_EQ(1, m[1].line);
+    m = search("error", "foo");
+    ASSERT_EQ(2, m.size());
+    EXPECT_EQ(2, m[1].number);
+    m = search("error", "", 150, 300);
+    ASSERT_EQ(2, m.size());
+    EXPECT_EQ("bar", m[0].job);
+    EXPECT_TRUE(search("error", "foo", 150, 250).empty());
+
+    bool more;
+    m = LogIndex::search(db, "error", "", 0, 1000, 2, more);
+    EXPECT_EQ(2, m.size());
+    EXPECT_TRUE(more);
+}
+
+TEST_F(LogIndexTest, Remove) {
+    LogIndex::add(db, "foo", 1, 100, "error\n");
+    LogIndex::add(db, "foo", 2, 200, "error\n");
+    LogIndex::remove(db, "foo", 1);
+    auto m = search("error");
+    ASSERT_EQ(1, m.size());
+    EXPECT_EQ(2, m[0].number);
+}
@@ -0,0 +1,63 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include "metrics.h"
+#include <unistd.h>
+
+TEST(MetricsTest, Histogram) {
+    Histogram h({1, 2});
+    h.observe(0.5);
+    h.observe(1);
+    h.observe(3);
+    std::string out;
+    h.write(out, "x", MetricsWriter::label("a", "b"));
+    EXPECT_EQ("x_bucket{a=\"b\",le=\"1\"} 2\n"
+              "x_bucket{a=\"b\",le=\"2\"} 2\n"
+              "x_bucket{a=\"b\",le=\"+Inf\"} 3\n"
+              "x_sum{a=\"b\"} 4.5\n"
+              "x_count{a=\"b\"} 3\n", out);
+}
+
+TEST(MetricsTest, Writer) {
+    MetricsWriter w;
+    w.family("y", "gauge", "Help text");
+    w.sample("y", std::string(), 2);
+    w.sample("y", MetricsWriter::label("job", "a\"b\\c\nd"), 0.25);
+    EXPECT_EQ("# HELP y Help text\n"
+              "# TYPE y gauge\n"
+              "y 2\n"
+              "y{job=\"a\\\"b\\\\c\\nd\"} 0.25\n", w.str());
+}
+
+TEST(MetricsTest, LoopSection) {
+    {
+        LoopSection outer("test outer");
+        LoopSection inner("test inner");
+        usleep(20000);
+    }
+    const LoopProfile::HandlerMap& handlers = metrics.loop.handlers();
+    ASSERT_EQ(1, handlers.count("test inner"));
+    ASSERT_EQ(1, handlers.count("test outer"));
+    // the time of the nested section is only attributed to it
+    EXPECT_LE(0.02, handlers.at("test inner").seconds);
+    EXPECT_GT(0.01, handlers.at("test outer").seconds);
+    double seconds;
+    EXPECT_STREQ("test inner", metrics.loop.takeSlowest(seconds));
+    EXPECT_EQ(nullptr, metrics.loop.takeSlowest(seconds));
+}
@@ -0,0 +1,97 @@
+///
+/// Copyright 2015-2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <sys/stat.h>
+#include "objectstore.h"
+
+namespace fs = boost::filesystem;
+
+class ObjectStoreTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        dir = fs::temp_directory_path() / fs::unique_path("lt-objects-%%%%%%");
+        fs::create_directories(dir/"archive");
+        ASSERT_TRUE(store.open((dir/"objects").string()));
+    }
+    void TearDown() override {
+        // objects are read-only, but their directories are not
+        fs::remove_all(dir);
+    }
+    std::string write(std::string name, std::string content) {
+        std::string path = (dir/"archive"/name).string();
+        std::ofstream(path) << content;
+        return path;
+    }
+    static struct stat info(std::string path) {
+        struct stat st;
+        stat(path.c_str(), &st);
+        return st;
+    }
+    fs::path dir;
+    ObjectStore store;
+};
+
+TEST_F(ObjectStoreTest, Deduplicates) {
+    std::string a = write("a", "content");
+    std::string b = write("b", "content");
+    std::string digest = store.add(a);
+    // sha256("content")
+    EXPECT_EQ("ed7002b439e9ac845f22357d822bac1444730fbdb6016d3ec9432297b9ec9f73", digest);
+    EXPECT_EQ(digest, store.add(b));
+    EXPECT_EQ(info(a).st_ino, info(b).st_ino);
+    EXPECT_EQ(3, info(a).st_nlink);
+    // adding again changes nothing
+    EXPECT_EQ(digest, store.add(a));
+    EXPECT_EQ(3, info(a).st_nlink);
+
+    std::string c = write("c", "other");
+    EXPECT_NE(digest, store.add(c));
+    EXPECT_NE(info(a).st_ino, info(c).st_ino);
+}
+
+TEST_F(ObjectStoreTest, CopiesLinkedFiles) {
+    std::string a = write("a", "content");
+    std::string ws = (dir/"workspace-file").string();
+    ASSERT_EQ(0, link(a.c_str(), ws.c_str()));
+    ASSERT_FALSE(store.add(a).empty());
+    // the archived file no longer shares its inode with the workspace
+    EXPECT_NE(info(a).st_ino, info(ws).st_ino);
+    EXPECT_EQ(1, info(ws).st_nlink);
+    EXPECT_EQ(2, info(a).st_nlink);
+    std::ifstream in(a);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    EXPECT_EQ("content", content);
+}
+
+TEST_F(ObjectStoreTest, Collect) {
+    std::string a = write("a", "content");
+    std::string b = write("b", "content");
+    store.add(a);
+    store.add(b);
+    std::string c = write("c", "other");
+    store.add(c);
+    EXPECT_EQ(0, store.collect());
+    fs::remove(a);
+    EXPECT_EQ(0, store.collect());
+    fs::remove(b);
+    fs::remove(c);
+    EXPECT_EQ(strlen("content") + strlen("other"), store.collect());
+}
@@ -0,0 +1,57 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include "resources.h"
+#include "runlog.h"
+
+// The fingerprinted URLs are only known from the generated index.html
+static std::string fingerprintedUrl(const Resources& resources, const std::string& path) {
+    Resources::Response response;
+    if(!resources.handleRequest("/", false, response))
+        return std::string();
+    std::string html;
+    if(!inflateLog(response.start, response.end - response.start, html))
+        return std::string();
+    size_t pos = html.find("\"" + path + "?v=");
+    if(pos == std::string::npos)
+        return std::string();
+    return html.substr(pos + 1, html.find('"', pos + 1) - pos - 1);
+}
+
+TEST(ResourcesTest, Fingerprint) {
+    Resources resources;
+    Resources::Response response;
+    std::string url = fingerprintedUrl(resources, "/js/app.js");
+    ASSERT_FALSE(url.empty());
+    ASSERT_TRUE(resources.handleRequest(url, false, response));
+    EXPECT_TRUE(response.immutable);
+
+    ASSERT_TRUE(resources.handleRequest("/js/app.js", false, response));
+    EXPECT_FALSE(response.immutable);
+}
+
+TEST(ResourcesTest, StaleFingerprint) {
+    Resources resources;
+    Resources::Response response;
+    // a stale URL still gets the current content, but must be revalidated
+    ASSERT_TRUE(resources.handleRequest("/js/app.js?v=0123456789abcdef", false, response));
+    EXPECT_FALSE(response.immutable);
+    ASSERT_TRUE(resources.handleRequest("/js/app.js?v=", false, response));
+    EXPECT_FALSE(response.immutable);
+}
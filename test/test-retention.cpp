@@ -0,0 +1,72 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include "retention.h"
+
+#include <set>
+
+namespace {
+
+const time_t NOW = 100 * 86400;
+
+// runs 10 down to 1, one per day, all successful unless listed in failed
+std::vector<CompletedRun> daily(std::set<uint> failed = {}) {
+    std::vector<CompletedRun> runs;
+    for(uint n = 10; n > 0; --n) {
+        RunState result = failed.count(n) ? RunState::FAILED : RunState::SUCCESS;
+        runs.push_back({n, NOW - time_t(10 - n) * 86400, result});
+    }
+    return runs;
+}
+
+}
+
+TEST(RetentionTest, Unlimited) {
+    RetentionPolicy policy;
+    EXPECT_TRUE(expiredRuns(policy, daily(), NOW).empty());
+}
+
+TEST(RetentionTest, KeepRuns) {
+    RetentionPolicy policy;
+    policy.keepRuns = 7;
+    EXPECT_EQ(std::vector<uint>({3, 2, 1}), expiredRuns(policy, daily(), NOW));
+}
+
+TEST(RetentionTest, KeepDays) {
+    RetentionPolicy policy;
+    policy.keepDays = 2;
+    // completed exactly two days ago is still kept
+    EXPECT_EQ(std::vector<uint>({7, 6, 5, 4, 3, 2, 1}), expiredRuns(policy, daily(), NOW));
+}
+
+TEST(RetentionTest, EitherLimitKeeps) {
+    RetentionPolicy policy;
+    policy.keepRuns = 2;
+    policy.keepDays = 4;
+    EXPECT_EQ(std::vector<uint>({5, 4, 3, 2, 1}), expiredRuns(policy, daily(), NOW));
+}
+
+TEST(RetentionTest, KeepLastSuccess) {
+    RetentionPolicy policy;
+    policy.keepRuns = 2;
+    std::vector<CompletedRun> runs = daily({10, 9, 8, 7});
+    EXPECT_EQ(std::vector<uint>({8, 7, 5, 4, 3, 2, 1}), expiredRuns(policy, runs, NOW));
+    policy.keepLastSuccess = false;
+    EXPECT_EQ(std::vector<uint>({8, 7, 6, 5, 4, 3, 2, 1}), expiredRuns(policy, runs, NOW));
+}
@@ -120,3 +120,58 @@ TEST_F(RunTest, AbortAfterFailed) {
     wait();
     EXPECT_EQ(RunState::FAILED, run.result);
 }
+
+TEST_F(RunTest, EnvFile) {
+    char tmp[16] = "/tmp/lt.XXXXXX";
+    int fd = mkstemp(tmp);
+    std::string content = "foo=bar\nJOB=overridden\n";
+    write(fd, content.data(), content.size());
+    close(fd);
+    run.name = "job";
+    run.params["foo"] = "param";
+    run.addEnv(tmp);
+    run.addScript("/usr/bin/env");
+    runAll();
+    unlink(tmp);
+    StringMap map = parseFromString(readAllOutput());
+    EXPECT_EQ("bar", map["foo"]);
+    EXPECT_EQ("job", map["JOB"]);
+}
+
+TEST_F(RunTest, ResultPerStep) {
+    run.addScript("/bin/false");
+    run.addScript("/usr/bin/env");
+    ASSERT_FALSE(run.step());
+    wait();
+    close(run.output_fd);
+    runAll();
+    StringMap map = parseFromString(readAllOutput());
+    EXPECT_EQ("failed", map["RESULT"]);
+}
+
+TEST_F(RunTest, ExecFailure) {
+    run.addScript("/nonexistent");
+    runAll();
+    EXPECT_EQ(RunState::FAILED, run.result);
+    EXPECT_EQ("[laminar] Failed to execute /nonexistent\n", readAllOutput());
+}
+
+#ifdef LAMINAR_SUPERVISOR_PATH
+TEST_F(RunTest, Supervisor) {
+    run.supervisor = LAMINAR_SUPERVISOR_PATH;
+    run.addScript("/bin/false");
+    run.addScript("/usr/bin/env");
+    ASSERT_FALSE(run.step());
+    ASSERT_NE(-1, run.status_fd);
+    std::string output = readAllOutput();
+    char tmp[64];
+    for(ssize_t n = read(run.status_fd, tmp, 64); n > 0; n = read(run.status_fd, tmp, 64))
+        run.statusReceived(tmp, n);
+    wait();
+    EXPECT_EQ(RunState::FAILED, run.result);
+    // both scripts were executed by the single supervisor
+    EXPECT_TRUE(run.step());
+    StringMap map = parseFromString(output);
+    EXPECT_EQ("failed", map["RESULT"]);
+}
+#endif
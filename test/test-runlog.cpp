@@ -0,0 +1,202 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include "runlog.h"
+
+class RunLogTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        close(mkstemp(tmpFile));
+        ASSERT_TRUE(log.open(tmpFile));
+    }
+    void TearDown() override {
+        unlink(tmpFile);
+    }
+    RunLog log;
+    char tmpFile[32] = "/tmp/lt.XXXXXX";
+};
+
+TEST_F(RunLogTest, Empty) {
+    EXPECT_EQ(0, log.size());
+    EXPECT_EQ("", log.read());
+}
+
+TEST_F(RunLogTest, ReadLive) {
+    log.append("foo", 3);
+    EXPECT_EQ("foo", log.read());
+    log.append("bar", 3);
+    EXPECT_EQ("foobar", log.read());
+    EXPECT_EQ(6, log.size());
+}
+
+TEST_F(RunLogTest, Finished) {
+    std::string content;
+    for(int i = 0; i < 10000; ++i)
+        content += "line " + std::to_string(i) + "\n";
+    log.append(content.data(), content.size());
+    log.finish();
+    std::string zipped = log.compressed();
+    EXPECT_LT(zipped.size(), content.size());
+    std::string out;
+    ASSERT_TRUE(inflateLog(zipped.data(), zipped.size(), out));
+    EXPECT_EQ(content, out);
+}
+
+TEST_F(RunLogTest, Reopen) {
+    ASSERT_TRUE(log.open(tmpFile));
+    std::string content = "after reopening\n";
+    log.append(content.data(), content.size());
+    log.finish();
+    std::string zipped = log.compressed();
+    std::string out;
+    ASSERT_TRUE(inflateLog(zipped.data(), zipped.size(), out));
+    EXPECT_EQ(content, out);
+}
+
+TEST_F(RunLogTest, BoundedTail) {
+    std::string chunk(4096, 'x');
+    for(int i = 0; i < 100; ++i)
+        log.append(chunk.data(), chunk.size());
+    log.append("end", 3);
+    std::string tail = log.tail();
+    EXPECT_GE(65536, tail.size());
+    EXPECT_EQ("end", tail.substr(tail.size() - 3));
+    EXPECT_EQ(100 * chunk.size() + 3, log.read().size());
+}
+
+TEST_F(RunLogTest, MoveTo) {
+    log.append("foo", 3);
+    log.finish();
+    EXPECT_EQ(64, log.digest().size());
+    std::string dest = std::string(tmpFile) + ".moved";
+    ASSERT_TRUE(log.moveTo(dest));
+    EXPECT_NE(0, access(tmpFile, F_OK));
+    EXPECT_EQ("foo", log.read());
+    unlink(dest.c_str());
+}
+
+TEST_F(RunLogTest, MoveRemoved) {
+    log.append("foo", 3);
+    log.finish();
+    // simulate a script cleaning the rundir
+    unlink(tmpFile);
+    std::string dest = std::string(tmpFile) + ".moved";
+    ASSERT_TRUE(log.moveTo(dest));
+    EXPECT_EQ(0, access(dest.c_str(), F_OK));
+    unlink(dest.c_str());
+}
+
+namespace {
+// "line 0\n" to "line <n-1>\n", appended in chunks of about 4 KiB
+std::string appendLines(RunLog& log, int n) {
+    std::string content, chunk;
+    for(int i = 0; i < n; ++i) {
+        chunk += "line " + std::to_string(i) + "\n";
+        if(chunk.size() > 4096 || i == n - 1) {
+            log.append(chunk.data(), chunk.size());
+            content += chunk;
+            chunk.clear();
+        }
+    }
+    return content;
+}
+}
+
+TEST_F(RunLogTest, Slice) {
+    // more than one checkpoint
+    std::string content = appendLines(log, 200000);
+    ASSERT_LT(1, log.lineIndex().checkpoints.size());
+    std::string line150k = "line 150000\n";
+    uint64_t at = content.find(line150k);
+
+    LogSlice s;
+    LogRange r;
+    r.tail = 2;
+    ASSERT_TRUE(log.slice(r, s));
+    EXPECT_EQ("line 199998\nline 199999\n", s.text);
+    EXPECT_EQ(199998, s.line);
+    EXPECT_EQ(content.size() - s.text.size(), s.offset);
+    EXPECT_EQ(200000, s.lines);
+    EXPECT_EQ(content.size(), s.size);
+
+    s = LogSlice();
+    r = LogRange();
+    r.unit = LogRange::LINES;
+    r.first = 150000;
+    r.last = 150001;
+    ASSERT_TRUE(log.slice(r, s));
+    EXPECT_EQ(line150k, s.text);
+    EXPECT_EQ(at, s.offset);
+
+    s = LogSlice();
+    r = LogRange();
+    r.first = at + 5;
+    r.last = at + 11;
+    ASSERT_TRUE(log.slice(r, s));
+    EXPECT_EQ("150000", s.text);
+    EXPECT_EQ(150000, s.line);
+
+    // the rest of the log from an offset, limited
+    s = LogSlice();
+    r = LogRange();
+    r.first = at;
+    r.limit = 5;
+    ASSERT_TRUE(log.slice(r, s));
+    EXPECT_EQ("line ", s.text);
+
+    // after the end
+    s = LogSlice();
+    r = LogRange();
+    r.first = content.size();
+    ASSERT_TRUE(log.slice(r, s));
+    EXPECT_EQ("", s.text);
+    EXPECT_EQ(content.size(), s.offset);
+}
+
+TEST_F(RunLogTest, SliceStored) {
+    std::string content = appendLines(log, 200000);
+    log.append("partial", 7);
+    content += "partial";
+    log.finish();
+    std::string zipped = log.compressed();
+    std::string idx = std::string(tmpFile) + ".idx";
+    ASSERT_TRUE(log.lineIndex().write(idx));
+    LogLines index;
+    ASSERT_TRUE(index.read(idx));
+    unlink(idx.c_str());
+    EXPECT_EQ(log.lineIndex().checkpoints.size(), index.checkpoints.size());
+    EXPECT_EQ(200001, index.lines);
+
+    LogRange r;
+    r.unit = LogRange::LINES;
+    r.first = 199999;
+    const LogLines* indexes[] = { &index, nullptr };
+    for(const LogLines* i : indexes) {
+        LogSlice s;
+        ASSERT_TRUE(sliceLog(zipped.data(), zipped.size(), i, r, s));
+        EXPECT_EQ("line 199999\npartial", s.text);
+        EXPECT_EQ(content.size() - s.text.size(), s.offset);
+        EXPECT_EQ(200001, s.lines);
+    }
+    // the whole log
+    LogSlice s;
+    ASSERT_TRUE(sliceLog(zipped.data(), zipped.size(), &index, LogRange(), s));
+    EXPECT_EQ(content, s.text);
+}
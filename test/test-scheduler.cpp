@@ -0,0 +1,224 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include "scheduler.h"
+
+class SchedulerTest : public ::testing::Test {
+protected:
+    std::shared_ptr<Node> addNode(std::string name, int executors, std::set<std::string> tags = {}) {
+        std::shared_ptr<Node> node(new Node);
+        node->name = name;
+        node->numExecutors = executors;
+        node->tags = tags;
+        nodes[name] = node;
+        return node;
+    }
+    std::shared_ptr<::Run> queue(std::string name, int priority = 0) {
+        std::shared_ptr<::Run> run(new ::Run);
+        run->name = name;
+        run->priority = priority;
+        scheduler.queue(run);
+        return run;
+    }
+    // dispatches, recording the started runs as "job@node:queueIndex"
+    std::vector<std::string> dispatch() {
+        std::vector<std::string> started;
+        scheduler.dispatch([&](std::shared_ptr<Node> node, std::shared_ptr<::Run> run, int queueIndex){
+            started.push_back(run->name + "@" + node->name + ":" + std::to_string(queueIndex));
+            return true;
+        });
+        return started;
+    }
+    Scheduler scheduler;
+    NodeMap nodes;
+    TagMap jobTags;
+    DemandMap demands;
+};
+
+TEST_F(SchedulerTest, Fifo) {
+    addNode("n", 2);
+    scheduler.configure(nodes, jobTags);
+    std::shared_ptr<::Run> a = queue("a");
+    queue("b");
+    queue("c");
+    EXPECT_EQ(std::vector<std::string>({"a@n:0", "b@n:0"}), dispatch());
+    EXPECT_EQ(1, scheduler.queued().size());
+    EXPECT_EQ(2, nodes["n"]->busyExecutors);
+    scheduler.finished(a.get());
+    EXPECT_EQ(std::vector<std::string>({"c@n:0"}), dispatch());
+}
+
+TEST_F(SchedulerTest, Tags) {
+    addNode("tagged", 1, {"x"});
+    jobTags["t"] = {"x"};
+    scheduler.configure(nodes, jobTags);
+    // an untagged job cannot run on a tagged node, but does not block
+    // the tagged job queued after it
+    queue("u");
+    queue("t");
+    EXPECT_EQ(std::vector<std::string>({"t@tagged:1"}), dispatch());
+    EXPECT_EQ(1, scheduler.queuedCount("u"));
+    addNode("plain", 1);
+    scheduler.configure(nodes, jobTags);
+    EXPECT_EQ(std::vector<std::string>({"u@plain:0"}), dispatch());
+}
+
+TEST_F(SchedulerTest, FailedStart) {
+    addNode("n", 2);
+    scheduler.configure(nodes, jobTags);
+    queue("a");
+    queue("b");
+    std::vector<std::string> tried;
+    scheduler.dispatch([&](std::shared_ptr<Node>, std::shared_ptr<::Run> run, int){
+        tried.push_back(run->name);
+        return false;
+    });
+    // each run is tried once and remains queued
+    EXPECT_EQ(std::vector<std::string>({"a", "b"}), tried);
+    EXPECT_EQ(2, scheduler.queued().size());
+}
+
+TEST_F(SchedulerTest, Slots) {
+    addNode("n", 8);
+    demands["big"].slots = 6;
+    scheduler.configure(nodes, jobTags, demands);
+    queue("big");
+    queue("big");
+    queue("small");
+    queue("small");
+    // the second big run does not fit, but small runs may fill the node
+    EXPECT_EQ(std::vector<std::string>({"big@n:0", "small@n:1", "small@n:1"}), dispatch());
+    EXPECT_EQ(8, nodes["n"]->busyExecutors);
+}
+
+TEST_F(SchedulerTest, Resources) {
+    std::shared_ptr<Node> cpu = addNode("cpu", 4);
+    std::shared_ptr<Node> gpu = addNode("gpu", 4);
+    gpu->resources = parseResources("gpu:1");
+    demands["train"].resources = parseResources("gpu");
+    scheduler.configure(nodes, jobTags, demands);
+    std::shared_ptr<::Run> first = queue("train");
+    queue("train");
+    std::vector<std::string> started = dispatch();
+    EXPECT_EQ(std::vector<std::string>({"train@gpu:0"}), started);
+    EXPECT_EQ(1, gpu->busyResources["gpu"]);
+    scheduler.finished(first.get());
+    EXPECT_EQ(0, gpu->busyResources["gpu"]);
+    EXPECT_EQ(std::vector<std::string>({"train@gpu:0"}), dispatch());
+}
+
+TEST_F(SchedulerTest, Reservation) {
+    addNode("n", 4);
+    demands["big"].slots = 4;
+    std::map<std::string, uint> durations = {{"long", 1000}, {"longer", 2000}, {"short", 10}, {"big", 100}};
+    scheduler.setEstimator([&](const std::string& job){ return durations[job]; });
+    scheduler.configure(nodes, jobTags, demands);
+    queue("long");
+    EXPECT_EQ(std::vector<std::string>({"long@n:0"}), dispatch());
+    // big must wait for long, so it holds a reservation. A short run may
+    // backfill because it is expected to finish first, but a longer run
+    // would postpone big and must wait
+    queue("big");
+    queue("longer");
+    queue("short");
+    EXPECT_EQ(std::vector<std::string>({"short@n:2"}), dispatch());
+    EXPECT_EQ(2, scheduler.queued().size());
+}
+
+TEST_F(SchedulerTest, ReservationSpare) {
+    addNode("n", 4);
+    demands["half"].slots = 2;
+    demands["big"].slots = 3;
+    scheduler.configure(nodes, jobTags, demands);
+    std::shared_ptr<::Run> first = queue("half");
+    queue("half");
+    EXPECT_EQ(std::vector<std::string>({"half@n:0", "half@n:0"}), dispatch());
+    scheduler.finished(first.get());
+    // Big cannot start yet. Without estimates, no run is known to finish
+    // before it can, but one executor remains once it has started, which
+    // one other run may use in the meantime
+    queue("big");
+    queue("a");
+    queue("b");
+    EXPECT_EQ(std::vector<std::string>({"a@n:1"}), dispatch());
+    EXPECT_EQ(2, scheduler.queued().size());
+}
+
+TEST_F(SchedulerTest, Priority) {
+    addNode("n", 1);
+    scheduler.configure(nodes, jobTags);
+    queue("nightly", -1);
+    queue("a");
+    queue("urgent", 5);
+    queue("b");
+    // queueIndex counts from the front of the queue in dispatch order
+    EXPECT_EQ(std::vector<std::string>({"urgent@n:0"}), dispatch());
+    EXPECT_EQ("a", scheduler.queued().begin()->run->name);
+    EXPECT_EQ("nightly", scheduler.queued().rbegin()->run->name);
+}
+
+TEST_F(SchedulerTest, Coalesce) {
+    scheduler.configure(nodes, jobTags);
+    std::shared_ptr<::Run> a = queue("a");
+    a->params["rev"] = "1";
+    queue("b", 1);
+
+    ::Run other;
+    other.name = "a";
+    other.params["rev"] = "2";
+    EXPECT_EQ(nullptr, scheduler.coalesce(other));
+    other.params["rev"] = "1";
+    other.priority = 3;
+    bool raised = false;
+    EXPECT_EQ(a, scheduler.coalesce(other, &raised));
+    EXPECT_TRUE(raised);
+    // raised above b
+    EXPECT_EQ(3, a->priority);
+    EXPECT_EQ(a, scheduler.queued().begin()->run);
+    EXPECT_EQ(2, scheduler.queued().size());
+    // an equal priority leaves it as it is
+    raised = false;
+    EXPECT_EQ(a, scheduler.coalesce(other, &raised));
+    EXPECT_FALSE(raised);
+}
+
+TEST_F(SchedulerTest, ScanLimit) {
+    addNode("busy", 1, {"x"});
+    addNode("gpu", 1, {"y"});
+    addNode("free", 1, {"z"});
+    jobTags["t"] = {"x"};
+    jobTags["g"] = {"y"};
+    jobTags["u"] = {"z"};
+    // the node of g has no gpu
+    demands["g"].resources = parseResources("gpu");
+    scheduler.configure(nodes, jobTags, demands);
+    queue("t");
+    EXPECT_EQ(std::vector<std::string>({"t@busy:0"}), dispatch());
+    for(int i = 0; i < 1000; ++i) {
+        queue("t");
+        queue("g");
+    }
+    queue("u");
+    int estimated = 0;
+    scheduler.setEstimator([&](const std::string&){ estimated++; return 0; });
+    // Neither the class whose node is busy nor more than one run of the
+    // job which does not fit on its free node is examined
+    EXPECT_EQ(std::vector<std::string>({"u@free:2000"}), dispatch());
+    EXPECT_EQ(2, estimated);
+}
@@ -19,11 +19,15 @@
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 #include <boost/filesystem.hpp>
+#include <fstream>
+#include <map>
 #include <thread>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include "server.h"
 #include "log.h"
 #include "interface.h"
+#include "node.h"
 #include "laminar.capnp.h"
 
 namespace fs = boost::filesystem;
@@ -41,9 +45,24 @@ public:
     }
 };
 
+// An artefact served from memory. If absent, it behaves like a file
+// which does not exist
+class FakeMappedFile : public MappedFile {
+public:
+    FakeMappedFile(const std::string* content) : content(content) {}
+    const void* address() override { return content ? content->data() : nullptr; }
+    size_t size() override { return content ? content->size() : 0; }
+    std::string etag() override { return "\"v1\""; }
+    time_t mtime() override { return 1000000000; }
+private:
+    const std::string* content;
+};
+
 class MockLaminar : public LaminarInterface {
 public:
     LaminarClient* client = nullptr;
+    // served by getArtefact
+    std::map<std::string, std::string> artefacts;
     ~MockLaminar() {}
     virtual void registerClient(LaminarClient* c) override {
         ASSERT_EQ(nullptr, client);
@@ -57,16 +76,83 @@ public:
     }
 
     // MOCK_METHOD does not seem to work with return values whose destructors have noexcept(false)
-    kj::Own<MappedFile> getArtefact(std::string path) override { return kj::Own<MappedFile>(nullptr, kj::NullDisposer()); }
+    kj::Own<MappedFile> getArtefact(std::string path) override {
+        auto it = artefacts.find(path);
+        return kj::heap<FakeMappedFile>(it != artefacts.end() ? &it->second : nullptr);
+    }
+    kj::Own<MappedFile> getLog(std::string job, uint num) override { return kj::heap<FakeMappedFile>(nullptr); }
 
     MOCK_METHOD2(queueJob, std::shared_ptr<Run>(std::string name, ParamMap params));
     MOCK_METHOD1(registerWaiter, void(LaminarWaiter* waiter));
     MOCK_METHOD1(deregisterWaiter, void(LaminarWaiter* waiter));
     MOCK_METHOD1(sendStatus, void(LaminarClient* client));
+    MOCK_METHOD2(runInProgress, bool(std::string job, uint num));
     MOCK_METHOD4(setParam, bool(std::string job, uint buildNum, std::string param, std::string value));
     MOCK_METHOD0(getCustomCss, std::string());
+    MOCK_METHOD0(getMetrics, std::string());
+    MOCK_METHOD4(getLogSlice, bool(std::string job, uint num, const LogRange& range, LogSlice& slice));
+    MOCK_METHOD4(searchLogs, std::string(std::string query, std::string job, time_t from, time_t to));
     MOCK_METHOD0(abortAll, void());
-    MOCK_METHOD0(notifyConfigChanged, void());
+    MOCK_METHOD1(notifyConfigChanged, void(std::string path));
+    MOCK_METHOD4(registerAgent, bool(std::string name, int executors, std::set<std::string> tags, std::shared_ptr<Agent> agent));
+    MOCK_METHOD1(deregisterAgent, void(const Agent* agent));
+};
+
+// Stands in for a laminar-agent: records the scripts it is given, then
+// sends some output and the given exit statuses. If lost is set, the
+// agent disconnects instead
+class FakeAgent : public LaminarCi::Agent::Server {
+public:
+    std::vector<std::pair<std::string, bool>> scripts;
+    std::vector<int> statuses;
+    bool lost = false;
+
+    kj::Promise<void> execute(ExecuteContext context) override {
+        auto params = context.getParams();
+        for(auto s : params.getScripts())
+            scripts.emplace_back(s.getName(), s.getInit());
+        if(lost)
+            return KJ_EXCEPTION(DISCONNECTED, "agent lost");
+        LaminarCi::RunOutput::Client output = params.getOutput();
+        auto write = output.writeRequest();
+        write.setData(kj::arrayPtr(reinterpret_cast<const kj::byte*>("hello\n"), 6));
+        kj::Promise<void> sent = write.send().ignoreResult();
+        for(size_t i = 0; i < statuses.size(); ++i) {
+            sent = sent.then([output,i,this]() mutable {
+                auto status = output.statusRequest();
+                status.setScript(i);
+                status.setStatus(statuses[i]);
+                return status.send().ignoreResult();
+            });
+        }
+        return sent;
+    }
+
+    kj::Promise<void> abort(AbortContext context) override {
+        return kj::READY_NOW;
+    }
+};
+
+// Collects the log sent by tailLog. If stalled is set, writes are never
+// answered, like a client which stopped reading
+class FakeLogOutput : public LaminarCi::LogOutput::Server {
+public:
+    FakeLogOutput(std::string& log, bool stalled = false) :
+        log(log),
+        stalled(stalled)
+    {}
+
+    kj::Promise<void> write(WriteContext context) override {
+        auto data = context.getParams().getData();
+        log.append(reinterpret_cast<const char*>(data.begin()), data.size());
+        if(stalled)
+            return kj::NEVER_DONE;
+        return kj::READY_NOW;
+    }
+
+private:
+    std::string& log;
+    bool stalled;
 };
 
 class ServerTest : public ::testing::Test {
@@ -76,7 +162,7 @@ protected:
     {
     }
     void SetUp() override {
-        EXPECT_CALL(mockLaminar, registerWaiter(testing::_));
+        EXPECT_CALL(mockLaminar, registerWaiter(testing::_)).WillOnce(testing::SaveArg<0>(&waiter));
         EXPECT_CALL(mockLaminar, deregisterWaiter(testing::_));
         server = new Server(mockLaminar, "unix:"+fs::path(tempDir/"rpc.sock").string(), "127.0.0.1:8080");
     }
@@ -95,9 +181,71 @@ protected:
     }
 
     kj::Network& network() { return server->ioContext.provider->getNetwork(); }
+
+    // Sends a GET request with the given extra header lines and returns the
+    // whole response, headers included
+    std::string httpGet(std::string path, std::string headers = std::string()) {
+        if(!httpListening) {
+            waitForHttpReady();
+            httpListening = true;
+        }
+        std::string request = "GET " + path + " HTTP/1.1\r\nHost: localhost:8080\r\n" + headers + "\r\n";
+        kj::Own<kj::NetworkAddress> addr = network().parseAddress("localhost:8080").wait(ws());
+        kj::Own<kj::AsyncIoStream> stream = addr->connect().wait(ws());
+        stream->write(request.data(), request.size()).wait(ws());
+        std::string response;
+        char buf[4096];
+        for(;;) {
+            size_t end = response.find("\r\n\r\n");
+            if(end != std::string::npos) {
+                size_t length = 0;
+                size_t cl = response.find("Content-Length: ");
+                if(cl < end)
+                    length = strtoul(response.c_str() + cl + strlen("Content-Length: "), nullptr, 10);
+                if(response.size() >= end + 4 + length)
+                    return response;
+            }
+            size_t n = stream->tryRead(buf, 1, sizeof(buf)).wait(ws());
+            if(n == 0)
+                return response;
+            response.append(buf, n);
+        }
+    }
+    static std::string body(const std::string& response) {
+        return response.substr(response.find("\r\n\r\n") + 4);
+    }
+
+    // registers the fake as an agent and returns laminar's handle to it,
+    // which is only valid while session is held
+    std::shared_ptr<Agent> registerAgent(kj::Own<FakeAgent> fake, kj::Maybe<LaminarCi::AgentSession::Client>& session) {
+        std::shared_ptr<Agent> agent;
+        EXPECT_CALL(mockLaminar, registerAgent("agent", 1, std::set<std::string>(), testing::_))
+            .WillOnce(testing::DoAll(testing::SaveArg<3>(&agent), testing::Return(true)));
+        EXPECT_CALL(mockLaminar, deregisterAgent(testing::_));
+        auto req = client().registerAgentRequest();
+        req.setName("agent");
+        req.setExecutors(1);
+        req.setAgent(kj::mv(fake));
+        session = req.send().wait(ws()).getSession();
+        return agent;
+    }
+
+    // a run of job foo with an init script and a run script
+    void initRun(Run& run) {
+        run.name = "foo";
+        run.build = 1;
+        run.runDir = (tempDir/"foo"/"1").string();
+        std::ofstream((tempDir/"foo.init").string()) << "#!/bin/sh\n";
+        std::ofstream((tempDir/"foo.run").string()) << "#!/bin/sh\n";
+        run.addScript((tempDir/"foo.init").string(), (tempDir/"workspace").string(), true);
+        run.addScript((tempDir/"foo.run").string());
+    }
     TempDir tempDir;
     MockLaminar mockLaminar;
     Server* server;
+    // the rpc interface, which is told about completed runs
+    LaminarWaiter* waiter = nullptr;
+    bool httpListening = false;
 };
 
 TEST_F(ServerTest, RpcQueue) {
@@ -107,6 +255,154 @@ TEST_F(ServerTest, RpcQueue) {
     req.send().wait(ws());
 }
 
+TEST_F(ServerTest, RpcQueueBatch) {
+    auto req = client().queueBatchRequest();
+    auto jobs = req.initJobs(2);
+    jobs[0].setJobName("foo");
+    jobs[1].setJobName("bar");
+    auto params = jobs[1].initParams(1);
+    params[0].setName("x");
+    params[0].setValue("1");
+    EXPECT_CALL(mockLaminar, queueJob("foo", ParamMap())).Times(testing::Exactly(1));
+    EXPECT_CALL(mockLaminar, queueJob("bar", ParamMap({{"x", "1"}}))).Times(testing::Exactly(1));
+    auto results = req.send().wait(ws()).getResults();
+    ASSERT_EQ(2, results.size());
+    // the mock knows no jobs
+    EXPECT_EQ(LaminarCi::MethodResult::FAILED, results[0]);
+    EXPECT_EQ(LaminarCi::MethodResult::FAILED, results[1]);
+}
+
+TEST_F(ServerTest, RpcRunBatch) {
+    auto req = client().runBatchRequest();
+    auto jobs = req.initJobs(2);
+    jobs[0].setJobName("foo");
+    jobs[1].setJobName("bar");
+    std::shared_ptr<Run> run = std::make_shared<Run>();
+    run->name = "foo";
+    run->build = 3;
+    EXPECT_CALL(mockLaminar, queueJob("foo", ParamMap())).WillOnce(testing::Return(run));
+    EXPECT_CALL(mockLaminar, queueJob("bar", ParamMap()));
+    auto promise = req.send();
+    ws().poll();
+    ASSERT_NE(nullptr, waiter);
+    run->result = RunState::FAILED;
+    waiter->complete(run.get());
+
+    auto results = promise.wait(ws()).getResults();
+    ASSERT_EQ(2, results.size());
+    EXPECT_EQ("foo", std::string(results[0].getJobName()));
+    EXPECT_EQ(3, results[0].getBuildNum());
+    EXPECT_EQ(LaminarCi::JobResult::FAILED, results[0].getResult());
+    // the mock knows no job bar
+    EXPECT_EQ("bar", std::string(results[1].getJobName()));
+    EXPECT_EQ(LaminarCi::JobResult::UNKNOWN, results[1].getResult());
+}
+
+TEST_F(ServerTest, RpcTailLogActiveRun) {
+    std::string log;
+    EXPECT_CALL(mockLaminar, runInProgress("foo", 1)).WillOnce(testing::Return(true));
+    auto req = client().tailLogRequest();
+    req.setJobName("foo");
+    req.setBuildNum(1);
+    req.setOutput(kj::heap<FakeLogOutput>(log));
+    auto promise = req.send();
+    ws().poll();
+    ASSERT_NE(nullptr, mockLaminar.client);
+    ASSERT_NE(nullptr, waiter);
+    // output produced while the run is active
+    mockLaminar.client->sendMessage(std::make_shared<std::string>("line 1\n"));
+    mockLaminar.client->sendMessage(std::make_shared<std::string>("line 2\n"));
+    Run run;
+    run.name = "foo";
+    run.build = 1;
+    waiter->complete(&run);
+
+    // returns once all output has been received
+    promise.wait(ws());
+    EXPECT_EQ("line 1\nline 2\n", log);
+    EXPECT_EQ(nullptr, mockLaminar.client);
+}
+
+TEST_F(ServerTest, RpcTailLogSlowClient) {
+    std::string log;
+    EXPECT_CALL(mockLaminar, runInProgress("foo", 1)).WillOnce(testing::Return(true));
+    auto req = client().tailLogRequest();
+    req.setJobName("foo");
+    req.setBuildNum(1);
+    req.setOutput(kj::heap<FakeLogOutput>(log, true));
+    auto promise = req.send();
+    ws().poll();
+    ASSERT_NE(nullptr, mockLaminar.client);
+    // more than the default queue limit, none of which is acknowledged
+    Message chunk = std::make_shared<std::string>(1024 * 1024, 'x');
+    for(int i = 0; i < 16 && mockLaminar.client; ++i) {
+        mockLaminar.client->sendMessage(chunk);
+        ws().poll();
+    }
+    // the client is dropped rather than the output queued without bound
+    EXPECT_ANY_THROW(promise.wait(ws()));
+    EXPECT_EQ(nullptr, mockLaminar.client);
+}
+
+TEST_F(ServerTest, HttpRange) {
+    mockLaminar.artefacts["a.txt"] = "0123456789";
+    std::string response = httpGet("/archive/a.txt", "Range: bytes=2-4\r\n");
+    EXPECT_EQ(0, response.find("HTTP/1.1 206"));
+    EXPECT_NE(std::string::npos, response.find("Content-Range: bytes 2-4/10\r\n"));
+    EXPECT_EQ("234", body(response));
+
+    response = httpGet("/archive/a.txt", "Range: bytes=7-\r\n");
+    EXPECT_NE(std::string::npos, response.find("Content-Range: bytes 7-9/10\r\n"));
+    EXPECT_EQ("789", body(response));
+}
+
+TEST_F(ServerTest, HttpRangeUnsatisfiable) {
+    mockLaminar.artefacts["a.txt"] = "0123456789";
+    // starts past the end of the file
+    std::string response = httpGet("/archive/a.txt", "Range: bytes=10-\r\n");
+    EXPECT_EQ(0, response.find("HTTP/1.1 416"));
+    EXPECT_NE(std::string::npos, response.find("Content-Range: bytes */10\r\n"));
+}
+
+TEST_F(ServerTest, HttpNotModified) {
+    mockLaminar.artefacts["a.txt"] = "0123456789";
+    std::string response = httpGet("/archive/a.txt", "If-None-Match: \"v1\"\r\n");
+    EXPECT_EQ(0, response.find("HTTP/1.1 304"));
+    EXPECT_EQ("", body(response));
+    // the weak comparison applies
+    response = httpGet("/archive/a.txt", "If-None-Match: \"v0\", W/\"v1\"\r\n");
+    EXPECT_EQ(0, response.find("HTTP/1.1 304"));
+
+    response = httpGet("/archive/a.txt", "If-None-Match: \"v0\"\r\n");
+    EXPECT_EQ(0, response.find("HTTP/1.1 200"));
+    EXPECT_EQ("0123456789", body(response));
+}
+
+TEST_F(ServerTest, HttpGzipSibling) {
+    mockLaminar.artefacts["a.txt"] = "0123456789";
+    mockLaminar.artefacts["a.txt.gz"] = "compressed";
+    std::string response = httpGet("/archive/a.txt", "Accept-Encoding: deflate, gzip\r\n");
+    EXPECT_EQ(0, response.find("HTTP/1.1 200"));
+    EXPECT_NE(std::string::npos, response.find("Content-Encoding: gzip\r\n"));
+    EXPECT_NE(std::string::npos, response.find("Vary: Accept-Encoding\r\n"));
+    EXPECT_EQ("compressed", body(response));
+
+    // explicitly refused
+    response = httpGet("/archive/a.txt", "Accept-Encoding: gzip;q=0\r\n");
+    EXPECT_EQ(std::string::npos, response.find("Content-Encoding"));
+    EXPECT_NE(std::string::npos, response.find("Vary: Accept-Encoding\r\n"));
+    EXPECT_EQ("0123456789", body(response));
+
+    response = httpGet("/archive/a.txt");
+    EXPECT_NE(std::string::npos, response.find("Vary: Accept-Encoding\r\n"));
+    EXPECT_EQ("0123456789", body(response));
+
+    // without a sibling the response does not vary
+    mockLaminar.artefacts["b.txt"] = "0123456789";
+    response = httpGet("/archive/b.txt", "Accept-Encoding: gzip\r\n");
+    EXPECT_EQ(std::string::npos, response.find("Vary"));
+}
+
 // Tests that agressively closed websockets are properly removed
 // and will not be attempted to be contacted again
 TEST_F(ServerTest, HttpWebsocketRST) {
@@ -145,3 +441,53 @@ TEST_F(ServerTest, HttpWebsocketRST) {
     // try to write to the closed file descriptor, causing an exception
     EXPECT_EQ(nullptr, mockLaminar.client);
 }
+
+TEST_F(ServerTest, AgentExecute) {
+    auto fake = kj::heap<FakeAgent>();
+    FakeAgent* f = fake.get();
+    f->statuses = {0, W_EXITCODE(2, 0)};
+    kj::Maybe<LaminarCi::AgentSession::Client> session;
+    std::shared_ptr<Agent> agent = registerAgent(kj::mv(fake), session);
+    ASSERT_TRUE(agent);
+
+    Run run;
+    initRun(run);
+    std::string output;
+    agent->execute(run, [&](const char* b, size_t n){
+        output.append(b, n);
+    }).wait(ws());
+
+    ASSERT_EQ(2, f->scripts.size());
+    EXPECT_EQ(std::make_pair(std::string("foo.init"), true), f->scripts[0]);
+    EXPECT_EQ(std::make_pair(std::string("foo.run"), false), f->scripts[1]);
+    EXPECT_EQ("hello\n", output);
+    // the status of the second script fails the run
+    EXPECT_EQ(RunState::FAILED, run.result);
+}
+
+TEST_F(ServerTest, AgentExecuteSuccess) {
+    auto fake = kj::heap<FakeAgent>();
+    fake->statuses = {0, 0};
+    kj::Maybe<LaminarCi::AgentSession::Client> session;
+    std::shared_ptr<Agent> agent = registerAgent(kj::mv(fake), session);
+    ASSERT_TRUE(agent);
+
+    Run run;
+    initRun(run);
+    agent->execute(run, [](const char*, size_t){}).wait(ws());
+    EXPECT_EQ(RunState::SUCCESS, run.result);
+}
+
+TEST_F(ServerTest, AgentLost) {
+    auto fake = kj::heap<FakeAgent>();
+    fake->lost = true;
+    kj::Maybe<LaminarCi::AgentSession::Client> session;
+    std::shared_ptr<Agent> agent = registerAgent(kj::mv(fake), session);
+    ASSERT_TRUE(agent);
+
+    Run run;
+    initRun(run);
+    // the run fails rather than the promise being rejected
+    agent->execute(run, [](const char*, size_t){}).wait(ws());
+    EXPECT_EQ(RunState::FAILED, run.result);
+}
@@ -0,0 +1,43 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include "sha256.h"
+
+TEST(Sha256Test, Empty) {
+    EXPECT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", Sha256().hexdigest());
+}
+
+TEST(Sha256Test, Short) {
+    Sha256 h;
+    h.update("abc", 3);
+    EXPECT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", h.hexdigest());
+}
+
+TEST(Sha256Test, Incremental) {
+    // one million 'a' characters, added in uneven pieces
+    std::string chunk(999, 'a');
+    Sha256 h;
+    size_t n = 0;
+    while(n + chunk.size() <= 1000000) {
+        h.update(chunk.data(), chunk.size());
+        n += chunk.size();
+    }
+    h.update(chunk.data(), 1000000 - n);
+    EXPECT_EQ("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", h.hexdigest());
+}
@@ -0,0 +1,90 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include <set>
+#include "subscriptions.h"
+
+class TestClient : public LaminarClient {
+public:
+    TestClient(MonitorScope s) { scope = s; }
+    ~TestClient() noexcept override {}
+    void sendMessage(Message) override {}
+};
+
+class SubscriptionsTest : public ::testing::Test {
+protected:
+    SubscriptionsTest() :
+        home(MonitorScope(MonitorScope::HOME)),
+        job(MonitorScope(MonitorScope::JOB, "foo")),
+        run(MonitorScope(MonitorScope::RUN, "foo", 1)),
+        otherRun(MonitorScope(MonitorScope::RUN, "foo", 2)),
+        log(MonitorScope(MonitorScope::LOG, "foo", 1))
+    {
+        for(LaminarClient* c : {&home, &job, &run, &otherRun, &log})
+            subs.add(c);
+    }
+    std::set<LaminarClient*> status(const std::string& name, uint num) {
+        std::set<LaminarClient*> result;
+        subs.forStatus(name, num, [&](LaminarClient* c){ result.insert(c); });
+        return result;
+    }
+    Subscriptions subs;
+    TestClient home, job, run, otherRun, log;
+};
+
+TEST_F(SubscriptionsTest, Status) {
+    EXPECT_EQ(std::set<LaminarClient*>({&home, &job, &run}), status("foo", 1));
+    EXPECT_EQ(std::set<LaminarClient*>({&home}), status("bar", 1));
+}
+
+TEST_F(SubscriptionsTest, RunsOf) {
+    std::set<LaminarClient*> result;
+    subs.forRunsOf("foo", [&](LaminarClient* c){ result.insert(c); });
+    EXPECT_EQ(std::set<LaminarClient*>({&run, &otherRun}), result);
+}
+
+TEST_F(SubscriptionsTest, Log) {
+    int n = 0;
+    subs.forLog("foo", 1, [&](LaminarClient* c){ EXPECT_EQ(&log, c); n++; });
+    subs.forLog("foo", 2, [&](LaminarClient*){ n++; });
+    EXPECT_EQ(1, n);
+    EXPECT_TRUE(subs.watchingLog("foo", 1));
+    EXPECT_FALSE(subs.watchingLog("foo", 2));
+    EXPECT_FALSE(subs.watchingLog("bar", 1));
+}
+
+TEST_F(SubscriptionsTest, Remove) {
+    subs.remove(&run);
+    subs.remove(&home);
+    EXPECT_EQ(std::set<LaminarClient*>({&job}), status("foo", 1));
+    subs.remove(&log);
+    int n = 0;
+    subs.forLog("foo", 1, [&](LaminarClient*){ n++; });
+    EXPECT_EQ(0, n);
+    EXPECT_FALSE(subs.watchingLog("foo", 1));
+}
+
+TEST_F(SubscriptionsTest, Count) {
+    EXPECT_EQ(2, subs.count(MonitorScope::RUN));
+    subs.remove(&run);
+    subs.remove(&run);
+    EXPECT_EQ(1, subs.count(MonitorScope::RUN));
+    EXPECT_EQ(1, subs.count(MonitorScope::HOME));
+    EXPECT_EQ(0, subs.count(MonitorScope::ALL));
+}
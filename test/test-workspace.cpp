@@ -0,0 +1,91 @@
+///
+/// Copyright 2018 Oliver Giles
+///
+/// This file is part of Laminar
+///
+/// Laminar is free software: you can redistribute it and/or modify
+/// it under the terms of the GNU General Public License as published by
+/// the Free Software Foundation, either version 3 of the License, or
+/// (at your option) any later version.
+///
+/// Laminar is distributed in the hope that it will be useful,
+/// but WITHOUT ANY WARRANTY; without even the implied warranty of
+/// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+/// GNU General Public License for more details.
+///
+/// You should have received a copy of the GNU General Public License
+/// along with Laminar.  If not, see <http://www.gnu.org/licenses/>
+///
+#include <gtest/gtest.h>
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include "workspace.h"
+
+namespace fs = boost::filesystem;
+
+class WorkspaceTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        dir = fs::temp_directory_path() / fs::unique_path("lt-workspace-%%%%%%");
+        fs::create_directories(dir/"base"/"src"/"empty");
+    }
+    void TearDown() override {
+        fs::remove_all(dir);
+    }
+    void write(std::string name, std::string content) {
+        std::ofstream((dir/"base"/name).string()) << content;
+    }
+    std::string read(std::string name) {
+        std::ifstream f((dir/"clone"/name).string());
+        std::stringstream ss;
+        ss << f.rdbuf();
+        return ss.str();
+    }
+    static struct stat info(fs::path path) {
+        struct stat st;
+        lstat(path.c_str(), &st);
+        return st;
+    }
+    fs::path dir;
+};
+
+TEST_F(WorkspaceTest, ClonesTree) {
+    write("top", "top level");
+    write("src/main.c", "int main() {}");
+    fs::create_symlink("src/main.c", dir/"base"/"link");
+    chmod((dir/"base"/"top").c_str(), 0751);
+    // older than anything created by the clone
+    fs::last_write_time(dir/"base"/"src"/"main.c", 1000000);
+
+    CloneStats stats;
+    ASSERT_TRUE(cloneTree((dir/"base").string(), (dir/"clone").string(), stats));
+    EXPECT_EQ(2, stats.files);
+    EXPECT_EQ("top level", read("top"));
+    EXPECT_EQ("int main() {}", read("src/main.c"));
+    EXPECT_TRUE(fs::is_directory(dir/"clone"/"src"/"empty"));
+    EXPECT_EQ(fs::path("src/main.c"), fs::read_symlink(dir/"clone"/"link"));
+    EXPECT_EQ(0751, info(dir/"clone"/"top").st_mode & 07777);
+    EXPECT_EQ(1000000, fs::last_write_time(dir/"clone"/"src"/"main.c"));
+    EXPECT_EQ(info(dir/"base"/"src").st_mtime, info(dir/"clone"/"src").st_mtime);
+}
+
+TEST_F(WorkspaceTest, CloneIsIndependent) {
+    write("file", "original");
+    CloneStats stats;
+    ASSERT_TRUE(cloneTree((dir/"base").string(), (dir/"clone").string(), stats));
+    std::ofstream((dir/"clone"/"file").string()) << "changed";
+    std::ifstream f((dir/"base"/"file").string());
+    std::string content;
+    f >> content;
+    EXPECT_EQ("original", content);
+    EXPECT_NE(info(dir/"base"/"file").st_ino, info(dir/"clone"/"file").st_ino);
+}
+
+TEST_F(WorkspaceTest, DestinationMustNotExist) {
+    fs::create_directory(dir/"clone");
+    CloneStats stats;
+    EXPECT_FALSE(cloneTree((dir/"base").string(), (dir/"clone").string(), stats));
+    EXPECT_FALSE(cloneTree((dir/"missing").string(), (dir/"other").string(), stats));
+}